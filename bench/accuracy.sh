@@ -0,0 +1,101 @@
+#!/bin/bash
+# Simulate reads with known adapter positions, trim them with every search mode, and report
+# the reads/sec and the precision and recall of the trim positions.
+#
+# usage: bench/accuracy.sh [-n pairs] [-l length] [-f adapters.fa] [-o outdir] [-t tolerance] [-x "fast-adapter-trimming options"] [-- extra fat-simulate options]
+#
+# A read is a true positive if we trimmed it within tolerance bp of where the adapter starts.
+# 	precision = true positives / reads we trimmed
+# 	recall    = true positives / reads that have an adapter
+
+set -euo pipefail
+
+PAIRS=100000
+LEN=150
+ADAPTERS=adapters/IlluminaAdapters.fa
+OUT=accuracy
+TOL=0
+FAT=bin/fast-adapter-trimming
+SIM=bin/fat-simulate
+FATFLAGS=""
+
+while getopts "n:l:f:o:t:x:h" opt; do
+	case $opt in
+		n) PAIRS=$OPTARG ;;
+		l) LEN=$OPTARG ;;
+		f) ADAPTERS=$OPTARG ;;
+		o) OUT=$OPTARG ;;
+		t) TOL=$OPTARG ;;
+		x) FATFLAGS=$OPTARG ;;
+		*) sed -n '2,9p' "$0" | sed 's/^# \?//'; exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+for exe in $FAT $SIM; do
+	if [ ! -x "$exe" ]; then
+		echo "Please run make all simulate first: we need $exe" >&2
+		exit 1
+	fi
+done
+
+mkdir -p "$OUT"
+echo "Simulating $PAIRS pairs of $LEN bp reads with adapters from $ADAPTERS" >&2
+$SIM -f "$ADAPTERS" -n "$PAIRS" -l "$LEN" -1 "$OUT/R1.fastq.gz" -2 "$OUT/R2.fastq.gz" -t "$OUT/truth.tsv" "$@"
+
+# score one output file against column col of the truth table. The outputs are in the same
+# order as the inputs, and with -l 0 the only reads that are missing were trimmed to nothing,
+# or their mate was. Those are in the discarded file, with the length we trimmed them to.
+score() {
+	local fq=$1 col=$2 discarded=$3
+	gzip -dc "$fq" | awk -v truth="$OUT/truth.tsv" -v col="$col" -v len="$LEN" -v tol="$TOL" -v discarded="gzip -dc $discarded" '
+		BEGIN {
+			getline hdr < truth
+			while ((discarded | getline line) > 0) {
+				n++
+				if (n % 4 == 1) { split(line, f, " "); dname = substr(f[1], 2) }
+				if (n % 4 == 2) dlen[dname] = length(line)
+			}
+		}
+		NR % 4 == 1 { name = substr($1, 2) }
+		NR % 4 == 2 {
+			while ((getline line < truth) > 0) {
+				split(line, t, "\t")
+				if (t[1] == name) { check(t[col], length($0)); next }
+				check(t[col], dlen[t[1]])
+			}
+		}
+		END {
+			while ((getline line < truth) > 0) { split(line, t, "\t"); check(t[col], dlen[t[1]]) }
+			p = predicted ? tp / predicted : 1
+			r = actual ? tp / actual : 1
+			printf "%d\t%d\t%d\t%.4f\t%.4f\n", actual, predicted, tp, p, r
+		}
+		function check(want, got,   trim) {
+			trim = got < len ? got : -1
+			if (want >= 0) actual++
+			if (trim >= 0) predicted++
+			if (want >= 0 && trim >= 0 && (trim - want <= tol && want - trim <= tol)) tp++
+		}'
+}
+
+printf "mode\tseconds\treads_per_s\tread\tadapters\ttrimmed\ttrue_positives\tprecision\trecall\n" | tee "$OUT/summary.tsv"
+for mode in fast nothreads paired_end; do
+	case $mode in
+		fast) flags="" ;;
+		nothreads) flags="--nothreads" ;;
+		paired_end) flags="--paired_end" ;;
+	esac
+	start=$(date +%s.%N)
+	$FAT -1 "$OUT/R1.fastq.gz" -2 "$OUT/R2.fastq.gz" -f "$ADAPTERS" -p "$OUT/$mode.R1.fastq.gz" -q "$OUT/$mode.R2.fastq.gz" \
+		-j "$OUT/$mode.R1.matches.tsv" -k "$OUT/$mode.R2.matches.tsv" --discarded-out "$OUT/$mode.discarded.fastq.gz" \
+		-l 0 $flags $FATFLAGS > "$OUT/$mode.log" 2>&1
+	end=$(date +%s.%N)
+	secs=$(awk -v s="$start" -v e="$end" 'BEGIN { printf "%.2f", e - s }')
+	rps=$(awk -v s="$secs" -v n="$PAIRS" 'BEGIN { printf "%.0f", (s > 0 ? 2 * n / s : 0) }')
+	for read in R1 R2; do
+		col=3
+		[ $read = R2 ] && col=4
+		printf "%s\t%s\t%s\t%s\t%s\n" "$mode" "$secs" "$rps" "$read" "$(score "$OUT/$mode.$read.fastq.gz" $col "$OUT/$mode.discarded.$read.fastq.gz")" | tee -a "$OUT/summary.tsv"
+	done
+done
@@ -0,0 +1,377 @@
+/*
+ * Microbenchmarks for the encoding and lookup kernels.
+ *
+ * We make some random reads (with adapters inserted into some of them), and then time each of
+ * the kernels over those reads for each adapter file. Run with make bench, or
+ *
+ * 	bin/fat-bench [-n reads] [-l read length] [-s seed] adapters/truseq.fa adapters/nebnext_adapters.fa
+ *
+ * We report the ns per call and, for the kernels that run over whole reads, the reads per second.
+ */
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "colours.h"
+#include "definitions.h"
+#include "kseq.h"
+#include "primer-index.h"
+#include "primer-match-counts.h"
+#include "primers.h"
+#include "rob_dna.h"
+#include "search-read.h"
+#include "seqs_to_ints.h"
+#include "structs.h"
+
+KSEQ_INIT(gzFile, gzread);
+
+// stop the compiler optimising away the work
+static volatile uint64_t sink;
+
+static double now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void report(char *adapters, char *kernel, char *engine, uint64_t ops, int nreads, double secs) {
+	printf("%-34s %-24s %-8s %12lu %10.2f", adapters, kernel, engine, ops, secs * 1e9 / ops);
+	if (nreads > 0)
+		printf(" %14.0f\n", nreads / secs);
+	else
+		printf(" %14s\n", "-");
+}
+
+/*
+ * Read the adapter sequences so we can put them in our reads
+ */
+static int read_adapters(char *file, char ***adapters) {
+	gzFile fp = gzopen(file, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "%sERROR: Can not open %s%s\n", RED, file, ENDC);
+		exit(3);
+	}
+	kseq_t *seq = kseq_init(fp);
+	int n = 0;
+	int size = 16;
+	*adapters = malloc(sizeof(char *) * size);
+	while (kseq_read(seq) >= 0) {
+		if (n == size) {
+			size *= 2;
+			*adapters = realloc(*adapters, sizeof(char *) * size);
+		}
+		(*adapters)[n++] = strdup(seq->seq.s);
+	}
+	kseq_destroy(seq);
+	gzclose(fp);
+	return n;
+}
+
+/*
+ * Random reads. Half of them have an adapter starting somewhere in the read
+ */
+static char **make_reads(int nreads, int len, char **adapters, int nadapters) {
+	char **reads = malloc(sizeof(char *) * nreads);
+	char *bases = "ACGT";
+	for (int i=0; i<nreads; i++) {
+		reads[i] = malloc(len + 1);
+		for (int j=0; j<len; j++)
+			reads[i][j] = bases[rand() % 4];
+		reads[i][len] = '\0';
+		if (nadapters && i % 2 == 0) {
+			char *a = adapters[rand() % nadapters];
+			int start = rand() % len;
+			for (int j=0; a[j] && start + j < len; j++)
+				reads[i][start + j] = a[j];
+		}
+	}
+	return reads;
+}
+
+/*
+ * The index engines that we can search with. Each engine has a name and a lookup
+ * that says whether an encoding of length k (whose reverse complement is rcenc) is a primer.
+ */
+typedef struct engine {
+	char *name;
+	bool (*lookup)(primer_index_t *, int, uint64_t, uint64_t);
+} engine_t;
+
+static bool bst_lookup(primer_index_t *idx, int k, uint64_t enc, uint64_t rcenc) {
+	return find_primer(enc, idx->all_primers[k]) != NULL;
+}
+
+static bool flat_lookup(primer_index_t *idx, int k, uint64_t enc, uint64_t rcenc) {
+	bool partner;
+	return primer_lookup(idx, k, enc, rcenc, &partner) != NULL;
+}
+
+static engine_t engines[] = {
+	{"bst", bst_lookup},
+	{"flat", flat_lookup},
+};
+static int nengines = sizeof(engines) / sizeof(engines[0]);
+
+static void bench_adapters(char *adapterfile, char **reads, int nreads, int len) {
+	char *label = strrchr(adapterfile, '/') ? strrchr(adapterfile, '/') + 1 : adapterfile;
+
+	struct options opt = {0};
+	opt.primers = adapterfile;
+	opt.maxkmer = MAXKMER;
+	opt.min_adapter_length = 6;
+	opt.min_sequence_length = 100;
+	opt.reverse = true;
+	opt.mismatches = 1;
+	opt.batch_width = SEARCH_WIDTH;
+
+	double start = now();
+	primer_index_t *idx = build_primer_index(&opt);
+	report(label, "build_primer_index", "flat", 1, 0, now() - start);
+
+	// how long it takes to start from a prebuilt index instead
+	char indexfile[] = "/tmp/fat-bench-XXXXXX";
+	int fd = mkstemp(indexfile);
+	if (fd >= 0) {
+		close(fd);
+		save_primer_index(idx, indexfile);
+		start = now();
+		primer_index_t *loaded = load_primer_index(indexfile);
+		report(label, "load_primer_index", "flat", 1, 0, now() - start);
+		free_primer_index(loaded);
+		unlink(indexfile);
+	}
+
+	int k = idx->unique_kmer_count ? idx->kmer_lengths[0] : MAXKMER;
+	int windows = len - k + 1;
+	uint64_t acc = 0;
+
+	// kmer_encoding at every position
+	start = now();
+	for (int i=0; i<nreads; i++)
+		for (int p=0; p<windows; p++)
+			acc += kmer_encoding(reads[i], p, k);
+	report(label, "kmer_encoding", "-", (uint64_t) nreads * windows, nreads, now() - start);
+
+	// next_kmer_encoding rolling along each read
+	start = now();
+	for (int i=0; i<nreads; i++) {
+		uint64_t enc = kmer_encoding(reads[i], 0, k);
+		for (int p=1; p<windows; p++) {
+			enc = next_kmer_encoding(reads[i], p, k, enc);
+			acc += enc;
+		}
+	}
+	report(label, "next_kmer_encoding", "-", (uint64_t) nreads * (windows - 1), nreads, now() - start);
+
+	// the encoding pre-pass that search_read does on every read
+	uint8_t *codes = malloc(len);
+	start = now();
+	for (int i=0; i<nreads; i++) {
+		acc += encode_read(reads[i], len, codes);
+		acc += codes[i % len];
+	}
+	report(label, "encode_read", "-", nreads, nreads, now() - start);
+	free(codes);
+
+	// the quality trimming (--qual-window 4 --qual-threshold 20) over qualities that drop off
+	// along the read, like they do on an Illumina run
+	char *qual = malloc(len + 1);
+	for (int j=0; j<len; j++)
+		qual[j] = 33 + 40 - 30 * j / len - rand() % 8;
+	qual[len] = '\0';
+	start = now();
+	for (int i=0; i<nreads; i++) {
+		qual[i % len] ^= 1;
+		acc += quality_trim(qual, len, 4, 20);
+	}
+	report(label, "quality_trim", "-", nreads, nreads, now() - start);
+	free(qual);
+
+	// the poly-G tails (--poly-g 10) on reads that end in a third of Gs with a few errors in them
+	char *tailed = malloc(len + 1);
+	memcpy(tailed, reads[0], len + 1);
+	for (int j=len - len / 3; j<len; j++)
+		tailed[j] = rand() % 12 ? 'G' : 'A';
+	start = now();
+	for (int i=0; i<nreads; i++) {
+		tailed[i % (len / 3)] ^= 4;
+		acc += poly_tail(tailed, len, 'G', 8);
+	}
+	report(label, "poly_tail", "-", nreads, nreads, now() - start);
+	free(tailed);
+
+	// keep the encodings so we time the lookups and not the encoding
+	uint64_t nenc = (uint64_t) nreads * windows;
+	uint64_t *encodings = malloc(sizeof(uint64_t) * nenc);
+	for (int i=0; i<nreads; i++) {
+		uint64_t enc = kmer_encoding(reads[i], 0, k);
+		encodings[(uint64_t) i * windows] = enc;
+		for (int p=1; p<windows; p++) {
+			enc = next_kmer_encoding(reads[i], p, k, enc);
+			encodings[(uint64_t) i * windows + p] = enc;
+		}
+	}
+
+	uint64_t *rcencodings = malloc(sizeof(uint64_t) * nenc);
+	start = now();
+	for (uint64_t e=0; e<nenc; e++)
+		rcencodings[e] = reverse_complement(encodings[e], k);
+	report(label, "reverse_complement", "-", nenc, 0, now() - start);
+
+	for (int g=0; g<nengines; g++) {
+		uint64_t found = 0;
+		start = now();
+		for (uint64_t e=0; e<nenc; e++)
+			if (engines[g].lookup(idx, k, encodings[e], rcencodings[e]))
+				found++;
+		report(label, "find_primer", engines[g].name, nenc, nreads, now() - start);
+		acc += found;
+	}
+	free(encodings);
+	free(rcencodings);
+
+	// the whole search, one read at a time
+	search_hit_t *hits = malloc(sizeof(search_hit_t) * nreads);
+	start = now();
+	for (int i=0; i<nreads; i++)
+		search_read(idx, &opt, reads[i], len, &hits[i]);
+	report(label, "search_read", "flat", nreads, nreads, now() - start);
+
+	// and with the main scans compiled for this read length (if there are any for these primers)
+	struct options kernelopt = opt;
+	select_search_kernels(idx, &kernelopt);
+	if (kernelopt.kernels) {
+		search_hit_t *kernelhits = malloc(sizeof(search_hit_t) * nreads);
+		start = now();
+		for (int i=0; i<nreads; i++)
+			search_read(idx, &kernelopt, reads[i], len, &kernelhits[i]);
+		report(label, "search_read", "special", nreads, nreads, now() - start);
+		for (int i=0; i<nreads; i++)
+			if (kernelhits[i].trim != hits[i].trim || kernelhits[i].id != hits[i].id) {
+				fprintf(stderr, "%sERROR: the specialized kernel trimmed read %d at %d but the generic one trimmed it at %d%s\n", RED, i, kernelhits[i].trim, hits[i].trim, ENDC);
+				exit(EXIT_FAILURE);
+			}
+		free(kernelhits);
+	}
+
+	// the whole search a batch at a time, with different numbers of reads searched together.
+	// These should find exactly the same adapters as search_read
+	read_batch_t batch = {nreads, nreads, calloc(nreads, sizeof(fastq_record_t)), malloc(sizeof(search_hit_t) * nreads)};
+	for (int i=0; i<nreads; i++) {
+		batch.reads[i].seq.s = reads[i];
+		batch.reads[i].seq.l = len;
+	}
+	int widths[] = {1, 4, 8, 16, 32};
+	for (int w=0; w<sizeof(widths)/sizeof(widths[0]); w++) {
+		struct options batchopt = opt;
+		batchopt.batch_width = widths[w];
+		char engine[16];
+		snprintf(engine, sizeof(engine), "w%d", widths[w]);
+		start = now();
+		search_batch(idx, &batchopt, &batch);
+		report(label, "search_batch", engine, nreads, nreads, now() - start);
+		for (int i=0; i<nreads; i++)
+			if (batch.hits[i].trim != hits[i].trim || batch.hits[i].id != hits[i].id) {
+				fprintf(stderr, "%sERROR: search_batch with width %d trimmed read %d at %d but search_read trimmed it at %d%s\n", RED, widths[w], i, batch.hits[i].trim, hits[i].trim, ENDC);
+				exit(EXIT_FAILURE);
+			}
+	}
+
+	// and allowing 2 mismatches, which also looks up the seeds when the primers and their SNPs miss
+	struct options seedopt = opt;
+	seedopt.mismatches = 2;
+	primer_index_t *seedidx = build_primer_index(&seedopt);
+	search_hit_t *seedhits = malloc(sizeof(search_hit_t) * nreads);
+	start = now();
+	for (int i=0; i<nreads; i++)
+		search_read(seedidx, &seedopt, reads[i], len, &seedhits[i]);
+	report(label, "search_read", "seed-d2", nreads, nreads, now() - start);
+	seedopt.batch_width = 16;
+	start = now();
+	search_batch(seedidx, &seedopt, &batch);
+	report(label, "search_batch", "seed-w16", nreads, nreads, now() - start);
+	free(seedhits);
+	free_primer_index(seedidx);
+	free(batch.reads);
+	free(batch.hits);
+
+	// count the primers that we found
+	primer_counts_t *pc = calloc(1, sizeof(primer_counts_t));
+	char name[MAXNAMELEN];
+	uint64_t counted = 0;
+	start = now();
+	for (int i=0; i<nreads; i++)
+		if (hits[i].trim > -1) {
+			count_primer_occurrence(pc, hit_name(&hits[i], name, MAXNAMELEN), hits[i].before, hits[i].after);
+			counted++;
+		}
+	if (counted)
+		report(label, "count_primer_occurrence", "-", counted, 0, now() - start);
+	free(hits);
+
+	sink += acc;
+	free_primer_index(idx);
+}
+
+void help() {
+	printf("USAGE: fat-bench [-n reads] [-l read length] [-s seed] adapters.fa [adapters.fa ...]\n");
+	printf("\nTime the encoding and lookup kernels of fast-adapter-trimming\n");
+	printf("-n number of synthetic reads (default 20000)\n");
+	printf("-l length of the synthetic reads (default 150)\n");
+	printf("-s random seed (default 42)\n");
+}
+
+int main(int argc, char *argv[]) {
+	int nreads = 20000;
+	int len = 150;
+	int seed = 42;
+
+	int gopt;
+	while ((gopt = getopt(argc, argv, "n:l:s:h")) != -1) {
+		switch (gopt) {
+			case 'n':
+				nreads = atoi(optarg);
+				break;
+			case 'l':
+				len = atoi(optarg);
+				break;
+			case 's':
+				seed = atoi(optarg);
+				break;
+			default:
+				help();
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (optind >= argc) {
+		help();
+		exit(EXIT_FAILURE);
+	}
+	if (len <= MAXKMER) {
+		fprintf(stderr, "%sERROR: The reads need to be longer than %d bp%s\n", RED, MAXKMER, ENDC);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("%-34s %-24s %-8s %12s %10s %14s\n", "adapters", "kernel", "engine", "ops", "ns/op", "reads/sec");
+	for (int f=optind; f<argc; f++) {
+		srand(seed);
+		char **adapters;
+		int nadapters = read_adapters(argv[f], &adapters);
+		char **reads = make_reads(nreads, len, adapters, nadapters);
+		bench_adapters(argv[f], reads, nreads, len);
+		for (int i=0; i<nreads; i++)
+			free(reads[i]);
+		free(reads);
+		for (int i=0; i<nadapters; i++)
+			free(adapters[i]);
+		free(adapters);
+	}
+	return 0;
+}
@@ -0,0 +1,59 @@
+#!/usr/bin/env python3
+"""
+Draw doc/img/wall_time.png and doc/img/memory.png from the CSV written by bench/scaling.py.
+Like the originals, the x-axis is the compressed input size in MB, and there is one series per tool (and mode).
+"""
+
+import argparse
+import csv
+import os
+import sys
+from collections import defaultdict
+
+try:
+    import matplotlib
+    matplotlib.use("Agg")
+    import matplotlib.pyplot as plt
+except ImportError:
+    sys.exit("Please install matplotlib to draw the plots")
+
+
+def scatter(series, ycol, scale, title, ylabel, outfile):
+    fig, ax = plt.subplots(figsize=(10, 6))
+    for label, rows in sorted(series.items()):
+        x = [float(r["input_mb"]) for r in rows]
+        y = [float(r[ycol]) * scale for r in rows]
+        ax.scatter(x, y, label=label)
+    ax.set_title(title, loc="left", color="grey", fontsize=18)
+    ax.set_xlabel("File size (mb)")
+    ax.set_ylabel(ylabel)
+    ax.set_ylim(bottom=0)
+    ax.grid(True, color="lightgrey")
+    ax.legend(loc="upper center", ncol=len(series), frameon=False, bbox_to_anchor=(0.5, 1.1))
+    fig.tight_layout()
+    fig.savefig(outfile, dpi=200)
+    print(f"Wrote {outfile}", file=sys.stderr)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("-c", "--csv", default="scaling/scaling.csv", help="results from bench/scaling.py")
+    parser.add_argument("-o", "--outdir", default="doc/img", help="where to write the plots")
+    args = parser.parse_args()
+
+    series = defaultdict(list)
+    with open(args.csv) as f:
+        for r in csv.DictReader(f):
+            if r["exit"] != "0":
+                continue
+            series[f"{r['tool']} {r['mode']}".strip()].append(r)
+    if not series:
+        sys.exit(f"There are no successful runs in {args.csv}")
+
+    os.makedirs(args.outdir, exist_ok=True)
+    scatter(series, "wall_s", 1, "Wall clock time", "Time (seconds)", os.path.join(args.outdir, "wall_time.png"))
+    scatter(series, "max_rss_mb", 1 / 1024, "Memory", "Memory used (Gb)", os.path.join(args.outdir, "memory.png"))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,165 @@
+#!/usr/bin/env python3
+"""
+Run fast-adapter-trimming over a ladder of input sizes and record the wall time, CPU time,
+peak memory and I/O of every run, so that we can regenerate doc/img/wall_time.png and
+doc/img/memory.png (with bench/plot-scaling.py) and check the scaling before we roll out a new version.
+
+By default we simulate the inputs with bin/fat-simulate (make simulate) and run the default,
+--nothreads, and --paired_end searches. Use --mode to add other runs, e.g. when there are thread counts:
+
+    bench/scaling.py --sizes 100000,1000000,10000000 --mode fast --mode 'threads8=--threads 8'
+
+and --command to compare with other tools, e.g.
+
+    bench/scaling.py --command 'cutadapt=cutadapt -a file:{adapters} -A file:{adapters} -o {out1} -p {out2} {R1} {R2}'
+
+We measure each run with wait4(), so the CPU time and peak RSS include the gzip processes that
+we write through. I/O bytes are from /proc/<pid>/io, which only counts the main process, so we
+also record the size of the input and output files.
+"""
+
+import argparse
+import csv
+import os
+import shlex
+import subprocess
+import sys
+import time
+
+FAT = "bin/fast-adapter-trimming"
+SIM = "bin/fat-simulate"
+
+COLUMNS = ["tool", "mode", "pairs", "reads", "input_mb", "repeat", "wall_s", "user_s", "sys_s", "cpu_s",
+           "cpu_percent", "max_rss_mb", "rchar", "wchar", "read_bytes", "write_bytes", "output_mb", "exit"]
+
+DEFAULT_MODES = {
+    "fast": "",
+    "nothreads": "--nothreads",
+    "paired_end": "--paired_end",
+}
+
+
+def read_io(pid):
+    """Read the I/O counters for a process that has exited but not been reaped"""
+    io = {}
+    try:
+        with open(f"/proc/{pid}/io") as f:
+            for line in f:
+                k, v = line.split(":")
+                io[k.strip()] = int(v)
+    except (OSError, ValueError):
+        pass
+    return io
+
+
+def measure(cmd, log):
+    """Run cmd and return the wall time, the rusage, the I/O counters and the exit code"""
+    start = time.perf_counter()
+    p = subprocess.Popen(cmd, stdout=log, stderr=subprocess.STDOUT)
+    # wait without reaping, so that /proc/<pid>/io still has the final counts
+    io = {}
+    if hasattr(os, "waitid") and hasattr(os, "WNOWAIT"):
+        os.waitid(os.P_PID, p.pid, os.WEXITED | os.WNOWAIT)
+        io = read_io(p.pid)
+    _, status, ru = os.wait4(p.pid, 0)
+    wall = time.perf_counter() - start
+    p.returncode = os.waitstatus_to_exitcode(status)
+    return wall, ru, io, p.returncode
+
+
+def file_mb(*files):
+    return sum(os.path.getsize(f) for f in files if os.path.exists(f)) / 1e6
+
+
+def simulate(outdir, pairs, args):
+    r1 = os.path.join(outdir, f"sim_{pairs}_R1.fastq.gz")
+    r2 = os.path.join(outdir, f"sim_{pairs}_R2.fastq.gz")
+    truth = os.path.join(outdir, f"sim_{pairs}_truth.tsv")
+    if not (os.path.exists(r1) and os.path.exists(r2)):
+        print(f"Simulating {pairs} pairs", file=sys.stderr)
+        subprocess.run([SIM, "-f", args.adapters, "-n", str(pairs), "-l", str(args.length),
+                        "-1", r1, "-2", r2, "-t", truth, "-s", str(args.seed)], check=True)
+    return r1, r2
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--sizes", default="10000,100000,1000000", help="comma separated numbers of read pairs to simulate")
+    parser.add_argument("--inputs", action="append", default=[],
+                        help="use existing files instead of simulating them: R1,R2 (may be repeated)")
+    parser.add_argument("--mode", action="append", default=[],
+                        help="name or name=extra fast-adapter-trimming options (default: fast, nothreads, paired_end)")
+    parser.add_argument("--command", action="append", default=[],
+                        help="name=command to run another tool. {R1} {R2} {out1} {out2} {adapters} are replaced")
+    parser.add_argument("-f", "--adapters", default="adapters/IlluminaAdapters.fa", help="adapter file")
+    parser.add_argument("-l", "--length", type=int, default=150, help="simulated read length")
+    parser.add_argument("-r", "--repeats", type=int, default=1, help="how many times to run each combination")
+    parser.add_argument("-s", "--seed", type=int, default=42, help="seed for the simulated reads")
+    parser.add_argument("-d", "--outdir", default="scaling", help="directory for the reads, trimmed output and logs")
+    parser.add_argument("-o", "--csv", default="scaling/scaling.csv", help="results file")
+    args = parser.parse_args()
+
+    os.makedirs(args.outdir, exist_ok=True)
+
+    runs = []
+    for m in args.mode or DEFAULT_MODES:
+        name, _, flags = m.partition("=")
+        if not flags and name in DEFAULT_MODES:
+            flags = DEFAULT_MODES[name]
+        runs.append(("fast-adapter-trimming", name,
+                     f"{FAT} -1 {{R1}} -2 {{R2}} -f {{adapters}} -p {{out1}} -q {{out2}} -j /dev/null -k /dev/null {flags}"))
+    for c in args.command:
+        name, _, cmd = c.partition("=")
+        if not cmd:
+            sys.exit(f"--command needs name=command, not {c}")
+        runs.append((name, "", cmd))
+
+    inputs = []
+    for i in args.inputs:
+        r1, _, r2 = i.partition(",")
+        inputs.append((None, r1, r2))
+    if not args.inputs:
+        if not os.path.exists(SIM):
+            sys.exit(f"Please run make simulate first: we need {SIM}")
+        for pairs in [int(x) for x in args.sizes.split(",") if x]:
+            inputs.append((pairs, *simulate(args.outdir, pairs, args)))
+
+    new_file = not os.path.exists(args.csv)
+    with open(args.csv, "a", newline="") as out:
+        writer = csv.DictWriter(out, fieldnames=COLUMNS)
+        if new_file:
+            writer.writeheader()
+        for pairs, r1, r2 in inputs:
+            input_mb = file_mb(r1, r2)
+            for tool, mode, template in runs:
+                label = f"{tool}.{mode}" if mode else tool
+                for rep in range(args.repeats):
+                    out1 = os.path.join(args.outdir, f"{label}_{os.path.basename(r1)}")
+                    out2 = os.path.join(args.outdir, f"{label}_{os.path.basename(r2)}")
+                    cmd = shlex.split(template.format(R1=r1, R2=r2, out1=out1, out2=out2, adapters=args.adapters))
+                    with open(os.path.join(args.outdir, f"{label}_{os.path.basename(r1)}.log"), "w") as log:
+                        wall, ru, io, code = measure(cmd, log)
+                    cpu = ru.ru_utime + ru.ru_stime
+                    row = {
+                        "tool": tool, "mode": mode, "pairs": pairs if pairs is not None else "",
+                        "reads": 2 * pairs if pairs is not None else "", "input_mb": f"{input_mb:.2f}",
+                        "repeat": rep, "wall_s": f"{wall:.3f}", "user_s": f"{ru.ru_utime:.3f}",
+                        "sys_s": f"{ru.ru_stime:.3f}", "cpu_s": f"{cpu:.3f}",
+                        "cpu_percent": f"{100 * cpu / wall:.0f}" if wall > 0 else "",
+                        # ru_maxrss is in KB on linux
+                        "max_rss_mb": f"{ru.ru_maxrss / 1024:.1f}",
+                        "rchar": io.get("rchar", ""), "wchar": io.get("wchar", ""),
+                        "read_bytes": io.get("read_bytes", ""), "write_bytes": io.get("write_bytes", ""),
+                        "output_mb": f"{file_mb(out1, out2):.2f}", "exit": code,
+                    }
+                    writer.writerow(row)
+                    out.flush()
+                    print(f"{label}\t{os.path.basename(r1)}\t{input_mb:.1f} MB\t{wall:.2f} s\t{ru.ru_maxrss / 1024:.1f} MB"
+                          + ("" if code == 0 else f"\texit {code}"), file=sys.stderr)
+                    for f in (out1, out2):
+                        if os.path.exists(f):
+                            os.remove(f)
+
+
+if __name__ == "__main__":
+    main()
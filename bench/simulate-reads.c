@@ -0,0 +1,329 @@
+/*
+ * Simulate paired end reads with adapters at known positions so that we can measure
+ * how fast, and how accurately, we trim them.
+ *
+ * Each pair is a random fragment of length insert. If the insert is shorter than the read,
+ * the sequencer reads through the fragment into the adapter, so R1 is
+ * 	fragment + R1 adapter + random bases
+ * and R2 is
+ * 	reverse complement(fragment) + R2 adapter + random bases
+ * and both reads should be trimmed at position insert.
+ *
+ * The truth table has one line per pair:
+ * 	name insert R1_trim R2_trim R1_adapter R2_adapter R1_adapter_subs R2_adapter_subs R1_overlap R2_overlap
+ * where trim is -1 if there is no adapter in the read, and overlap is how many bases of the adapter are in the read.
+ */
+
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "colours.h"
+#include "kseq.h"
+
+KSEQ_INIT(gzFile, gzread);
+
+typedef struct adapter {
+	char *name;
+	char *seq;
+	int len;
+} adapter_t;
+
+// xorshift64* is plenty random for this and much faster than rand()
+static uint64_t rng_state = 88172645463325252ULL;
+
+static inline uint64_t rng() {
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ULL;
+}
+
+static inline double rng_uniform() {
+	return (rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double rng_normal(double mean, double sd) {
+	double u1 = rng_uniform();
+	double u2 = rng_uniform();
+	if (u1 < 1e-300)
+		u1 = 1e-300;
+	return mean + sd * sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+}
+
+static const char *bases = "ACGT";
+
+static char complement(char c) {
+	switch (c) {
+		case 'A': return 'T';
+		case 'C': return 'G';
+		case 'G': return 'C';
+		case 'T': return 'A';
+		default: return 'N';
+	}
+}
+
+static char substitute(char c) {
+	// a different base to c
+	char b;
+	do {
+		b = bases[rng() & 3];
+	} while (b == c);
+	return b;
+}
+
+static int read_adapters(char *file, adapter_t **adapters) {
+	gzFile fp = gzopen(file, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "%sERROR: Can not open %s%s\n", RED, file, ENDC);
+		exit(3);
+	}
+	kseq_t *seq = kseq_init(fp);
+	int n = 0;
+	int size = 16;
+	*adapters = malloc(sizeof(adapter_t) * size);
+	while (kseq_read(seq) >= 0) {
+		if (n == size) {
+			size *= 2;
+			*adapters = realloc(*adapters, sizeof(adapter_t) * size);
+		}
+		(*adapters)[n].name = strdup(seq->name.s);
+		(*adapters)[n].seq = strdup(seq->seq.s);
+		(*adapters)[n].len = seq->seq.l;
+		n++;
+	}
+	kseq_destroy(seq);
+	gzclose(fp);
+	return n;
+}
+
+/*
+ * Fill read with the insert (fragment), then the adapter (with up to max_subs substitutions), then random bases.
+ * Returns the number of substitutions we made in the part of the adapter that is in the read.
+ */
+static int build_read(char *read, int len, char *fragment, int insert, adapter_t *a, int subs) {
+	int p = 0;
+	for (; p < len && p < insert; p++)
+		read[p] = fragment[p];
+	int adapter_start = p;
+	for (int j = 0; p < len && j < a->len; j++, p++)
+		read[p] = a->seq[j];
+	int visible = p - adapter_start;
+	for (; p < len; p++)
+		read[p] = bases[rng() & 3];
+	read[len] = '\0';
+
+	int made = 0;
+	for (int s = 0; s < subs && visible > 0; s++) {
+		int posn = adapter_start + (rng() % visible);
+		read[posn] = substitute(read[posn]);
+		made++;
+	}
+	return made;
+}
+
+static void add_errors(char *read, char *qual, int len, double error_rate) {
+	for (int p = 0; p < len; p++) {
+		if (rng_uniform() < error_rate) {
+			read[p] = substitute(read[p]);
+			qual[p] = '#'; // errors usually have low quality
+		}
+	}
+}
+
+static void fill_quality(char *qual, int len) {
+	// mostly high quality that drops off a bit towards the 3' end
+	for (int p = 0; p < len; p++) {
+		int q = 38 - (p * 8 / len) - (int) (rng() % 4);
+		qual[p] = (char) (33 + q);
+	}
+	qual[len] = '\0';
+}
+
+void help() {
+	printf("USAGE: fat-simulate -f adapters.fa -1 R1.fastq.gz -2 R2.fastq.gz -t truth.tsv [options]\n");
+	printf("\nSimulate paired end reads with adapters at known positions\n");
+	printf("-f --adapters fasta file of adapters to insert (%srequired%s)\n", RED, ENDC);
+	printf("-1 --R1 R1 output file (%srequired%s). Compressed if it ends .gz\n", RED, ENDC);
+	printf("-2 --R2 R2 output file (%srequired%s)\n", RED, ENDC);
+	printf("-t --truth truth table (%srequired%s)\n", RED, ENDC);
+	printf("-n --pairs number of read pairs (default 100000)\n");
+	printf("-l --length read length (default 150)\n");
+	printf("-i --insert mean insert size (default 200)\n");
+	printf("-d --sd standard deviation of the insert size (default 80)\n");
+	printf("-e --error per base substitution error rate (default 0.001)\n");
+	printf("-m --adapter-subs maximum number of substitutions in an adapter (default 1)\n");
+	printf("-a --adapter-sub-fraction fraction of adapters that have substitutions (default 0.1)\n");
+	printf("-p --partial fraction of pairs whose insert puts only part of the adapter at the 3' end (default 0.05)\n");
+	printf("-c --level gzip compression level (default 1)\n");
+	printf("-s --seed random seed (default 42)\n");
+}
+
+int main(int argc, char *argv[]) {
+	char *adapter_file = NULL;
+	char *R1_file = NULL;
+	char *R2_file = NULL;
+	char *truth_file = NULL;
+	long pairs = 100000;
+	int len = 150;
+	double insert_mean = 200;
+	double insert_sd = 80;
+	double error_rate = 0.001;
+	int max_subs = 1;
+	double sub_fraction = 0.1;
+	double partial = 0.05;
+	int level = 1;
+	uint64_t seed = 42;
+
+	static struct option long_options[] = {
+		{"adapters", required_argument, 0, 'f'},
+		{"R1", required_argument, 0, '1'},
+		{"R2", required_argument, 0, '2'},
+		{"truth", required_argument, 0, 't'},
+		{"pairs", required_argument, 0, 'n'},
+		{"length", required_argument, 0, 'l'},
+		{"insert", required_argument, 0, 'i'},
+		{"sd", required_argument, 0, 'd'},
+		{"error", required_argument, 0, 'e'},
+		{"adapter-subs", required_argument, 0, 'm'},
+		{"adapter-sub-fraction", required_argument, 0, 'a'},
+		{"partial", required_argument, 0, 'p'},
+		{"level", required_argument, 0, 'c'},
+		{"seed", required_argument, 0, 's'},
+		{0, 0, 0, 0}
+	};
+	int gopt;
+	int option_index = 0;
+	while ((gopt = getopt_long(argc, argv, "f:1:2:t:n:l:i:d:e:m:a:p:c:s:h", long_options, &option_index)) != -1) {
+		switch (gopt) {
+			case 'f': adapter_file = strdup(optarg); break;
+			case '1': R1_file = strdup(optarg); break;
+			case '2': R2_file = strdup(optarg); break;
+			case 't': truth_file = strdup(optarg); break;
+			case 'n': pairs = atol(optarg); break;
+			case 'l': len = atoi(optarg); break;
+			case 'i': insert_mean = atof(optarg); break;
+			case 'd': insert_sd = atof(optarg); break;
+			case 'e': error_rate = atof(optarg); break;
+			case 'm': max_subs = atoi(optarg); break;
+			case 'a': sub_fraction = atof(optarg); break;
+			case 'p': partial = atof(optarg); break;
+			case 'c': level = atoi(optarg); break;
+			case 's': seed = strtoull(optarg, NULL, 10); break;
+			default: help();
+				 exit(EXIT_FAILURE);
+		}
+	}
+	if (!adapter_file || !R1_file || !R2_file || !truth_file) {
+		help();
+		exit(EXIT_FAILURE);
+	}
+	if (len < 1) {
+		fprintf(stderr, "%sERROR: The read length must be positive%s\n", RED, ENDC);
+		exit(EXIT_FAILURE);
+	}
+	rng_state ^= seed * 0x9E3779B97F4A7C15ULL;
+	if (rng_state == 0)
+		rng_state = 88172645463325252ULL;
+
+	adapter_t *adapters;
+	int nadapters = read_adapters(adapter_file, &adapters);
+	if (nadapters == 0) {
+		fprintf(stderr, "%sERROR: There are no adapters in %s%s\n", RED, adapter_file, ENDC);
+		exit(EXIT_FAILURE);
+	}
+
+	char mode[8];
+	sprintf(mode, "wb%d", level);
+	gzFile out1 = gzopen(R1_file, strstr(R1_file, ".gz") ? mode : "wT");
+	gzFile out2 = gzopen(R2_file, strstr(R2_file, ".gz") ? mode : "wT");
+	FILE *truth = fopen(truth_file, "w");
+	if (out1 == NULL || out2 == NULL || truth == NULL) {
+		fprintf(stderr, "%sERROR: Can not open the output files%s\n", RED, ENDC);
+		exit(3);
+	}
+	gzbuffer(out1, 1 << 20);
+	gzbuffer(out2, 1 << 20);
+	fprintf(truth, "name\tinsert\tR1_trim\tR2_trim\tR1_adapter\tR2_adapter\tR1_adapter_subs\tR2_adapter_subs\tR1_overlap\tR2_overlap\n");
+
+	int maxlen = 0;
+	for (int i = 0; i < nadapters; i++)
+		if (adapters[i].len > maxlen)
+			maxlen = adapters[i].len;
+
+	char *fragment = malloc(len + 1);
+	char *rcfragment = malloc(len + 1);
+	char *r1 = malloc(len + 1);
+	char *r2 = malloc(len + 1);
+	char *q1 = malloc(len + 1);
+	char *q2 = malloc(len + 1);
+
+	for (long n = 0; n < pairs; n++) {
+		adapter_t *a1 = &adapters[rng() % nadapters];
+		adapter_t *a2 = &adapters[rng() % nadapters];
+
+		int insert;
+		if (rng_uniform() < partial) {
+			// only the start of the adapter fits at the 3' end of the read
+			int shortest = a1->len < a2->len ? a1->len : a2->len;
+			if (shortest > len)
+				shortest = len;
+			insert = len - 1 - (int) (rng() % (shortest > 1 ? shortest - 1 : 1));
+		} else {
+			insert = (int) lround(rng_normal(insert_mean, insert_sd));
+		}
+		if (insert < 0)
+			insert = 0;
+
+		// we only need as much of the fragment as we can read
+		int readable = insert < len ? insert : len;
+		for (int p = 0; p < readable; p++)
+			fragment[p] = bases[rng() & 3];
+		// R2 starts at the other end of the fragment. If the insert is longer than the read
+		// we never see that end, so it can be any sequence
+		if (insert <= len) {
+			for (int p = 0; p < insert; p++)
+				rcfragment[p] = complement(fragment[insert - 1 - p]);
+		} else {
+			for (int p = 0; p < len; p++)
+				rcfragment[p] = bases[rng() & 3];
+		}
+
+		int subs1 = rng_uniform() < sub_fraction ? 1 + (int) (rng() % max_subs) : 0;
+		int subs2 = rng_uniform() < sub_fraction ? 1 + (int) (rng() % max_subs) : 0;
+		if (max_subs <= 0)
+			subs1 = subs2 = 0;
+		subs1 = build_read(r1, len, fragment, insert, a1, subs1);
+		subs2 = build_read(r2, len, rcfragment, insert, a2, subs2);
+
+		fill_quality(q1, len);
+		fill_quality(q2, len);
+		add_errors(r1, q1, len, error_rate);
+		add_errors(r2, q2, len, error_rate);
+
+		int trim = insert < len ? insert : -1;
+		int overlap1 = trim < 0 ? 0 : (len - insert < a1->len ? len - insert : a1->len);
+		int overlap2 = trim < 0 ? 0 : (len - insert < a2->len ? len - insert : a2->len);
+
+		gzprintf(out1, "@sim%ld 1:N:0:1\n%s\n+\n%s\n", n, r1, q1);
+		gzprintf(out2, "@sim%ld 2:N:0:1\n%s\n+\n%s\n", n, r2, q2);
+		fprintf(truth, "sim%ld\t%d\t%d\t%d\t%s\t%s\t%d\t%d\t%d\t%d\n", n, insert, trim, trim,
+				trim < 0 ? "-" : a1->name, trim < 0 ? "-" : a2->name, subs1, subs2, overlap1, overlap2);
+	}
+
+	gzclose(out1);
+	gzclose(out2);
+	fclose(truth);
+	free(fragment);
+	free(rcfragment);
+	free(r1);
+	free(r2);
+	free(q1);
+	free(q2);
+	return 0;
+}
@@ -0,0 +1,53 @@
+
+#ifndef FAST_SEARCH_ARENA_H
+#define FAST_SEARCH_ARENA_H
+
+#include <stddef.h>
+
+/*
+ * A bump allocator. We hand out memory from big chunks and never free any of it
+ * until we are done, and then we free all of it in one go with arena_destroy.
+ * We use this to build the primer index, which makes lots of small things that
+ * all live exactly as long as the index does.
+ */
+
+typedef struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	char data[] __attribute__ ((aligned (16)));
+} arena_chunk_t;
+
+typedef struct arena {
+	arena_chunk_t *chunks;  // the chunk that we are using is first
+	size_t chunk_size;      // the default size of new chunks
+	size_t allocated;       // how many bytes we have handed out
+	size_t reserved;        // how many bytes we have malloc'd
+} arena_t;
+
+/*
+ * Create an arena whose first chunk is size bytes
+ */
+arena_t *arena_create(size_t size);
+
+/*
+ * Make sure that the next size bytes come from one chunk
+ */
+void arena_reserve(arena_t *a, size_t size);
+
+/*
+ * Get n bytes of memory (aligned to 16 bytes). Exits if we run out of memory.
+ */
+void *arena_alloc(arena_t *a, size_t n);
+
+/*
+ * sprintf into the arena
+ */
+char *arena_sprintf(arena_t *a, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+
+/*
+ * Free everything in the arena, and the arena
+ */
+void arena_destroy(arena_t *a);
+
+#endif
@@ -1,9 +1,10 @@
 #ifndef CREATE_SNPS_H
 #define CREATE_SNPS_H
 
+#include "arena.h"
 #include "structs.h"
 
-void create_all_snps(char *, int, char*, kmer_bst_t *, bool);
+void create_all_snps(char *, int, uint32_t, kmer_bst_t *, arena_t *, char **, bool);
 
 #endif
 
@@ -7,5 +7,35 @@
 // how long should our lines be. This is a 64k buffer
 #define MAXLINELEN 65536
 
+// the most mismatches we allow between a primer and the read (--mismatches)
+#define MAXMISMATCHES 4
+
+// the longest primer name we print (including its SNP)
+#define MAXNAMELEN 1024
+
+// reads up to this long are encoded on the stack when we search them
+#define READ_CODES 1024
+
+// how many reads we read, search, and write at a time
+#define READ_BATCH_SIZE 4096
+
+// the longest --qual-window. We add up 16 windows at a time in 16 bits
+#define MAXQUALWINDOW 256
+
+// the longest --umi-len or --umi-pattern
+#define MAXUMILEN 64
+
+// the most --shards. Each one is a writer (two with R1 and R2)
+#define MAXSHARDS 1000
+
+// --external-pairs splits the reads into 2^this partitions by the hash of their names
+#define PAIR_PARTITION_BITS 10
+
+// the most --out-threads for each output
+#define MAXOUTTHREADS 64
+
+// how many reads of a batch we search together so their lookups overlap (--batch-width)
+#define SEARCH_WIDTH 1
+
 
 #endif
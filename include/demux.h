@@ -0,0 +1,55 @@
+#ifndef FAST_SEARCH_DEMUX_H
+#define FAST_SEARCH_DEMUX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "arena.h"
+#include "structs.h"
+#include "writer.h"
+
+/*
+ * Inline barcode demultiplexing (--demux barcodes.fa --demux-out DIR).
+ *
+ * The barcodes are all the same length and are at the start of R1 (after the UMI if there is
+ * one). We keep them, and all of their SNPs (create_all_snps), in a tree like the primers, so
+ * a read matches a barcode with up to 1 mismatch with one lookup. Each barcode has its own
+ * writer for R1 (and R2), and the reads that don't match one go to "unassigned".
+ */
+
+typedef struct demux {
+	int n;                // how many barcodes. Barcode n is unassigned
+	int k;                // how long they are
+	int mismatches;       // 1, or 0 if two barcodes are too close together to tell apart with a mismatch
+	char **names;
+	kmer_bst_t *barcodes; // the barcodes and their SNPs
+	arena_t *arena;
+	writer_t **out[2];    // the writers for R1 and R2 for each barcode (and unassigned)
+	uint64_t *reads;      // how many reads (or pairs) we sent to each barcode
+} demux_t;
+
+/*
+ * Read the barcodes and open a writer for each of them in dir (in opt->out_format). We only open
+ * the R2 writers if paired
+ */
+demux_t *demux_open(char *barcodefile, char *dir, bool paired, struct options *opt);
+
+/*
+ * Which barcode the read starts with, or d->n if it doesn't start with one. We remove the
+ * barcode from the read so that we search (and write) the rest of it
+ */
+int demux_read(demux_t *d, fastq_record_t *read);
+
+/*
+ * Where to write the reads with barcode b. stream is PROGRESS_R1 or PROGRESS_R2
+ */
+static inline FILE *demux_out(demux_t *d, int stream, int b) {
+	return d->out[stream][b]->fp;
+}
+
+/*
+ * Close all the writers, print how many reads had each barcode, and free the memory
+ */
+void demux_close(demux_t *d);
+
+#endif
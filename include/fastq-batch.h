@@ -0,0 +1,76 @@
+
+#ifndef FAST_SEARCH_FASTQ_BATCH_H
+#define FAST_SEARCH_FASTQ_BATCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "structs.h"
+
+/*
+ * Read fastq files a batch at a time.
+ *
+ * fastq_reader_t wraps the gzFile (or zstd stream) and kseq so that the search modes don't need their own
+ * KSEQ_INIT, and so that we can time how long we spend inflating the data.
+ */
+
+typedef struct fastq_reader fastq_reader_t;
+
+/*
+ * Open a fastq file. It can be gzip (or bgzf) compressed, zstd compressed if we were built with
+ * make ZSTD=1, or not compressed at all. Returns NULL if we can't open it
+ */
+fastq_reader_t *fastq_open(char *filename);
+
+/*
+ * Read up to batch->size reads into batch. Returns the number of reads, 0 at the end of the file
+ */
+int fastq_read_batch(fastq_reader_t *reader, read_batch_t *batch);
+
+/*
+ * How far through the compressed file we are
+ */
+uint64_t fastq_offset(fastq_reader_t *reader);
+
+/*
+ * Time the calls to gzread. fastq_inflate_ns returns the time spent
+ * inflating since the last call, in nanoseconds.
+ */
+void fastq_time_inflate(fastq_reader_t *reader, bool timed);
+uint64_t fastq_inflate_ns(fastq_reader_t *reader);
+
+/*
+ * Move the bases at the start of every read that match an N in pattern into the read's umi,
+ * and drop the ones that match an X. The reads (and their qualities) then start after the pattern
+ */
+void fastq_umi(fastq_reader_t *reader, char *pattern);
+
+void fastq_close(fastq_reader_t *reader);
+
+/*
+ * Create and free a batch that can hold size reads
+ */
+read_batch_t *read_batch_init(int size);
+void read_batch_destroy(read_batch_t *batch);
+
+/*
+ * Trim a read to trim bases
+ */
+void trim_fastq_record(fastq_record_t *r, int trim);
+
+/*
+ * Set the UMI of a read, e.g. to the one from its mate
+ */
+void fastq_record_umi(fastq_record_t *r, char *umi);
+
+/*
+ * Write a read in fastq format. If it has a UMI we add it to the name as name_UMI
+ */
+void write_fastq_record(FILE *out, fastq_record_t *r);
+
+/*
+ * Write a read that we trimmed to nothing (an adapter dimer) without formatting its sequence
+ */
+void write_empty_fastq_record(FILE *out, fastq_record_t *r);
+
+#endif
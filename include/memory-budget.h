@@ -0,0 +1,42 @@
+#ifndef FAST_SEARCH_MEMORY_BUDGET_H
+#define FAST_SEARCH_MEMORY_BUDGET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "structs.h"
+
+/*
+ * --max-memory. We share the budget between the things that grow with the input:
+ *
+ * 	the primer index and the compressors' buffers, which we can't make any smaller
+ * 	the batches of reads (opt->batch_reads reads in each)
+ * 	in --paired_end mode, the hash table of R1 reads (opt->tablesize buckets) and the R1 reads
+ * 	in it (opt->pair_memory). Above that we spill the R1 reads to a temp file (see pairs.h)
+ *
+ * Without --max-memory we use READ_BATCH_SIZE reads and keep all the R1 reads in memory.
+ */
+
+// about how much memory each read in a batch takes (the name, sequence, quality, and hit)
+#define BATCH_READ_BYTES 1024
+
+// and the buffers for each compressor thread of each output
+#define WRITER_THREAD_BYTES (1 << 20)
+
+/*
+ * Parse a size like 4G, 500M, 64k, or 1000000 (bytes). Returns 0 if we can't
+ */
+size_t parse_memory(char *s);
+
+/*
+ * Set opt->batch_reads, opt->tablesize, and opt->pair_memory from opt->max_memory. Exits if the
+ * budget is too small for the index and the smallest batches
+ */
+void memory_plan(struct options *opt, bool paired_end);
+
+/*
+ * An anonymous temp file in $TMPDIR (or /tmp) that goes away when we close it
+ */
+FILE *temp_file(char *what);
+
+#endif
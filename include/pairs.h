@@ -0,0 +1,83 @@
+#ifndef FAST_SEARCH_PAIRS_H
+#define FAST_SEARCH_PAIRS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "arena.h"
+#include "structs.h"
+
+/*
+ * The R1 reads that paired_end_search compares to R2. We remember where we want to trim each R1
+ * read in a hash table on its name.
+ *
+ * With --max-memory (opt->pair_memory) we only keep the newest R1 reads in memory. When they
+ * use more than that we write them to a temp file (in the same order as the file, with just the
+ * fields we need) and start again. R2 is nearly always in the same order as R1, so when we
+ * don't find a mate in memory we read the spilled reads back in order, and forget them again
+ * once we've found their mate. We then write the final trim of every R1 read to another temp
+ * file in order, and the last pass over R1 reads that instead of looking up the names.
+ *
+ * If R2 is not in the same order as R1 we still find the mates, but we keep all the R1 reads
+ * that we read back while we look for them, so we can go over the budget. --external-pairs
+ * (external_pair_search) doesn't mind the order.
+ */
+
+typedef struct pair_table {
+	struct R1_read **table;  // the hash table on the name
+	int size;
+	arena_t *arena;          // the R1 reads from pass 1 that are in memory
+	struct R1_read **order;  // and the same reads in the order we read them
+	uint64_t norder;
+	uint64_t order_size;
+	size_t budget;           // how much memory the R1 reads can use, or 0 for all of it
+	uint64_t n;              // how many R1 reads we have
+	FILE *spill;             // the R1 reads [0, spilled) that we took out of memory
+	uint64_t spilled;
+	uint64_t loaded;         // how many of them we have read back
+	size_t window;           // how much memory the ones we read back and haven't matched use
+	bool warned;
+	FILE *finals;            // the final trim and keep of every R1 read, if we spilled
+	uint64_t final;          // the next one to read
+} pair_table_t;
+
+pair_table_t *pairs_init(int size, size_t budget);
+
+/*
+ * Remember R1 (which we copy). Its ordinal is the number of reads we added before it
+ */
+void pairs_add(pair_table_t *t, struct R1_read *R1);
+
+/*
+ * Find the R1 read called name, or NULL
+ */
+struct R1_read *pairs_find(pair_table_t *t, char *name);
+
+/*
+ * We've compared R1 to its mate and set its trim and keep
+ */
+void pairs_matched(pair_table_t *t, struct R1_read *R1);
+
+/*
+ * After the last R2 read. Writes the final trims if we spilled
+ */
+void pairs_finish(pair_table_t *t);
+
+/*
+ * Where to trim the next R1 read (called name) in pass 3, and whether to keep it. trim is -1 if
+ * we don't trim it. Returns false if we don't know the read
+ */
+bool pairs_final(pair_table_t *t, char *name, int *trim, bool *keep);
+
+void pairs_destroy(pair_table_t *t);
+
+enum { PAIR_SAME, PAIR_R1_ADJUSTED, PAIR_R2_ADJUSTED };
+
+/*
+ * Compare where we found the adapter in R1 and R2 (-1 if we didn't), and move one of them so
+ * that they match: a read without an adapter trims where its mate does, and otherwise we use
+ * the shorter. Returns which one we moved
+ */
+int reconcile_trims(int *R1_trim, int *R2_trim);
+
+#endif
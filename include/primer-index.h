@@ -0,0 +1,347 @@
+
+#ifndef FAST_SEARCH_PRIMER_INDEX_H
+#define FAST_SEARCH_PRIMER_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "structs.h"
+
+/*
+ * The flat primer index.
+ *
+ * After we build the trees of primers we copy them into one block of memory that has no pointers
+ * in it, just offsets, so we can write it to a file (fast-adapter-trimming index) and mmap it
+ * straight back in (--index-file) without parsing anything. Every process that maps the same
+ * file shares the same page cache.
+ *
+ * The block is a header, then an open addressing hash table for each primer length (and one
+ * more for the short 3' primers), then the primer names as NUL terminated strings. The SNPs
+ * of a primer all point to its name.
+ *
+ * The tables are canonical: each primer is stored under the smaller of its encoding and the
+ * encoding of its reverse complement, and we look up the smaller of the window of the read and
+ * its reverse complement. With --reverse (the default) the " rc" version of a primer (and each
+ * of its SNPs) is the reverse complement of the primer, so they share a slot. The slot is marked
+ * FATI_PARTNER, and the " rc" name is the next name in the names. That halves the tables.
+ *
+ * With --mismatches 2 or more there are far too many variants of each primer to put them
+ * all in the tables, so we also split each full length primer into seeds. A primer of length k
+ * gets min(mismatches, k/FATI_MIN_SEED - 1) mismatches (see seed_budget) and one more seed than
+ * that. If a window of the read is within that many mismatches of a primer, at least one of its
+ * seeds matches exactly (the pigeonhole principle). So we look up the seeds of the window in one more
+ * hash table, and count the differences to each primer that shares a seed with a popcount.
+ * The seed table points to a list of primer numbers (the postings) in the array of primers.
+ * Short seeds match everywhere, so primers too short for three FATI_MIN_SEED bp seeds (and the
+ * short 3' primers) only get 1 mismatch. A primer never gets fewer mismatches with a bigger
+ * --mismatches, so we never lose a match by asking for more. Most windows don't share a seed with any primer,
+ * so before we hash a seed we check its first FATI_MIN_SEED bp in a bitmap in the header.
+ *
+ * Primers with degenerate bases (e.g. an N for the index) are stored as their encoding and a
+ * mask of the bits that we compare, and grouped by table and mask. Each group is another hash
+ * table of (encoding & mask), so we look up (read & mask) in each group after the exact table.
+ * The groups for a table are in order of how many bases they compare, most first.
+ *
+ * The short 3' primers are short enough (FATI_DIRECT_MAX bp or less) that we can also have a
+ * direct address table with an entry for every possible encoding, that says which slot (and
+ * whether it is the partner) primer_lookup would find for it, or FATI_EMPTY. That is one load
+ * instead of a hash and a probe, and it is what the SIMD lanes in search_batch gather from.
+ * Everything is in the byte order of the machine that wrote it, so we check that when we load it.
+ */
+
+#define FATI_MAGIC "FATI"
+#define FATI_VERSION 7
+#define FATI_BYTE_ORDER 0x01020304
+#define FATI_TRUNC (MAXKMER+1)  // the table of short 3' primers
+#define FATI_TABLES (MAXKMER+2)
+#define FATI_EMPTY UINT32_MAX   // the name of an empty slot
+#define FATI_MIN_SEED 6         // the shortest seed we split a primer into
+#define FATI_DIRECT_MAX 8       // the longest short 3' primers that get a direct address table
+
+#define FATI_NAMED_RC 1 // the named primer is the reverse complement of value
+#define FATI_PARTNER 2  // the reverse complement of the named primer is the next name, with the SNP mirrored
+
+typedef struct fati_slot {
+	uint64_t value;   // the canonical encoding of the primer (the masked encoding in a group)
+	uint32_t name;    // offset of the name in the names, or FATI_EMPTY
+	int8_t snp_posn;  // the SNP (see primer_name_t)
+	uint8_t strand;   // FATI_NAMED_RC and FATI_PARTNER (always 0 in a group)
+	char snp_from;
+	char snp_to;
+} fati_slot_t;
+
+typedef struct fati_primer {
+	uint64_t value;   // the encoding of the primer
+	uint32_t name;    // offset of the name in the names
+	uint32_t k;       // the length of the primer
+} fati_primer_t;
+
+typedef struct fati_seed {
+	uint64_t key;     // see seed_key()
+	uint32_t first;   // the first posting of the primers with this seed
+	uint32_t count;   // how many primers have this seed. 0 is an empty slot
+} fati_seed_t;
+
+typedef struct fati_table {
+	uint64_t offset; // from the start of the index to the first slot
+	uint64_t mask;   // the number of slots (a power of 2) - 1
+	uint64_t count;  // how many primers are in the table
+} fati_table_t;
+
+typedef struct fati_group {
+	uint64_t mask;    // the bits of the encoding that we compare
+	fati_table_t table;
+} fati_group_t;
+
+typedef struct fati_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t maxkmer;
+	uint32_t min_adapter_length;
+	uint32_t reverse;
+	uint32_t unique_kmer_count;
+	uint32_t mismatches;
+	int32_t kmer_lengths[MAXKMER+1];
+	fati_table_t tables[FATI_TABLES];
+	uint64_t primers_offset;  // the fati_primer_t's that we split into seeds
+	uint64_t nprimers;
+	fati_table_t seeds;       // the fati_seed_t's
+	uint64_t postings_offset; // uint32_t numbers of the primers for each seed
+	uint64_t npostings;
+	uint8_t seed_starts[MAXKMER+1][MAXMISMATCHES+2]; // seed_start() for every k, so we don't divide when we search
+	uint64_t seed_filter[1 << (2 * FATI_MIN_SEED - 6)]; // a bit for the first FATI_MIN_SEED bp of every seed
+	uint64_t groups_offset;   // the fati_group_t's of primers with degenerate bases
+	uint32_t ngroups;
+	uint16_t group_first[FATI_TABLES]; // the groups for each table
+	uint16_t group_count[FATI_TABLES];
+	uint64_t direct_offset;   // the uint32_t entries of the direct address table (see direct_lookup)
+	uint32_t direct_k;        // the length of the short 3' primers in it, or 0 if there isn't one
+	uint64_t names_offset;
+	uint64_t names_size;
+	uint64_t size; // the size of the whole index in bytes
+} fati_header_t;
+
+static inline uint64_t fati_hash(uint64_t enc) {
+	enc ^= enc >> 31;
+	enc *= 0x7fb5d329728ea185ULL;
+	enc ^= enc >> 27;
+	return enc;
+}
+
+static inline const fati_slot_t *table_lookup(const char *flat, const fati_table_t *t, uint64_t enc) {
+	const fati_slot_t *slots = (const fati_slot_t *) (flat + t->offset);
+	for (uint64_t i = fati_hash(enc) & t->mask;; i = (i + 1) & t->mask) {
+		if (slots[i].name == FATI_EMPTY)
+			return NULL;
+		if (slots[i].value == enc)
+			return &slots[i];
+	}
+}
+
+/*
+ * Look up a window of the read in table (a primer length, or FATI_TRUNC). rcenc is the
+ * reverse complement of enc. If it is not in the table we try the groups of primers with
+ * degenerate bases for that table.
+ * Returns the slot of the primer or NULL if it is not there. If the read matches the
+ * FATI_PARTNER of the named primer, we set *partner.
+ */
+static inline const fati_slot_t *primer_lookup(primer_index_t *idx, int table, uint64_t enc, uint64_t rcenc, bool *partner) {
+	const fati_header_t *h = (const fati_header_t *) idx->flat;
+	const fati_table_t *t = &h->tables[table];
+	const fati_slot_t *slots = (const fati_slot_t *) (idx->flat + t->offset);
+	uint64_t key = enc < rcenc ? enc : rcenc;
+	uint8_t rc = enc != key ? FATI_NAMED_RC : 0;
+	*partner = false;
+	for (uint64_t i = fati_hash(key) & t->mask; slots[i].name != FATI_EMPTY; i = (i + 1) & t->mask) {
+		if (slots[i].value != key)
+			continue;
+		if ((slots[i].strand & FATI_NAMED_RC) == rc || enc == rcenc)
+			return &slots[i];
+		if (slots[i].strand & FATI_PARTNER) {
+			*partner = true;
+			return &slots[i];
+		}
+	}
+	if (h->group_count[table] == 0)
+		return NULL;
+	const fati_group_t *groups = (const fati_group_t *) (idx->flat + h->groups_offset);
+	const fati_slot_t *slot;
+	for (int g=h->group_first[table]; g<h->group_first[table] + h->group_count[table]; g++)
+		if ((slot = table_lookup(idx->flat, &groups[g].table, enc & groups[g].mask)))
+			return slot;
+	return NULL;
+}
+
+/*
+ * Look up a short 3' primer in the direct address table. enc must be direct_k bases long.
+ * An entry is the number of the slot (counting 16 byte slots from the start of the index)
+ * shifted up one, and the bottom bit is set if the read matches the partner.
+ */
+static inline const fati_slot_t *direct_slot(primer_index_t *idx, uint32_t entry, bool *partner) {
+	*partner = entry & 1;
+	return (const fati_slot_t *) (idx->flat + (uint64_t) (entry >> 1) * sizeof(fati_slot_t));
+}
+
+static inline const fati_slot_t *direct_lookup(primer_index_t *idx, uint64_t enc, bool *partner) {
+	const fati_header_t *h = (const fati_header_t *) idx->flat;
+	uint32_t entry = ((const uint32_t *) (idx->flat + h->direct_offset))[enc];
+	if (entry == FATI_EMPTY)
+		return NULL;
+	return direct_slot(idx, entry, partner);
+}
+
+/*
+ * How many mismatches a primer of length k gets with the seeds: as many as we asked for, but
+ * only as many as leave every seed at least FATI_MIN_SEED bp.
+ */
+static inline int seed_budget(int k, int mismatches) {
+	int most = k / FATI_MIN_SEED - 1;
+	if (most < 0)
+		most = 0;
+	return mismatches < most ? mismatches : most;
+}
+
+/*
+ * Do we split primers of length k into seeds?
+ */
+static inline bool seeded_length(int k, int mismatches) {
+	return seed_budget(k, mismatches) > 1;
+}
+
+/*
+ * Seed s of a primer of length k covers bases seed_start(s) to seed_start(s+1). There are
+ * seed_budget(k, mismatches) + 1 seeds
+ */
+static inline int seed_start(int k, int mismatches, int s) {
+	return s * k / (seed_budget(k, mismatches) + 1);
+}
+
+/*
+ * The bases from a to b of an encoding of length k (the first base is in the high bits)
+ */
+static inline uint64_t seed_bases(uint64_t enc, int k, int a, int b) {
+	return (enc >> (2 * (k - b))) & ((1ULL << (2 * (b - a))) - 1);
+}
+
+/*
+ * The seeds are at most MAXKMER/3 bases, so there is room for which seed it is and the
+ * primer length above them, and one table holds all the seeds.
+ */
+static inline uint64_t seed_key(int k, int s, uint64_t seed) {
+	return seed | (uint64_t) s << 40 | (uint64_t) k << 48;
+}
+
+/*
+ * How many bases are different between two encodings. Each base is 2 bits, so we fold
+ * the high bit of every pair onto the low bit and count those.
+ */
+static inline int kmer_mismatches(uint64_t a, uint64_t b) {
+	uint64_t x = a ^ b;
+	return __builtin_popcountll((x | x >> 1) & 0x5555555555555555ULL);
+}
+
+/*
+ * Find the primer of length k with the fewest mismatches (up to its seed_budget) to
+ * enc using the seeds. Returns NULL if there isn't one, otherwise sets *mismatches.
+ * Only use this if seeded_length(k, mismatches) for the index.
+ */
+static inline const fati_primer_t *seed_lookup(primer_index_t *idx, int k, uint64_t enc, int *mismatches) {
+	const fati_header_t *h = (const fati_header_t *) idx->flat;
+	const fati_seed_t *slots = (const fati_seed_t *) (idx->flat + h->seeds.offset);
+	const fati_primer_t *primers = (const fati_primer_t *) (idx->flat + h->primers_offset);
+	const uint32_t *postings = (const uint32_t *) (idx->flat + h->postings_offset);
+	const uint8_t *starts = h->seed_starts[k];
+	int n = seed_budget(k, h->mismatches);
+	const fati_primer_t *best = NULL;
+	int fewest = n + 1;
+	for (int s=0; s<=n && fewest > 0; s++) {
+		uint64_t prefix = seed_bases(enc, k, starts[s], starts[s] + FATI_MIN_SEED);
+		if ((h->seed_filter[prefix >> 6] & (1ULL << (prefix & 63))) == 0)
+			continue;
+		uint64_t key = seed_key(k, s, seed_bases(enc, k, starts[s], starts[s+1]));
+		for (uint64_t i = fati_hash(key) & h->seeds.mask;; i = (i + 1) & h->seeds.mask) {
+			if (slots[i].count == 0)
+				break;
+			if (slots[i].key != key)
+				continue;
+			for (uint32_t j=slots[i].first; j<slots[i].first + slots[i].count; j++) {
+				int d = kmer_mismatches(primers[postings[j]].value, enc);
+				if (d < fewest) {
+					fewest = d;
+					best = &primers[postings[j]];
+				}
+			}
+			break;
+		}
+	}
+	*mismatches = fewest;
+	return best;
+}
+
+/*
+ * Prefetch the cache lines that primer_lookup (and seed_lookup, if we split primers of this
+ * length into seeds) will read for a window. search_batch calls this for lots of windows
+ * before it looks any of them up, so that we wait for memory once rather than for every window.
+ */
+static inline void primer_prefetch(primer_index_t *idx, int table, uint64_t enc, uint64_t rcenc) {
+	const fati_header_t *h = (const fati_header_t *) idx->flat;
+	const fati_table_t *t = &h->tables[table];
+	uint64_t key = enc < rcenc ? enc : rcenc;
+	__builtin_prefetch(idx->flat + t->offset + (fati_hash(key) & t->mask) * sizeof(fati_slot_t));
+	if (h->group_count[table]) {
+		const fati_group_t *groups = (const fati_group_t *) (idx->flat + h->groups_offset);
+		for (int g=h->group_first[table]; g<h->group_first[table] + h->group_count[table]; g++)
+			__builtin_prefetch(idx->flat + groups[g].table.offset + (fati_hash(enc & groups[g].mask) & groups[g].table.mask) * sizeof(fati_slot_t));
+	}
+	if (table == FATI_TRUNC || !seeded_length(table, h->mismatches))
+		return;
+	const uint8_t *starts = h->seed_starts[table];
+	for (int s=0; s<=seed_budget(table, h->mismatches); s++) {
+		uint64_t prefix = seed_bases(enc, table, starts[s], starts[s] + FATI_MIN_SEED);
+		if ((h->seed_filter[prefix >> 6] & (1ULL << (prefix & 63))) == 0)
+			continue;
+		uint64_t skey = seed_key(table, s, seed_bases(enc, table, starts[s], starts[s+1]));
+		__builtin_prefetch(idx->flat + h->seeds.offset + (fati_hash(skey) & h->seeds.mask) * sizeof(fati_seed_t));
+	}
+}
+
+/*
+ * Read the primers in opt->primers, create all their SNPs (unless opt->mismatches is 0),
+ * the seeds (if opt->mismatches is more than 1), and the short primers we look for at the 3' end.
+ */
+primer_index_t *build_primer_index(struct options *opt);
+
+/*
+ * The name of the primer in a slot, or of its partner (which is the next name)
+ */
+static inline char *primer_slot_name(primer_index_t *idx, const fati_slot_t *slot, bool partner) {
+	char *name = idx->flat + ((const fati_header_t *) idx->flat)->names_offset + slot->name;
+	return partner ? name + strlen(name) + 1 : name;
+}
+
+/*
+ * Write the flat index to a file that we can load with load_primer_index
+ */
+void save_primer_index(primer_index_t *idx, char *file);
+
+/*
+ * mmap an index that we wrote with save_primer_index. Exits if it is not a valid index.
+ */
+primer_index_t *load_primer_index(char *file);
+
+/*
+ * Share one copy of the index between all the processes on a node. The name of the index
+ * is a hash of the primer file and the options. If another process has already published it
+ * we map it read only, otherwise we build it and publish it to POSIX shared memory (or to a
+ * file in hugepage_dir, which should be on hugetlbfs). If we can't share it we build our own.
+ */
+primer_index_t *shared_primer_index(struct options *opt, char *hugepage_dir);
+
+/*
+ * Free the primer index and all the primers in it
+ */
+void free_primer_index(primer_index_t *idx);
+
+#endif
@@ -2,33 +2,43 @@
 #ifndef FAST_SEARCH_PRIMERS_H
 #define FAST_SEARCH_PRIMERS_H
 
-
+#include <stddef.h>
+#include "arena.h"
 #include "structs.h"
 
+/*
+ * An empty binary search tree of primers
+ */
+kmer_bst_t *new_primer_root(arena_t *);
+
 /* 
  * Add a sequence encoding (a long long int) to a binary
  * search tree.
  */
-void add_primer(uint64_t, char*, kmer_bst_t*);
+void add_primer(uint64_t, primer_name_t, kmer_bst_t*, arena_t *);
 
 /*
  * Find an encoding in a bst
  */
 kmer_bst_t* find_primer(uint64_t, kmer_bst_t*);
 
+/*
+ * The full name of a primer, e.g. "TruSeq_R1 rc 12 A->G". If it is not a SNP we
+ * just return base, otherwise we write it in buf.
+ */
+char *format_primer_name(char *base, int snp_posn, char snp_from, char snp_to, char *buf, size_t len);
+
 /*
  * recursively print all primers
  */
 
-void print_all_primers(kmer_bst_t*, int);
+void print_all_primers(kmer_bst_t*, int, char **);
 
 // read the primers and populate the kmer_bst_t
-void read_primers(char*, kmer_bst_t**, int, bool, int);
-
-// read the priemrs and populate the kmer_bst_t with a snp in every position
-void read_primers_create_snps(char*, kmer_bst_t**, int, bool, int);
+void read_primers(char*, primer_index_t*, int);
 
-// read the primers but only store a substring of each
-void read_trunc_primers(char*, int, kmer_bst_t*, bool, int);
+// read the primers once and populate the kmer_bst_t's with a snp in every position,
+// and the short primers we look for at the 3' end
+void read_primers_create_snps(char*, primer_index_t*, int);
 
 #endif
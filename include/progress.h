@@ -0,0 +1,69 @@
+
+#ifndef FAST_SEARCH_PROGRESS_H
+#define FAST_SEARCH_PROGRESS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Periodic progress reporting for long runs.
+ *
+ * Each input stream (R1 and R2) has a set of counters. Only one search thread ever writes
+ * to a stream, so it publishes its local counts with relaxed atomic stores after every
+ * batch of reads, and the reporting thread reads them with relaxed loads. There are
+ * no locks anywhere on the search path.
+ */
+
+enum { PROGRESS_R1 = 0, PROGRESS_R2 = 1 };
+
+typedef struct progress_stream {
+	_Atomic uint64_t reads;      // reads parsed from the input
+	_Atomic uint64_t trimmed;    // reads that we trimmed
+	_Atomic uint64_t written;    // reads written to the output
+	_Atomic uint64_t bytes_in;   // compressed bytes consumed from the input
+	_Atomic uint64_t pipe_bytes; // bytes waiting in the pipe to the compressor
+	_Atomic uint64_t pending;    // reads held in memory waiting for their mate
+	_Atomic bool active;         // have we seen anything on this stream
+} progress_stream_t;
+
+typedef struct progress {
+	int interval;               // seconds between reports
+	FILE *out;                  // where to write (stderr or a file)
+	bool tsv;                   // write tab separated values (used for files)
+	progress_stream_t streams[2];
+	_Atomic bool stop;
+	pthread_t thread;
+	struct timespec start;
+	// the last values we reported so we can calculate rates. Only the reporting thread uses these.
+	double last_time;
+	uint64_t last_reads[2];
+	uint64_t last_bytes[2];
+} progress_t;
+
+/*
+ * Start a thread that reports every interval seconds. If file is NULL we write to stderr.
+ * Returns NULL if interval is not positive.
+ */
+progress_t *progress_start(int interval, char *file);
+
+/*
+ * Publish the counts for one stream. Safe to call with a NULL progress_t. pipe may be
+ * NULL, otherwise we ask the kernel how many bytes are waiting to be compressed.
+ */
+void progress_update(progress_t *p, int stream, uint64_t reads, uint64_t trimmed, uint64_t written, uint64_t bytes_in, FILE *pipe);
+
+/*
+ * Publish the number of reads held waiting for their mate (paired end mode)
+ */
+void progress_pending(progress_t *p, int stream, uint64_t pending);
+
+/*
+ * Write a final report, stop the thread and free the memory
+ */
+void progress_stop(progress_t *p);
+
+#endif
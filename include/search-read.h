@@ -0,0 +1,73 @@
+
+#ifndef FAST_SEARCH_SEARCH_READ_H
+#define FAST_SEARCH_SEARCH_READ_H
+
+#include <stddef.h>
+#include "structs.h"
+
+/*
+ * Find the most 5' adapter in a sequence of length len.
+ *
+ * At each position we try the longest primers first. If we don't find a full
+ * length primer, we look for the short primers in the last few bases.
+ * hit->trim is -1 if there isn't an adapter.
+ */
+void search_read(primer_index_t *idx, struct options *opt, char *seq, int len, search_hit_t *hit);
+
+/*
+ * Pick the main scans that are compiled for this index's longest primer, for the usual read
+ * lengths. Call this once after we build (or load) the index. Until then (and for other
+ * lengths) we use the generic one.
+ */
+void select_search_kernels(primer_index_t *idx, struct options *opt);
+
+/*
+ * Search all the reads in a batch, and put the hits in batch->hits. This finds the same
+ * adapters as search_read, but searches opt->batch_width reads together so that we can
+ * prefetch the index for all of them (see search-read.c). A width of 1 is one read at a time.
+ */
+void search_batch(primer_index_t *idx, struct options *opt, read_batch_t *batch);
+
+/*
+ * Where the first window of window bases with a mean quality (phred+33) below threshold
+ * starts, or -1 if there isn't one. We trim the read there.
+ */
+int quality_trim(char *qual, int len, int window, int threshold);
+
+/*
+ * How long the tail of base at the 3' end of the read is, allowing one mismatch in every
+ * every bases. The tail starts and ends with base, and is 0 if there isn't one.
+ */
+int poly_tail(char *seq, int len, char base, int every);
+
+/*
+ * The first of two places we could trim a read, or -1 for neither
+ */
+static inline int earliest_trim(int a, int b) {
+	if (b < 0 || (a > -1 && a < b))
+		return a;
+	return b;
+}
+
+/*
+ * Where we trim the read apart from the adapter: where the quality drops or the poly-G/A tail starts
+ */
+static inline int end_trim(search_hit_t *hit) {
+	return earliest_trim(hit->qual_trim, hit->poly_trim);
+}
+
+/*
+ * Where we trim the read: the adapter, where the quality drops, or the poly-G/A tail,
+ * whichever is first. -1 for none of them
+ */
+static inline int trim_point(search_hit_t *hit) {
+	return earliest_trim(hit->trim, end_trim(hit));
+}
+
+/*
+ * The full name of the primer that we hit, including the SNP (e.g. "TruSeq_R1 rc 12 A->G").
+ * We only write it into buf if it is a SNP.
+ */
+char *hit_name(search_hit_t *hit, char *buf, size_t len);
+
+#endif
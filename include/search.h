@@ -1,15 +1,48 @@
 #ifndef FAST_SEARCH_DEFS_H
 #define FAST_SEARCH_DEFS_H
 
+#include <pthread.h>
+#include <stdbool.h>
+#include "definitions.h"
+#include "structs.h"
+
+/*
+ * The two threads of the fast search swap which reads of each batch are long enough to write,
+ * so that we write a pair or neither of its reads. R1 also passes on its UMIs, so that the R2
+ * mates get the same names, and its --demux barcodes, so that they go to the same files
+ */
+typedef struct pair_sync {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool keep[2][READ_BATCH_SIZE]; // the last batch from R1 and R2
+	char umi[READ_BATCH_SIZE][MAXUMILEN + 1]; // the UMIs of the last batch from R1 (with --umi-len)
+	int barcode[READ_BATCH_SIZE];  // and its barcodes (with --demux)
+	int n[2];
+	int posted[2];                 // how many batches each stream has posted
+	int taken[2];                  // and how many of the other stream's batches it has read
+	bool done[2];
+} pair_sync_t;
+
+pair_sync_t *pair_sync_init();
+void pair_sync_destroy(pair_sync_t *);
 
 //  paired end search
 void paired_end_search(struct options *opt);
 
+// paired end search through temp files, for mates in any order (--external-pairs)
+void external_pair_search(struct options *opt);
+
 // fast search without pairing
 void fast_search(struct options *opt);
 
 // search one file, for multi-threading
 void *fast_search_one_file(void *);
 
+// search one file and write the trimmed reads. Both of the fast searches use this
+void search_file(thread_args_t *, primer_index_t *, COUNTS *, primer_counts_t *, int);
+
+// search R1 and R2 in one thread, keeping the pairs together
+void search_pair(thread_args_t *, thread_args_t *, primer_index_t *, COUNTS *, primer_counts_t *, int);
+
 
 #endif
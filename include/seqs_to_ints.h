@@ -2,11 +2,22 @@
 #ifndef SEQS_TO_INT_H
 #define SEQS_TO_INT_H
 
+#include <stdint.h>
+
+// the code encode_read() gives anything that isn't A, C, G, or T
+#define AMBIGUOUS_BASE 4
+
 /*
  * convert a kmer of A,T,G,C into a uint64_t
  */
 uint64_t kmer_encoding(char*, int, int);
 
+/*
+ * convert a kmer that may have degenerate (IUPAC) bases into a uint64_t, and set the mask
+ * to the bits that we need to compare
+ */
+uint64_t kmer_iupac_encoding(char*, int, int, uint64_t*);
+
 /*
  * decode a uint64_t into a kmer of A,T,G,C. We need to know how long k is otherwise it will be left filled with A's!
  */
@@ -18,5 +29,9 @@ char* kmer_decoding(uint64_t, int);
  */
 uint64_t next_kmer_encoding(char*, int, int, uint64_t);
 
+/*
+ * encode every base of a read (0-3, or AMBIGUOUS_BASE) into codes, and return the number of ambiguous bases
+ */
+int encode_read(char*, int, uint8_t*);
 
 #endif
@@ -0,0 +1,55 @@
+#ifndef FAST_SEARCH_SHARDS_H
+#define FAST_SEARCH_SHARDS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "structs.h"
+#include "writer.h"
+
+/*
+ * The trimmed output split into n files (--shards), each with its own writer (see writer.h).
+ *
+ * We choose the shard from the number of the read in the input file, so R1 and R2 of a
+ * pair always go to the same shard. chunk reads in a row go to the same shard (--shard-reads),
+ * so chunk 1 is round robin. With one shard we just write to the file.
+ */
+
+typedef struct shards {
+	int n;
+	int chunk;
+	writer_t **out;
+} shards_t;
+
+/*
+ * Open n writers. The shards are named file with the shard number before the extension,
+ * e.g. R1.fastq.gz is R1.000.fastq.gz, R1.001.fastq.gz, ...
+ */
+shards_t *shards_open(char *file, int n, int chunk, struct options *opt);
+
+/*
+ * file with tag before its extension, e.g. R1.fastq.gz and 000 is R1.000.fastq.gz
+ */
+char *output_name(char *file, char *tag);
+
+/*
+ * Where to write read number ordinal (counting from 0)
+ */
+static inline FILE *shard_out(shards_t *s, uint64_t ordinal) {
+	if (s->n == 1)
+		return s->out[0]->fp;
+	return s->out[(ordinal / s->chunk) % s->n]->fp;
+}
+
+/*
+ * The compressor pipe of the first shard (for the progress reports), or NULL if it isn't a pipe
+ */
+static inline FILE *shards_pipe(shards_t *s) {
+	return s ? s->out[0]->pipe : NULL;
+}
+
+/*
+ * Close all the writers and free the memory
+ */
+void shards_close(shards_t *s);
+
+#endif
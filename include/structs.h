@@ -3,6 +3,13 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include "definitions.h"
+#include "kseq.h"
+
+struct progress;
+struct trace;
+struct primer_index;
+struct arena;
 
 /*
  * Structs that are used in searching the sequences
@@ -24,9 +31,33 @@ struct options {
 	char* primers;
 	int primer_occurrences;
 	bool reverse;
+	int mismatches; // how many mismatches we allow in a full length primer (default 1)
+	bool last_trunc; // trim at the last short primer in the 3' tail rather than the first (the paired end searches)
 	int tablesize;
+	int batch_width; // how many reads we search together (--batch-width)
+	int qual_window; // trim reads where the mean quality of this many bases drops below qual_threshold (0 is off)
+	int qual_threshold;
+	int poly_g; // trim poly-G tails at least this long from the 3' end (0 is off)
+	int poly_a; // and poly-A tails
+	int poly_every; // allow one mismatch in every poly_every bases of a tail
+	char *umi_pattern; // move the bases at the start of R1 that match N in this into the read name (NULL is off)
 	bool verbose;
 	bool debug;
+	struct progress *progress; // periodic progress reports (NULL if we are not reporting)
+	struct trace *trace; // trace-event timeline (NULL if we are not tracing)
+	struct primer_index *index; // the primers we search for. We build (or load) this once and share it
+	const struct search_kernel *kernels; // the main scans specialized for this index (see select_search_kernels), or NULL
+	struct demux *demux; // the barcodes and their outputs for --demux, or NULL
+	int shards; // split the output into this many files
+	int shard_reads; // and write this many reads in a row to each one
+	char *discarded; // write the reads shorter than min_sequence_length here (with .R1 and .R2 before the extension)
+	int out_format; // how we compress the outputs (FORMAT_AUTO chooses from the extension, see writer.h)
+	int out_level; // the compression level (0 is the compressor's default)
+	int out_threads; // the threads each output can use to compress
+	size_t max_memory; // --max-memory in bytes (0 is no limit). See memory-budget.h
+	int batch_reads; // how many reads we read in each batch (at most READ_BATCH_SIZE)
+	size_t pair_memory; // how much the R1 reads can use in --paired_end mode before we spill them (0 is no limit)
+	char *trim_list; // write where we trim each read here instead of the reads (with .R1 and .R2 before the extension). See trim-list.h
 };
 
 /*
@@ -35,21 +66,130 @@ struct options {
  */
 struct R1_read {
 	int trim;
+	int end_trim; // where the quality drops or the poly-G/A tail starts, or -1
 	char *id;
+	char *umi; // the UMI we took from the start of R1, or NULL
+	int barcode; // the --demux barcode of the pair
+	int len; // the length of the read before we trim it
+	bool keep; // is its R2 mate long enough too
+	uint64_t ordinal; // which read it is in the file
 	struct R1_read *next;
 };
 
+/*
+ * The name of a primer. We make 3 SNPs at every position of every primer, so rather than
+ * write out all of their names we remember the primer they came from (an index into the
+ * primer_index_t names) and the SNP, e.g. "TruSeq_R1 rc 12 A->G" is
+ * {"TruSeq_R1 rc", 12, 'A', 'G'}. snp_posn is -1 for the primer itself.
+ */
+typedef struct primer_name {
+	uint32_t base;
+	int16_t snp_posn;
+	char snp_from;
+	char snp_to;
+} primer_name_t;
+
 /*
  * This is an unbalanced binary search tree, and so could devolve into O(n)
  * performance, however with random ints it should be ~O(log n)
  */
 typedef struct kmer_bst {
     uint64_t value;
-    char* id;
+    primer_name_t name;
     struct kmer_bst *bigger;
     struct kmer_bst *smaller;
 } kmer_bst_t;
 
+/*
+ * A full length primer (without any SNPs) that we split into seeds when we allow
+ * more than one mismatch.
+ */
+typedef struct seed_primer {
+	uint64_t value;
+	uint32_t base; // the name, as in primer_name_t
+	int k;
+} seed_primer_t;
+
+/*
+ * A primer with degenerate (IUPAC) bases, e.g. an N for an index. We only compare the bits
+ * of the encoding that are set in mask, so these don't go in the trees. table is the length
+ * of the primer, or FATI_TRUNC for the short 3' primers.
+ */
+typedef struct masked_primer {
+	uint64_t value;
+	uint64_t mask;
+	primer_name_t name;
+	int table;
+} masked_primer_t;
+
+/*
+ * All the primers that we search for. all_primers[k] holds the primers (and their SNPs)
+ * of length k, and kmer_lengths lists the k's that actually have primers, longest first.
+ * trunc_primers are the short primers that we look for at the 3' end of the sequence.
+ *
+ * We search the flat copy of the trees (see primer-index.h). If we loaded the index from
+ * a file we don't have the trees at all, and all_primers and trunc_primers are NULL.
+ */
+typedef struct primer_index {
+	int maxkmer;
+	int min_adapter_length;
+	bool reverse;
+	int mismatches;   // 0: exact matches only, 1: the primers and all their SNPs, more: we also use the seeds
+	kmer_bst_t *all_primers[MAXKMER+1];
+	kmer_bst_t *trunc_primers;
+	int kmer_lengths[MAXKMER+1];
+	int unique_kmer_count;
+	char **names;     // the names of the primers (and their rc and trunc versions) that primer_name_t's refer to
+	uint32_t nnames;
+	seed_primer_t *seed_primers; // the full length primers to split into seeds (if mismatches > 1)
+	uint32_t nseed_primers;
+	masked_primer_t *masked_primers; // the primers (and their SNPs) with degenerate bases
+	uint32_t nmasked_primers;
+	struct arena *arena; // everything we built the index with, including this struct
+	char *flat;       // the flat index
+	size_t flat_size;
+	bool mapped;      // flat is mmap'd from a file
+} primer_index_t;
+
+/*
+ * The adapter we found in a read. trim is -1 if we didn't find one.
+ */
+typedef struct search_hit {
+	int trim;
+	char *id;      // the primer we matched. If we matched a SNP of it, snp_posn is where, otherwise -1
+	int snp_posn;
+	char snp_from;
+	char snp_to;
+	int mismatches; // how many bases are different to the primer
+	int kmer;
+	char before;
+	char after;
+	bool truncated; // matched one of the short 3' primers
+	int ambiguous;  // how many bases of the read are not A, C, G, or T (we skip the windows with them)
+	int qual_trim;  // where the quality drops below --qual-threshold (see quality_trim), or -1
+	int poly_trim;  // where the poly-G or poly-A tail starts (see poly_tail), or -1
+} search_hit_t;
+
+/*
+ * A batch of reads. We read a batch, search all the reads in it, and then write them
+ * so that each of those stages runs over many reads at a time. The strings in reads[]
+ * are reused from batch to batch.
+ */
+typedef struct fastq_record {
+	kstring_t name;
+	kstring_t comment;
+	kstring_t seq;
+	kstring_t qual;
+	kstring_t umi;  // the bases we moved out of the start of the read (see fastq_umi). We write them after the name
+} fastq_record_t;
+
+typedef struct read_batch {
+	int n;      // how many reads are in this batch
+	int size;   // how many reads we can hold
+	fastq_record_t *reads;
+	search_hit_t *hits;
+} read_batch_t;
+
 /*
  * Some counts and information about primer matches. Currently this is done
  * as an O(n) search each time we find a match because (a) we don't have a 
@@ -83,6 +223,12 @@ typedef struct COUNTS {
 	int R2_adjusted;
 	int R1_trimmed;
 	int R2_trimmed;
+	int R1_poly; // reads with a poly-G or poly-A tail
+	int R2_poly;
+	int R1_dimers; // reads that we trimmed to nothing
+	int R2_dimers;
+	int R1_discarded; // reads (or their mates) shorter than min_sequence_length that we didn't write
+	int R2_discarded;
 	int same;
 } COUNTS;
 
@@ -96,6 +242,10 @@ typedef struct thread_arg_struct {
 	char* fqfile;
 	char* matches_file;
 	char* output_file;
+	int stream; // PROGRESS_R1 or PROGRESS_R2
+	char* discarded_file; // where to write the reads that are too short, or NULL
+	char* trim_list_file; // where to write the trims with --trim-list, or NULL
+	struct pair_sync *sync; // the other thread, if it is searching the mates of these reads
 } thread_args_t;
 
 
@@ -0,0 +1,55 @@
+
+#ifndef FAST_SEARCH_TRACE_H
+#define FAST_SEARCH_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+/*
+ * Write a timeline of what each thread is doing in the chrome trace-event JSON format.
+ * Open the file in https://ui.perfetto.dev or chrome://tracing
+ *
+ * We write one span per batch per stage per thread. All the functions do nothing if
+ * the trace_t is NULL, so the callers don't need to check.
+ */
+
+typedef struct trace {
+	FILE *out;
+	pthread_mutex_t lock;
+	uint64_t start;   // when we opened the trace (ns)
+	int events;       // how many events we have written
+	int pid;
+} trace_t;
+
+/*
+ * The trace ids (tid) for the threads
+ */
+enum { TRACE_MAIN = 0, TRACE_R1 = 1, TRACE_R2 = 2 };
+
+/*
+ * A monotonic clock in nanoseconds
+ */
+uint64_t trace_now(void);
+
+trace_t *trace_open(char *filename);
+
+/*
+ * Give a thread a name in the timeline
+ */
+void trace_thread_name(trace_t *t, int tid, const char *name);
+
+/*
+ * Write a span called name from start to end (both from trace_now()).
+ */
+void trace_span(trace_t *t, int tid, const char *name, uint64_t start, uint64_t end, int batch, int reads);
+
+/*
+ * Write a read span and split it into the time spent inflating (inflate_ns from
+ * fastq_inflate_ns()) and the time spent parsing the fastq
+ */
+void trace_read_span(trace_t *t, int tid, uint64_t start, uint64_t end, uint64_t inflate_ns, int batch, int reads);
+
+void trace_close(trace_t *t);
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef FAST_SEARCH_TRIM_LIST_H
+#define FAST_SEARCH_TRIM_LIST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "structs.h"
+
+/*
+ * --trim-list: instead of writing the trimmed reads, the searches write where they trim each read,
+ * and `fast-adapter-trimming apply` trims the original fastq files later. The search only has to
+ * write a few bytes per read, and we only compress the reads once, in the step that needs them.
+ *
+ * The file is TRIM_LIST_MAGIC and then one unsigned LEB128 varint for each read, in the same order
+ * as the fastq file (so the ordinal of a read is its position in the list):
+ *
+ * 	0      we don't write the read (an adapter dimer, or it or its mate is too short)
+ * 	1 + n  we write the read without its last n bases
+ *
+ * Most reads don't have an adapter, so they are one byte, and a trimmed read is one or two.
+ */
+
+#define TRIM_LIST_MAGIC "FATTRIM1"
+
+typedef struct trim_list {
+	FILE *fp;
+	char *file;
+	uint64_t n; // how many reads we have written or read
+} trim_list_t;
+
+/*
+ * Start a new trim list. Exits if we can't
+ */
+trim_list_t *trim_list_create(char *file);
+
+/*
+ * Add the next read, which is len bp before we trim it at trim (-1 if we don't, and 0 for an
+ * adapter dimer, which we never keep)
+ */
+void trim_list_add(trim_list_t *t, size_t len, int trim, bool keep);
+
+/*
+ * Open a trim list to read. Exits if it isn't one
+ */
+trim_list_t *trim_list_open(char *file);
+
+/*
+ * The next read. Returns false at the end of the list
+ */
+bool trim_list_next(trim_list_t *t, bool *keep, size_t *cut);
+
+void trim_list_close(trim_list_t *t);
+
+/*
+ * fast-adapter-trimming apply: trim R1 and R2 (each on its own thread) with the trim lists
+ * from --trim-list (opt->trim_list with .R1 and .R2 before the extension), and write them to
+ * opt->R1_output and opt->R2_output
+ */
+void apply_trim_lists(struct options *opt);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef FAST_SEARCH_WRITER_H
+#define FAST_SEARCH_WRITER_H
+
+#include <stdio.h>
+#include "structs.h"
+
+/*
+ * Where we write the reads. The search modes just fprintf to a FILE, and the backend
+ * compresses it:
+ *
+ * 	raw   the fastq, with a big buffer
+ * 	gzip  a pipe to pigz (or gzip if we don't have pigz), so it runs in another process
+ * 	bgzf  blocked gzip (like bgzip) that we compress on our own threads. Any gzip reader can read it
+ * 	zstd  libzstd with its own worker threads. Only if we were built with make ZSTD=1
+ *
+ * FORMAT_AUTO chooses from the extension: .gz is gzip, .bgz or .bgzf is bgzf, .zst is zstd,
+ * and anything else is raw.
+ */
+
+enum { FORMAT_AUTO, FORMAT_RAW, FORMAT_GZIP, FORMAT_BGZF, FORMAT_ZSTD };
+
+typedef struct writer {
+	FILE *fp;    // write the reads here
+	FILE *pipe;  // the pipe to the compressor if there is one, so we can see how much is waiting
+	void *state; // the bgzf or zstd backend
+	int format;
+	char *file;  // so we can say which one failed
+} writer_t;
+
+/*
+ * The format for --out-format, or -1 if we don't know it
+ */
+int output_format(char *name);
+
+/*
+ * The extension for files that we name ourselves (e.g. --demux-out)
+ */
+char *format_extension(int format);
+
+/*
+ * Open file for writing with opt->out_format, opt->out_level and opt->out_threads. Exits if we can't
+ */
+writer_t *writer_open(char *file, struct options *opt);
+
+/*
+ * Flush everything, finish the file, and free the writer. Exits if the compressor or the write failed
+ */
+void writer_close(writer_t *w);
+
+#endif
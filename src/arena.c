@@ -0,0 +1,79 @@
+/*
+ * A simple bump allocator. See arena.h
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "arena.h"
+#include "colours.h"
+
+#define ARENA_ALIGN 16
+
+static void new_chunk(arena_t *a, size_t size) {
+	arena_chunk_t *c = malloc(sizeof(arena_chunk_t) + size);
+	if (c == NULL) {
+		fprintf(stderr, "%sERROR: Can't malloc %zu bytes for the arena%s\n", RED, size, ENDC);
+		exit(1);
+	}
+	c->size = size;
+	c->used = 0;
+	c->next = a->chunks;
+	a->chunks = c;
+	a->reserved += size;
+}
+
+arena_t *arena_create(size_t size) {
+	arena_t *a = calloc(1, sizeof(arena_t));
+	if (a == NULL) {
+		fprintf(stderr, "%sERROR: Can't malloc memory for the arena%s\n", RED, ENDC);
+		exit(1);
+	}
+	if (size < 4096)
+		size = 4096;
+	a->chunk_size = size;
+	new_chunk(a, size);
+	return a;
+}
+
+void arena_reserve(arena_t *a, size_t size) {
+	size = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+	if (a->chunks->size - a->chunks->used >= size)
+		return;
+	new_chunk(a, size > a->chunk_size ? size : a->chunk_size);
+}
+
+void *arena_alloc(arena_t *a, size_t n) {
+	n = (n + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+	arena_reserve(a, n);
+	void *p = a->chunks->data + a->chunks->used;
+	a->chunks->used += n;
+	a->allocated += n;
+	return p;
+}
+
+char *arena_sprintf(arena_t *a, const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(NULL, 0, fmt, args);
+	va_end(args);
+
+	char *s = arena_alloc(a, len + 1);
+	va_start(args, fmt);
+	vsnprintf(s, len + 1, fmt, args);
+	va_end(args);
+	return s;
+}
+
+void arena_destroy(arena_t *a) {
+	if (a == NULL)
+		return;
+	arena_chunk_t *c = a->chunks;
+	while (c) {
+		arena_chunk_t *next = c->next;
+		free(c);
+		c = next;
+	}
+	free(a);
+}
@@ -7,36 +7,39 @@
 #include <string.h>
 #include <stdio.h>
 #include "create-snps.h"
+#include "definitions.h"
 #include "primers.h"
 #include "structs.h"
 #include "seqs_to_ints.h"
 
 
 
-void create_all_snps(char *adapter, int kmer, char* seqid, kmer_bst_t *primers, bool verbose) {
+void create_all_snps(char *adapter, int kmer, uint32_t base, kmer_bst_t *primers, arena_t *arena, char **names, bool verbose) {
 	/*
 	 * calculate a SNP at every position. This is O(3*k) where k is length of kmer
+	 *
+	 * We don't need to write the names of the SNPs, just the position and the bases.
 	 */
 
 	uint64_t enc = kmer_encoding(adapter, 0, kmer);
-	add_primer(enc, seqid, primers);
+	primer_name_t name = {base, -1, 0, 0};
+	add_primer(enc, name, primers, arena);
 
-	char *base = "ACGT";
+	char *bases = "ACGT";
+	char snp[MAXKMER+1];
+	memcpy(snp, adapter, kmer);
+	snp[kmer] = '\0';
 	for (int i = 0; i < kmer; i++) {
-		char* snp = malloc(sizeof(char) * strlen(adapter)+1);
-		strcpy(snp, adapter);
 		for (int j = 0; j<4; j++) {
-			if (adapter[i] == base[j])
+			if (adapter[i] == bases[j])
 				continue;
-			snp[i] = base[j];
-			char* name = malloc(sizeof(char) * (strlen(seqid) + 10));
-			sprintf(name, "%s %d %c->%c", seqid, i, adapter[i], snp[i]);
+			snp[i] = bases[j];
+			primer_name_t snpname = {base, i, adapter[i], snp[i]};
 			uint64_t encs = kmer_encoding(snp, 0, kmer);
-			add_primer(encs, name, primers);
+			add_primer(encs, snpname, primers, arena);
 			if (verbose)
-				fprintf(stderr, "Added primer: %s (%s) enc: %ld\n", name, snp, encs);
+				fprintf(stderr, "Added primer: %s %d %c->%c (%s) enc: %ld\n", names[base], i, adapter[i], snp[i], snp, encs);
 		}
+		snp[i] = adapter[i];
 	}
 }
-
-
@@ -0,0 +1,184 @@
+/*
+ * Demultiplex the reads by an inline barcode at the start of R1, while we trim them.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "arena.h"
+#include "colours.h"
+#include "create-snps.h"
+#include "definitions.h"
+#include "demux.h"
+#include "kseq.h"
+#include "primers.h"
+#include "seqs_to_ints.h"
+
+KSEQ_INIT(gzFile, gzread);
+
+static bool acgt(char c) {
+	return c == 'A' || c == 'C' || c == 'G' || c == 'T';
+}
+
+/*
+ * Open dir/name_read.fastq.gz (or .fastq or .fastq.zst for the other formats)
+ */
+static writer_t *open_output(char *dir, char *name, char *read, struct options *opt) {
+	char *ext = format_extension(opt->out_format == FORMAT_AUTO ? FORMAT_GZIP : opt->out_format);
+	size_t len = strlen(dir) + strlen(name) + strlen(ext) + 8;
+	char *file = malloc(len);
+	snprintf(file, len, "%s/%s_%s%s", dir, name, read, ext);
+	writer_t *w = writer_open(file, opt);
+	free(file);
+	return w;
+}
+
+demux_t *demux_open(char *barcodefile, char *dir, bool paired, struct options *opt) {
+	gzFile fp = gzopen(barcodefile, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "%sERROR: The file %s can not be found. Please check the file path%s\n", RED, barcodefile, ENDC);
+		exit(3);
+	}
+	demux_t *d = calloc(1, sizeof(demux_t));
+	d->arena = arena_create(1 << 16);
+	d->barcodes = new_primer_root(d->arena);
+	d->mismatches = 1;
+
+	// read the barcodes first, so we know if they are far enough apart to allow a mismatch
+	kseq_t *seq = kseq_init(fp);
+	int size = 64;
+	char **seqs = malloc(sizeof(char *) * size);
+	d->names = malloc(sizeof(char *) * size);
+	while (kseq_read(seq) >= 0) {
+		if (d->n == 0)
+			d->k = seq->seq.l;
+		if (seq->seq.l != (size_t) d->k || d->k == 0 || d->k > MAXKMER) {
+			fprintf(stderr, "%sERROR: The barcodes in %s must all be the same length, and no more than %d bp. %s is %zu bp%s\n", RED, barcodefile, MAXKMER, seq->name.s, seq->seq.l, ENDC);
+			exit(EXIT_FAILURE);
+		}
+		for (int i=0; i<d->k; i++) {
+			if (!acgt(seq->seq.s[i])) {
+				fprintf(stderr, "%sERROR: Barcode %s can only have A, C, G, and T%s\n", RED, seq->name.s, ENDC);
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (d->n == size - 1) {
+			size *= 2;
+			seqs = realloc(seqs, sizeof(char *) * size);
+			d->names = realloc(d->names, sizeof(char *) * size);
+		}
+		seqs[d->n] = arena_sprintf(d->arena, "%s", seq->seq.s);
+		d->names[d->n] = arena_sprintf(d->arena, "%s", seq->name.s);
+		d->n++;
+	}
+	kseq_destroy(seq);
+	gzclose(fp);
+	if (d->n == 0) {
+		fprintf(stderr, "%sERROR: There are no barcodes in %s%s\n", RED, barcodefile, ENDC);
+		exit(EXIT_FAILURE);
+	}
+	d->names[d->n] = "unassigned";
+
+	// with a mismatch, two barcodes that are less than 3 bp apart could both match a read
+	for (int i=0; i<d->n && d->mismatches; i++) {
+		for (int j=i+1; j<d->n; j++) {
+			int diff = 0;
+			for (int p=0; p<d->k; p++)
+				diff += seqs[i][p] != seqs[j][p];
+			if (diff < 3) {
+				fprintf(stderr, "%sWARNING: Barcodes %s and %s are only %d bp apart, so we only use exact matches%s\n", BLUE, d->names[i], d->names[j], diff, ENDC);
+				d->mismatches = 0;
+				break;
+			}
+		}
+	}
+
+	for (int i=0; i<d->n; i++) {
+		if (d->mismatches) {
+			create_all_snps(seqs[i], d->k, i, d->barcodes, d->arena, d->names, false);
+		} else {
+			primer_name_t name = {i, -1, 0, 0};
+			add_primer(kmer_encoding(seqs[i], 0, d->k), name, d->barcodes, d->arena);
+		}
+		if (opt->verbose)
+			fprintf(stderr, "%sAdded barcode %s: %s%s\n", GREEN, d->names[i], seqs[i], ENDC);
+	}
+	free(seqs);
+
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+		fprintf(stderr, "%sERROR: Can not make the directory %s%s\n", RED, dir, ENDC);
+		exit(3);
+	}
+	d->reads = calloc(d->n + 1, sizeof(uint64_t));
+	for (int s=0; s<(paired ? 2 : 1); s++) {
+		d->out[s] = malloc(sizeof(writer_t *) * (d->n + 1));
+		for (int i=0; i<=d->n; i++)
+			d->out[s][i] = open_output(dir, d->names[i], s == 0 ? "R1" : "R2", opt);
+	}
+	return d;
+}
+
+/*
+ * Which barcode seq starts with. An N counts as the mismatch, so we try all four bases there and
+ * only take an exact match
+ */
+static int match_barcode(demux_t *d, char *seq) {
+	int n_posn = -1;
+	for (int i=0; i<d->k; i++) {
+		if (acgt(seq[i]))
+			continue;
+		if (n_posn > -1 || d->mismatches == 0)
+			return d->n;
+		n_posn = i;
+	}
+	if (n_posn < 0) {
+		kmer_bst_t *b = find_primer(kmer_encoding(seq, 0, d->k), d->barcodes);
+		return b ? (int) b->name.base : d->n;
+	}
+	char copy[MAXKMER];
+	memcpy(copy, seq, d->k);
+	for (int j=0; j<4; j++) {
+		copy[n_posn] = "ACGT"[j];
+		kmer_bst_t *b = find_primer(kmer_encoding(copy, 0, d->k), d->barcodes);
+		if (b && b->name.snp_posn < 0)
+			return b->name.base;
+	}
+	return d->n;
+}
+
+int demux_read(demux_t *d, fastq_record_t *read) {
+	if (read->seq.l < (size_t) d->k)
+		return d->n;
+	int b = match_barcode(d, read->seq.s);
+	if (b == d->n)
+		return b;
+	// the barcode is only a few bp, so we just move the rest of the read along
+	read->seq.l -= d->k;
+	memmove(read->seq.s, read->seq.s + d->k, read->seq.l + 1);
+	if (read->qual.l >= (size_t) d->k) {
+		read->qual.l -= d->k;
+		memmove(read->qual.s, read->qual.s + d->k, read->qual.l + 1);
+	}
+	return b;
+}
+
+void demux_close(demux_t *d) {
+	printf("\nBarcodes:\n");
+	for (int i=0; i<=d->n; i++) {
+		printf("%s\t%" PRIu64 "\n", d->names[i], d->reads[i]);
+		for (int s=0; s<2; s++)
+			if (d->out[s])
+				writer_close(d->out[s][i]);
+	}
+	free(d->out[0]);
+	free(d->out[1]);
+	free(d->reads);
+	free(d->names);
+	arena_destroy(d->arena);
+	free(d);
+}
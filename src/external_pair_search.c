@@ -0,0 +1,643 @@
+/*
+ * The paired end search for R1 and R2 files that are not in the same order, or that have too
+ * many reads to keep the R1 reads in memory (--external-pairs). Instead of the hash table of R1
+ * reads that paired_end_search uses, we:
+ *
+ * 1. search R1 and then R2, and write a small tuple for each read (two hashes of its name, where
+ *    it is in the file, and where we want to trim it) to temp runs, partitioned by the top bits
+ *    of the hash. Mates have the same name, so they are always in the same partition
+ * 2. join the R1 and R2 tuples one partition at a time, so only one partition of R1 is in memory,
+ *    and write where to trim each read (and whether to keep it) to a temp file by its ordinal
+ * 3. read R1 and R2 again, and write them with those trims
+ *
+ * We compare 96 bits of hash rather than the names, so the tuples are the same size for every read.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "colours.h"
+#include "definitions.h"
+#include "demux.h"
+#include "fastq-batch.h"
+#include "hash.h"
+#include "memory-budget.h"
+#include "pairs.h"
+#include "primer-index.h"
+#include "primer-match-counts.h"
+#include "progress.h"
+#include "search.h"
+#include "search-read.h"
+#include "shards.h"
+#include "structs.h"
+#include "trace.h"
+#include "trim-list.h"
+
+#define PARTITIONS (1 << PAIR_PARTITION_BITS)
+
+/*
+ * What we remember about each read. The R1 tuples are followed by the UMI
+ */
+typedef struct pair_tuple {
+	uint64_t hash;
+	uint64_t ordinal;  // which read it is in the file
+	uint32_t check;    // a second hash of the name
+	int32_t trim;      // the adapter, or -1
+	int32_t end_trim;  // where the quality drops or the poly-G/A tail starts, or -1
+	int32_t len;
+	int32_t barcode;   // the --demux barcode (R1 only)
+} pair_tuple_t;
+
+/*
+ * Where to trim each read, by its ordinal. The R2 finals are followed by the UMI of R1
+ */
+typedef struct pair_final {
+	int32_t trim;      // where we trim the read, or -1
+	int32_t from;      // the adapter before and after we compared it to the mate, for --adjustments
+	int32_t to;
+	int32_t barcode;   // the --demux barcode of the pair
+	uint8_t keep;      // are both reads long enough
+	uint8_t matched;   // did we find the mate
+	uint8_t adjusted;  // PAIR_SAME, PAIR_R1_ADJUSTED, or PAIR_R2_ADJUSTED
+} pair_final_t;
+
+typedef struct run {
+	off_t offset;
+	uint32_t n;
+} run_t;
+
+/*
+ * The tuples for one file. We keep cap tuples for each partition in memory, and then write
+ * them to the end of the temp file as a run
+ */
+typedef struct runs {
+	FILE *fp;
+	size_t rec;            // the size of each tuple
+	size_t cap;
+	off_t end;
+	char *buf[PARTITIONS];
+	uint32_t nbuf[PARTITIONS];
+	run_t *runs[PARTITIONS];
+	uint32_t nruns[PARTITIONS];
+	uint32_t runs_size[PARTITIONS];
+	uint64_t count[PARTITIONS];
+} runs_t;
+
+typedef struct finals {
+	FILE *fp;
+	size_t rec;
+	char *buf;
+} finals_t;
+
+/*
+ * FNV-1a with a final mix, so the top bits (which choose the partition) depend on the whole name
+ */
+static uint64_t name_hash(char *s) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (; *s; s++)
+		h = (h ^ (unsigned char) *s) * 0x100000001b3ULL;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static runs_t *runs_init(char *what, size_t umi_bytes, size_t memory) {
+	runs_t *r = calloc(1, sizeof(runs_t));
+	if (r == NULL) {
+		fprintf(stderr, "%sERROR: Can't allocate memory for the %s%s\n", RED, what, ENDC);
+		exit(2);
+	}
+	r->fp = temp_file(what);
+	r->rec = sizeof(pair_tuple_t) + umi_bytes;
+	// by default 1,024 tuples for each partition. With --max-memory we use up to a quarter of it here
+	r->cap = 1024;
+	if (memory) {
+		r->cap = memory / 4 / PARTITIONS / r->rec;
+		if (r->cap < 16)
+			r->cap = 16;
+	}
+	return r;
+}
+
+static void runs_flush(runs_t *r, int p) {
+	if (r->nbuf[p] == 0)
+		return;
+	if (r->nruns[p] == r->runs_size[p]) {
+		r->runs_size[p] = r->runs_size[p] ? r->runs_size[p] * 2 : 16;
+		r->runs[p] = realloc(r->runs[p], sizeof(run_t) * r->runs_size[p]);
+		if (r->runs[p] == NULL) {
+			fprintf(stderr, "%sERROR: Can't allocate memory for the temp runs%s\n", RED, ENDC);
+			exit(2);
+		}
+	}
+	if (fwrite(r->buf[p], r->rec, r->nbuf[p], r->fp) != r->nbuf[p]) {
+		fprintf(stderr, "%sERROR: We could not write the reads to the temp file. Is $TMPDIR full?%s\n", RED, ENDC);
+		exit(3);
+	}
+	r->runs[p][r->nruns[p]++] = (run_t) {r->end, r->nbuf[p]};
+	r->end += (off_t) r->nbuf[p] * r->rec;
+	r->nbuf[p] = 0;
+}
+
+static void runs_add(runs_t *r, pair_tuple_t *t, char *umi) {
+	int p = t->hash >> (64 - PAIR_PARTITION_BITS);
+	if (r->buf[p] == NULL) {
+		r->buf[p] = malloc(r->cap * r->rec);
+		if (r->buf[p] == NULL) {
+			fprintf(stderr, "%sERROR: Can't allocate memory for the temp runs%s\n", RED, ENDC);
+			exit(2);
+		}
+	}
+	char *rec = r->buf[p] + r->nbuf[p] * r->rec;
+	memcpy(rec, t, sizeof(pair_tuple_t));
+	if (r->rec > sizeof(pair_tuple_t)) {
+		memset(rec + sizeof(pair_tuple_t), 0, r->rec - sizeof(pair_tuple_t));
+		if (umi)
+			memcpy(rec + sizeof(pair_tuple_t), umi, strlen(umi));
+	}
+	r->count[p]++;
+	if (++r->nbuf[p] == r->cap)
+		runs_flush(r, p);
+}
+
+/*
+ * Write what is left in the buffers, and free them
+ */
+static void runs_finish(runs_t *r) {
+	for (int p=0; p<PARTITIONS; p++) {
+		runs_flush(r, p);
+		free(r->buf[p]);
+		r->buf[p] = NULL;
+	}
+	fflush(r->fp);
+}
+
+static void read_run(runs_t *r, run_t *run, char *buf) {
+	if (fseeko(r->fp, run->offset, SEEK_SET) != 0 || fread(buf, r->rec, run->n, r->fp) != run->n) {
+		fprintf(stderr, "%sERROR: We could not read the reads back from the temp file%s\n", RED, ENDC);
+		exit(3);
+	}
+}
+
+static void runs_destroy(runs_t *r) {
+	fclose(r->fp);
+	for (int p=0; p<PARTITIONS; p++)
+		free(r->runs[p]);
+	free(r);
+}
+
+static finals_t *finals_init(char *what, size_t umi_bytes) {
+	finals_t *f = calloc(1, sizeof(finals_t));
+	f->fp = temp_file(what);
+	f->rec = sizeof(pair_final_t) + umi_bytes;
+	f->buf = calloc(1, f->rec);
+	return f;
+}
+
+static void finals_write(finals_t *f, uint64_t ordinal, pair_final_t *final, char *umi) {
+	memcpy(f->buf, final, sizeof(pair_final_t));
+	if (f->rec > sizeof(pair_final_t))
+		memcpy(f->buf + sizeof(pair_final_t), umi, f->rec - sizeof(pair_final_t));
+	if (pwrite(fileno(f->fp), f->buf, f->rec, ordinal * f->rec) != (ssize_t) f->rec) {
+		fprintf(stderr, "%sERROR: We could not write the trims to the temp file. Is $TMPDIR full?%s\n", RED, ENDC);
+		exit(3);
+	}
+}
+
+/*
+ * The final for the next read in the file, and its UMI (or NULL)
+ */
+static bool finals_next(finals_t *f, pair_final_t *final, char **umi) {
+	if (fread(f->buf, f->rec, 1, f->fp) != 1)
+		return false;
+	memcpy(final, f->buf, sizeof(pair_final_t));
+	*umi = f->rec > sizeof(pair_final_t) && f->buf[sizeof(pair_final_t)] ? f->buf + sizeof(pair_final_t) : NULL;
+	return true;
+}
+
+static void finals_destroy(finals_t *f) {
+	fclose(f->fp);
+	free(f->buf);
+	free(f);
+}
+
+/*
+ * Step 1. Search R1 or R2, and write a tuple for each read
+ */
+static void search_pass(struct options *opt, int stream, runs_t *runs, read_batch_t *batch, COUNTS *counts, primer_counts_t *pc, int *nbatch) {
+	bool R1 = stream == PROGRESS_R1;
+	char *file = R1 ? opt->R1_file : opt->R2_file;
+	char *matches = R1 ? opt->R1_matches : opt->R2_matches;
+	char name[MAXNAMELEN]; // the name of the primer we found
+
+	fastq_reader_t *reader = fastq_open(file);
+	if (reader == NULL) {
+		fprintf(stderr, "%sERROR: Can not open %s%s\n", RED, file, ENDC);
+		exit(3);
+	}
+	fastq_time_inflate(reader, opt->trace != NULL);
+	if (R1)
+		fastq_umi(reader, opt->umi_pattern);
+	FILE *match_out = NULL;
+	if (matches)
+		match_out = fopen(matches, "w");
+
+	int *seqs = R1 ? &counts->R1_seqs : &counts->R2_seqs;
+	int *found = R1 ? &counts->R1_found : &counts->R2_found;
+	int *poly = R1 ? &counts->R1_poly : &counts->R2_poly;
+	uint64_t will_trim = 0;
+	uint64_t ordinal = 0;
+	bool warning_printed = false;
+	while (true) {
+		uint64_t read_start = trace_now();
+		if (fastq_read_batch(reader, batch) == 0)
+			break;
+		uint64_t search_start = trace_now();
+		trace_read_span(opt->trace, TRACE_MAIN, read_start, search_start, fastq_inflate_ns(reader), *nbatch, batch->n);
+
+		// we take the barcodes off R1 before we search for the adapters
+		int barcodes[READ_BATCH_SIZE];
+		if (R1 && opt->demux) {
+			for (int r=0; r<batch->n; r++) {
+				barcodes[r] = demux_read(opt->demux, &batch->reads[r]);
+				opt->demux->reads[barcodes[r]]++;
+			}
+		}
+		search_batch(opt->index, opt, batch);
+		uint64_t store_start = trace_now();
+		trace_span(opt->trace, TRACE_MAIN, "search", search_start, store_start, *nbatch, batch->n);
+
+		for (int r=0; r<batch->n; r++) {
+			fastq_record_t *read = &batch->reads[r];
+			search_hit_t *hit = &batch->hits[r];
+			(*seqs)++;
+			if (opt->verbose && !warning_printed && hit->ambiguous) {
+				fprintf(stderr, "%sWARNING: sequences have an N. We don't look for adapters that overlap them%s\n", BLUE, ENDC);
+				warning_printed = true;
+			}
+			if (hit->trim > -1) {
+				if (matches)
+					fprintf(match_out, "%s\t%s\t%s\t%d\t-%ld\n", R1 ? "R1" : "R2", hit_name(hit, name, MAXNAMELEN), read->name.s, hit->trim, read->seq.l-hit->trim);
+				(*found)++;
+				count_primer_occurrence(pc, hit_name(hit, name, MAXNAMELEN), hit->before, hit->after);
+			}
+			if (trim_point(hit) > -1)
+				will_trim++;
+			if (hit->poly_trim > -1)
+				(*poly)++;
+
+			pair_tuple_t t = {
+				.hash = name_hash(read->name.s),
+				.ordinal = ordinal++,
+				.check = hash(read->name.s),
+				.trim = hit->trim,
+				.end_trim = end_trim(hit),
+				.len = read->seq.l,
+				.barcode = R1 && opt->demux ? barcodes[r] : 0,
+			};
+			runs_add(runs, &t, read->umi.l ? read->umi.s : NULL);
+		}
+		uint64_t store_end = trace_now();
+		trace_span(opt->trace, TRACE_MAIN, "runs", store_start, store_end, *nbatch, batch->n);
+		progress_update(opt->progress, stream, *seqs, will_trim, 0, fastq_offset(reader), NULL);
+		(*nbatch)++;
+	}
+	runs_finish(runs);
+	fastq_close(reader);
+	if (match_out)
+		fclose(match_out);
+}
+
+/*
+ * Is a read with this adapter trim (after we compared it to its mate) long enough to keep
+ */
+static bool long_enough(struct options *opt, pair_tuple_t *t, int trim) {
+	int len = earliest_trim(trim, t->end_trim);
+	if (len < 0 || len > t->len)
+		len = t->len;
+	return len > opt->min_sequence_length;
+}
+
+/*
+ * Step 2. Find the mates one partition at a time. Returns how many R2 reads don't have an R1
+ */
+static uint64_t join(struct options *opt, runs_t *R1runs, runs_t *R2runs, finals_t *R1finals, finals_t *R2finals, COUNTS *counts) {
+	size_t umi_bytes = R1runs->rec - sizeof(pair_tuple_t);
+	char *R1s = NULL;          // the R1 tuples of the partition
+	bool *matched = NULL;
+	uint32_t *table = NULL;    // an open addressing hash table of R1s (index + 1)
+	size_t size = 0;
+	char *R2s = malloc(R2runs->cap * R2runs->rec);
+	char *no_umi = calloc(1, umi_bytes + 1);
+	bool warned = false;
+	uint64_t unmatched = 0;
+
+	for (int p=0; p<PARTITIONS; p++) {
+		uint64_t n = R1runs->count[p];
+		if (n > size) {
+			size = n;
+			R1s = realloc(R1s, n * R1runs->rec);
+			matched = realloc(matched, n * sizeof(bool));
+		}
+		size_t tablesize = 1024;
+		while (tablesize < 2 * n)
+			tablesize *= 2;
+		table = realloc(table, tablesize * sizeof(uint32_t));
+		if ((n && (R1s == NULL || matched == NULL)) || table == NULL || R2s == NULL) {
+			fprintf(stderr, "%sERROR: Can't allocate memory to join %" PRIu64 " R1 reads%s\n", RED, n, ENDC);
+			exit(2);
+		}
+		if (opt->pair_memory && !warned && n * (R1runs->rec + 2 * sizeof(uint32_t) + 1) > opt->pair_memory) {
+			fprintf(stderr, "%sWARNING: There are %" PRIu64 " R1 reads in one partition, so we need more than --max-memory to join them%s\n", BLUE, n, ENDC);
+			warned = true;
+		}
+
+		char *next = R1s;
+		for (uint32_t i=0; i<R1runs->nruns[p]; i++) {
+			read_run(R1runs, &R1runs->runs[p][i], next);
+			next += R1runs->runs[p][i].n * R1runs->rec;
+		}
+		memset(table, 0, tablesize * sizeof(uint32_t));
+		memset(matched, 0, n * sizeof(bool));
+		for (uint64_t i=0; i<n; i++) {
+			pair_tuple_t *t = (pair_tuple_t *) (R1s + i * R1runs->rec);
+			size_t slot = t->hash & (tablesize - 1);
+			while (table[slot])
+				slot = (slot + 1) & (tablesize - 1);
+			table[slot] = i + 1;
+		}
+
+		for (uint32_t i=0; i<R2runs->nruns[p]; i++) {
+			run_t *run = &R2runs->runs[p][i];
+			read_run(R2runs, run, R2s);
+			for (uint32_t j=0; j<run->n; j++) {
+				pair_tuple_t R2;
+				memcpy(&R2, R2s + j * R2runs->rec, sizeof(R2));
+				pair_tuple_t *R1 = NULL;
+				size_t slot = R2.hash & (tablesize - 1);
+				for (; table[slot]; slot = (slot + 1) & (tablesize - 1)) {
+					pair_tuple_t *t = (pair_tuple_t *) (R1s + (table[slot] - 1) * R1runs->rec);
+					if (t->hash == R2.hash && t->check == R2.check) {
+						R1 = t;
+						matched[table[slot] - 1] = true;
+						break;
+					}
+				}
+
+				pair_final_t R2final = {R2.trim, R2.trim, R2.trim, opt->demux ? opt->demux->n : 0, true, false, PAIR_SAME};
+				if (R1 == NULL) {
+					R2final.trim = earliest_trim(R2.trim, R2.end_trim);
+					if (R2final.trim > -1)
+						counts->R2_trimmed++;
+					R2final.keep = long_enough(opt, &R2, R2.trim);
+					finals_write(R2finals, R2.ordinal, &R2final, no_umi);
+					unmatched++;
+					continue;
+				}
+				pair_final_t R1final = {R1->trim, R1->trim, R1->trim, R1->barcode, true, true, PAIR_SAME};
+				int R1_trim = R1->trim;
+				int R2_trim = R2.trim;
+				int adjusted = reconcile_trims(&R1_trim, &R2_trim);
+				if (adjusted == PAIR_SAME)
+					counts->same++;
+				else if (adjusted == PAIR_R1_ADJUSTED)
+					counts->R1_adjusted++;
+				else
+					counts->R2_adjusted++;
+				R1final.to = R1_trim;
+				R1final.trim = earliest_trim(R1_trim, R1->end_trim);
+				R1final.adjusted = adjusted;
+				R2final.to = R2_trim;
+				R2final.trim = earliest_trim(R2_trim, R2.end_trim);
+				if (R2final.trim > -1)
+					counts->R2_trimmed++;
+				R2final.adjusted = adjusted;
+				R2final.barcode = R1->barcode;
+				R2final.matched = true;
+				// we only keep the pair if they are both long enough
+				R1final.keep = R2final.keep = long_enough(opt, &R2, R2_trim) && long_enough(opt, R1, R1_trim);
+				finals_write(R1finals, R1->ordinal, &R1final, NULL);
+				finals_write(R2finals, R2.ordinal, &R2final, (char *) (R1 + 1));
+			}
+		}
+
+		// and the R1 reads that don't have a mate
+		for (uint64_t i=0; i<n; i++) {
+			if (matched[i])
+				continue;
+			pair_tuple_t *t = (pair_tuple_t *) (R1s + i * R1runs->rec);
+			pair_final_t R1final = {earliest_trim(t->trim, t->end_trim), t->trim, t->trim, t->barcode, true, false, PAIR_SAME};
+			finals_write(R1finals, t->ordinal, &R1final, NULL);
+		}
+	}
+	free(R1s);
+	free(R2s);
+	free(matched);
+	free(table);
+	free(no_umi);
+	rewind(R1finals->fp);
+	rewind(R2finals->fp);
+	return unmatched;
+}
+
+/*
+ * Step 3. Read R1 or R2 again, and write the reads with the trims from the join
+ */
+static void write_pass(struct options *opt, int stream, finals_t *finals, read_batch_t *batch, COUNTS *counts, FILE *adjust, int *nbatch, uint64_t bytes_before) {
+	bool R1 = stream == PROGRESS_R1;
+	char *file = R1 ? opt->R1_file : opt->R2_file;
+	char *output_file = R1 ? opt->R1_output : opt->R2_output;
+	char *label = R1 ? "R1" : "R2";
+
+	fastq_reader_t *reader = fastq_open(file);
+	if (reader == NULL) {
+		fprintf(stderr, "%sERROR: Can not open %s%s\n", RED, file, ENDC);
+		exit(3);
+	}
+	fastq_time_inflate(reader, opt->trace != NULL);
+	if (R1)
+		fastq_umi(reader, opt->umi_pattern);
+
+	shards_t *output = NULL;
+	if (output_file && !opt->demux)
+		output = shards_open(output_file, opt->shards, opt->shard_reads, opt);
+	shards_t *discarded = NULL;
+	if (opt->discarded) {
+		char *discarded_file = output_name(opt->discarded, label);
+		discarded = shards_open(discarded_file, 1, 1, opt);
+		free(discarded_file);
+	}
+	trim_list_t *trims = NULL;
+	if (opt->trim_list) {
+		char *trim_list_file = output_name(opt->trim_list, label);
+		trims = trim_list_create(trim_list_file);
+		free(trim_list_file);
+	}
+
+	int *seqs = R1 ? &counts->R1_seqs : &counts->R2_seqs;
+	int *dimers = R1 ? &counts->R1_dimers : &counts->R2_dimers;
+	int *discarded_count = R1 ? &counts->R1_discarded : &counts->R2_discarded;
+	uint64_t ordinal = 0;
+	uint64_t written = 0;
+	uint64_t will_trim = 0;
+	while (true) {
+		uint64_t read_start = trace_now();
+		if (fastq_read_batch(reader, batch) == 0)
+			break;
+		uint64_t write_start = trace_now();
+		trace_read_span(opt->trace, TRACE_MAIN, read_start, write_start, fastq_inflate_ns(reader), *nbatch, batch->n);
+
+		for (int r=0; r<batch->n; r++) {
+			fastq_record_t *read = &batch->reads[r];
+			uint64_t read_ordinal = ordinal++;
+			pair_final_t final;
+			char *umi;
+			if (!finals_next(finals, &final, &umi)) {
+				fprintf(stderr, "%sERROR: %s has more reads than the first time we read it%s\n", RED, file, ENDC);
+				exit(3);
+			}
+			// take the barcode off again so the trim positions are the same as the first time
+			int barcode = final.barcode;
+			if (R1 && opt->demux)
+				barcode = demux_read(opt->demux, read);
+			if (!R1) {
+				if (!final.matched)
+					fprintf(stderr, "%s We did not find an R1 that matches %s%s\n", PINK, read->name.s, ENDC);
+				else if (umi)
+					fastq_record_umi(read, umi);
+			}
+			if (adjust && final.adjusted == (R1 ? PAIR_R1_ADJUSTED : PAIR_R2_ADJUSTED))
+				fprintf(adjust, "%s\t%s\t%d\t%d\n", label, read->name.s, final.from, final.to);
+
+			int trim = final.trim;
+			if (trim > -1) {
+				// we counted the R2 reads we trim in the join, as paired_end_search does while it searches R2
+				if (R1)
+					counts->R1_trimmed++;
+				will_trim++;
+			}
+			if (trim == 0) {
+				// an adapter dimer: there is nothing left of the read to trim or format
+				(*dimers)++;
+				(*discarded_count)++;
+				if (trims)
+					trim_list_add(trims, read->seq.l, trim, false);
+				if (discarded)
+					write_empty_fastq_record(shard_out(discarded, 0), read);
+				continue;
+			}
+			size_t len = read->seq.l;
+			if (trim > 0) {
+				if (opt->debug)
+					fprintf(stderr, "Trimming %s %s from %ld to %d\n", label, read->name.s, read->seq.l, trim);
+				trim_fastq_record(read, trim);
+			}
+			bool keep = final.keep && read->seq.l > (size_t) opt->min_sequence_length;
+			if (trims)
+				trim_list_add(trims, len, trim, keep);
+			if (!keep) {
+				(*discarded_count)++;
+				if (discarded)
+					write_fastq_record(shard_out(discarded, 0), read);
+				continue;
+			}
+			FILE *out = opt->demux ? demux_out(opt->demux, stream, barcode) : output ? shard_out(output, read_ordinal) : NULL;
+			if (out) {
+				write_fastq_record(out, read);
+				written++;
+			}
+		}
+		uint64_t write_end = trace_now();
+		trace_span(opt->trace, TRACE_MAIN, "write", write_start, write_end, *nbatch, batch->n);
+		progress_update(opt->progress, stream, *seqs, will_trim, written, bytes_before + fastq_offset(reader), shards_pipe(output));
+		(*nbatch)++;
+	}
+	if (output)
+		shards_close(output);
+	if (discarded)
+		shards_close(discarded);
+	if (trims)
+		trim_list_close(trims);
+	fastq_close(reader);
+}
+
+void external_pair_search(struct options *opt) {
+	fprintf(stderr, "EXTERNAL PAIRWISE searching\n");
+
+	if (opt->R1_file == NULL || opt->R2_file == NULL) {
+		fprintf(stderr, "%sPlease provide both R1 and R2 files for paired end trimming%s\n", RED, ENDC);
+		exit(EXIT_FAILURE);
+	}
+
+	COUNTS counts = {};
+	primer_counts_t *pc = malloc(sizeof(primer_counts_t));
+	pc->id = NULL;
+	pc->count = 0;
+	pc->next_primer = NULL;
+	for (int i=0; i<5; i++) {
+		pc->before[i] = 0;
+		pc->after[i] = 0;
+	}
+
+	trace_thread_name(opt->trace, TRACE_MAIN, "external pair search");
+	read_batch_t *batch = read_batch_init(opt->batch_reads);
+	int nbatch = 0;
+
+	// the UMIs are the N's of the pattern, and R2 gets the one from its R1. We keep them with at
+	// least one \0 after them, and the tuples 8 byte aligned
+	size_t umi_bytes = 0;
+	for (char *c = opt->umi_pattern; c && *c; c++)
+		umi_bytes += *c == 'N';
+	if (umi_bytes)
+		umi_bytes = (umi_bytes + 8) & ~(size_t) 7;
+
+	runs_t *R1runs = runs_init("R1 runs", umi_bytes, opt->pair_memory);
+	search_pass(opt, PROGRESS_R1, R1runs, batch, &counts, pc, &nbatch);
+	runs_t *R2runs = runs_init("R2 runs", 0, opt->pair_memory);
+	search_pass(opt, PROGRESS_R2, R2runs, batch, &counts, pc, &nbatch);
+
+	uint64_t join_start = trace_now();
+	finals_t *R1finals = finals_init("R1 trims", 0);
+	finals_t *R2finals = finals_init("R2 trims", umi_bytes);
+	uint64_t unmatched = join(opt, R1runs, R2runs, R1finals, R2finals, &counts);
+	trace_span(opt->trace, TRACE_MAIN, "join", join_start, trace_now(), nbatch, 0);
+	runs_destroy(R1runs);
+	runs_destroy(R2runs);
+
+	FILE *adjust = NULL;
+	if (opt->adjustments) {
+		adjust = fopen(opt->adjustments, "w");
+		fprintf(adjust, "R1/R2\tSeq ID\tFrom\tTo\n");
+	}
+	// we only need to read the files again if we are going to write something
+	if (opt->R1_output || opt->R2_output || opt->demux || opt->discarded || opt->adjustments || opt->trim_list) {
+		write_pass(opt, PROGRESS_R1, R1finals, batch, &counts, adjust, &nbatch, 0);
+		write_pass(opt, PROGRESS_R2, R2finals, batch, &counts, adjust, &nbatch, 0);
+	} else if (unmatched) {
+		fprintf(stderr, "%s We did not find an R1 that matches %" PRIu64 " R2 reads%s\n", PINK, unmatched, ENDC);
+	}
+	if (adjust)
+		fclose(adjust);
+	finals_destroy(R1finals);
+	finals_destroy(R2finals);
+	read_batch_destroy(batch);
+
+	printf("Total sequences: R1 %d R2 %d\n", counts.R1_seqs, counts.R2_seqs);
+	printf("Primer found: R1 %d R2 %d\n", counts.R1_found, counts.R2_found);
+	printf("Same Offset: %d (includes no adapter)\n", counts.same);
+	printf("Adjusted offset: R1 %d R2 %d\n", counts.R1_adjusted, counts.R2_adjusted);
+	printf("Sequences trimmed: R1 %d R2 %d\n", counts.R1_trimmed, counts.R2_trimmed);
+	if (opt->poly_g || opt->poly_a)
+		printf("Poly-G/A tails: R1 %d R2 %d\n", counts.R1_poly, counts.R2_poly);
+	printf("Adapter dimers: R1 %d R2 %d\n", counts.R1_dimers, counts.R2_dimers);
+	printf("Discarded: R1 %d R2 %d\n", counts.R1_discarded, counts.R2_discarded);
+
+	printf("\nAdapter occurrences:\n");
+	print_primers(pc, opt->primer_occurrences);
+}
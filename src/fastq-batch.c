@@ -0,0 +1,293 @@
+/*
+ * Read fastq files a batch at a time, and write the reads back out again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "colours.h"
+#include "fastq-batch.h"
+#include "kseq.h"
+#include "structs.h"
+#include "trace.h"
+
+#ifdef HAVE_ZSTD
+/*
+ * A zstd compressed input. zlib reads gzip, bgzf (which is just gzip), and uncompressed files
+ */
+typedef struct zstd_in {
+	FILE *file;
+	ZSTD_DCtx *dctx;
+	ZSTD_inBuffer in;
+	void *buf;
+	bool eof;
+} zstd_in_t;
+
+static int zstd_read(zstd_in_t *z, void *buf, unsigned len) {
+	ZSTD_outBuffer out = {buf, len, 0};
+	while (out.pos == 0) {
+		if (z->in.pos == z->in.size && !z->eof) {
+			z->in.size = fread(z->buf, 1, ZSTD_DStreamInSize(), z->file);
+			z->in.pos = 0;
+			z->eof = z->in.size == 0;
+		}
+		size_t ret = ZSTD_decompressStream(z->dctx, &out, &z->in);
+		if (ZSTD_isError(ret)) {
+			fprintf(stderr, "%sERROR: zstd: %s%s\n", RED, ZSTD_getErrorName(ret), ENDC);
+			return -1;
+		}
+		if (z->eof)
+			break;
+	}
+	return out.pos;
+}
+
+static zstd_in_t *zstd_open(FILE *file) {
+	zstd_in_t *z = calloc(1, sizeof(zstd_in_t));
+	z->file = file;
+	z->dctx = ZSTD_createDCtx();
+	z->buf = malloc(ZSTD_DStreamInSize());
+	z->in.src = z->buf;
+	return z;
+}
+
+static void zstd_close(zstd_in_t *z) {
+	fclose(z->file);
+	ZSTD_freeDCtx(z->dctx);
+	free(z->buf);
+	free(z);
+}
+#endif
+
+struct fastq_reader {
+	gzFile fp;
+	void *zstd;          // the zstd_in_t if the file is zstd compressed, otherwise we read fp
+	void *seq;           // the kseq_t, which is only defined in this file
+	bool timed;
+	uint64_t inflate_ns;
+	char *umi;           // the --umi-pattern, or NULL
+	int umi_len;
+};
+
+static int raw_read(struct fastq_reader *reader, void *buf, unsigned len) {
+#ifdef HAVE_ZSTD
+	if (reader->zstd)
+		return zstd_read(reader->zstd, buf, len);
+#endif
+	return gzread(reader->fp, buf, len);
+}
+
+static int reader_read(struct fastq_reader *reader, void *buf, unsigned len) {
+	if (!reader->timed)
+		return raw_read(reader, buf, len);
+	uint64_t start = trace_now();
+	int n = raw_read(reader, buf, len);
+	reader->inflate_ns += trace_now() - start;
+	return n;
+}
+
+KSEQ_INIT(struct fastq_reader *, reader_read);
+
+/*
+ * Does the file start with the zstd magic number
+ */
+static bool is_zstd(char *filename) {
+	FILE *fp = fopen(filename, "rb");
+	if (fp == NULL)
+		return false;
+	unsigned char magic[4] = {0};
+	size_t n = fread(magic, 1, 4, fp);
+	fclose(fp);
+	return n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd;
+}
+
+fastq_reader_t *fastq_open(char *filename) {
+	fastq_reader_t *reader = calloc(1, sizeof(fastq_reader_t));
+	if (reader == NULL) {
+		fprintf(stderr, "%sERROR: Can't allocate memory to read %s%s\n", RED, filename, ENDC);
+		exit(2);
+	}
+	if (is_zstd(filename)) {
+#ifdef HAVE_ZSTD
+		reader->zstd = zstd_open(fopen(filename, "rb"));
+#else
+		fprintf(stderr, "%sERROR: %s is zstd compressed. Please rebuild with make ZSTD=1 to read it%s\n", RED, filename, ENDC);
+		exit(EXIT_FAILURE);
+#endif
+	} else {
+		// gzip, bgzf, and uncompressed files
+		reader->fp = gzopen(filename, "r");
+		if (reader->fp == NULL) {
+			free(reader);
+			return NULL;
+		}
+	}
+	reader->seq = kseq_init(reader);
+	return reader;
+}
+
+static void reserve_kstring(kstring_t *to, size_t l) {
+	if (to->m < l + 1) {
+		to->m = l + 1;
+		kroundup32(to->m);
+		to->s = realloc(to->s, to->m);
+		if (to->s == NULL) {
+			fprintf(stderr, "%sERROR: Can't allocate memory for a read of %zu bp%s\n", RED, l, ENDC);
+			exit(2);
+		}
+	}
+}
+
+static void copy_kstring(kstring_t *to, kstring_t *from, size_t start) {
+	// kseq may leave an old string in a member it didn't fill, so we only trust from->l
+	if (start > from->l)
+		start = from->l;
+	size_t l = from->l - start;
+	reserve_kstring(to, l);
+	if (l)
+		memcpy(to->s, from->s + start, l);
+	to->s[l] = '\0';
+	to->l = l;
+}
+
+/*
+ * Take the UMI bases from the start of seq, and return how many bases the read starts after
+ */
+static size_t take_umi(fastq_record_t *r, kstring_t *seq, char *pattern, int len) {
+	size_t skip = (size_t) len < seq->l ? (size_t) len : seq->l;
+	reserve_kstring(&r->umi, len);
+	r->umi.l = 0;
+	for (size_t i=0; i<skip; i++)
+		if (pattern[i] == 'N')
+			r->umi.s[r->umi.l++] = seq->s[i];
+	r->umi.s[r->umi.l] = '\0';
+	return skip;
+}
+
+int fastq_read_batch(fastq_reader_t *reader, read_batch_t *batch) {
+	kseq_t *seq = (kseq_t *) reader->seq;
+	batch->n = 0;
+	while (batch->n < batch->size && kseq_read(seq) >= 0) {
+		fastq_record_t *r = &batch->reads[batch->n++];
+		// we copy the read anyway, so we just start copying after the UMI
+		size_t skip = 0;
+		r->umi.l = 0;
+		if (reader->umi)
+			skip = take_umi(r, &seq->seq, reader->umi, reader->umi_len);
+		copy_kstring(&r->name, &seq->name, 0);
+		copy_kstring(&r->comment, &seq->comment, 0);
+		copy_kstring(&r->seq, &seq->seq, skip);
+		copy_kstring(&r->qual, &seq->qual, skip);
+	}
+	return batch->n;
+}
+
+uint64_t fastq_offset(fastq_reader_t *reader) {
+#ifdef HAVE_ZSTD
+	if (reader->zstd)
+		return (uint64_t) ftell(((zstd_in_t *) reader->zstd)->file);
+#endif
+	return (uint64_t) gzoffset(reader->fp);
+}
+
+void fastq_time_inflate(fastq_reader_t *reader, bool timed) {
+	reader->timed = timed;
+}
+
+uint64_t fastq_inflate_ns(fastq_reader_t *reader) {
+	uint64_t ns = reader->inflate_ns;
+	reader->inflate_ns = 0;
+	return ns;
+}
+
+void fastq_umi(fastq_reader_t *reader, char *pattern) {
+	reader->umi = pattern;
+	reader->umi_len = pattern ? strlen(pattern) : 0;
+}
+
+void fastq_close(fastq_reader_t *reader) {
+	kseq_destroy((kseq_t *) reader->seq);
+#ifdef HAVE_ZSTD
+	if (reader->zstd)
+		zstd_close(reader->zstd);
+#endif
+	if (reader->fp)
+		gzclose(reader->fp);
+	free(reader);
+}
+
+read_batch_t *read_batch_init(int size) {
+	read_batch_t *batch = malloc(sizeof(read_batch_t));
+	if (batch == NULL) {
+		fprintf(stderr, "%sERROR: Can't allocate memory for a batch of %d reads%s\n", RED, size, ENDC);
+		exit(2);
+	}
+	batch->n = 0;
+	batch->size = size;
+	batch->reads = calloc(size, sizeof(fastq_record_t));
+	batch->hits = calloc(size, sizeof(search_hit_t));
+	if (batch->reads == NULL || batch->hits == NULL) {
+		fprintf(stderr, "%sERROR: Can't allocate memory for a batch of %d reads%s\n", RED, size, ENDC);
+		exit(2);
+	}
+	return batch;
+}
+
+void read_batch_destroy(read_batch_t *batch) {
+	for (int i=0; i<batch->size; i++) {
+		free(batch->reads[i].name.s);
+		free(batch->reads[i].comment.s);
+		free(batch->reads[i].seq.s);
+		free(batch->reads[i].qual.s);
+		free(batch->reads[i].umi.s);
+	}
+	free(batch->reads);
+	free(batch->hits);
+	free(batch);
+}
+
+void trim_fastq_record(fastq_record_t *r, int trim) {
+	if (trim < 0 || trim >= r->seq.l)
+		return;
+	r->seq.s[trim] = '\0';
+	r->seq.l = trim;
+	if (r->qual.l > trim) {
+		r->qual.s[trim] = '\0';
+		r->qual.l = trim;
+	}
+}
+
+void fastq_record_umi(fastq_record_t *r, char *umi) {
+	kstring_t from = {strlen(umi), 0, umi};
+	copy_kstring(&r->umi, &from, 0);
+}
+
+void write_empty_fastq_record(FILE *out, fastq_record_t *r) {
+	fputc('@', out);
+	fputs(r->name.s, out);
+	if (r->umi.l) {
+		fputc('_', out);
+		fputs(r->umi.s, out);
+	}
+	if (r->comment.l) {
+		fputc(' ', out);
+		fputs(r->comment.s, out);
+	}
+	fputs("\n\n+\n\n", out);
+}
+
+void write_fastq_record(FILE *out, fastq_record_t *r) {
+	// no space after the name if there isn't a comment
+	char *space = r->comment.l ? " " : "";
+	char *comment = r->comment.l ? r->comment.s : "";
+	if (r->umi.l) {
+		fprintf(out, "@%s_%s%s%s\n%s\n+\n%s\n", r->name.s, r->umi.s, space, comment, r->seq.s, r->qual.s);
+		return;
+	}
+	fprintf(out, "@%s%s%s\n%s\n+\n%s\n", r->name.s, space, comment, r->seq.s, r->qual.s);
+}
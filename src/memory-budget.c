@@ -0,0 +1,145 @@
+/*
+ * Share --max-memory between the parts of the search. See memory-budget.h
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "colours.h"
+#include "definitions.h"
+#include "demux.h"
+#include "memory-budget.h"
+
+// the least we let the R1 reads have in --paired_end mode, so we don't spill every few reads
+#define MIN_PAIR_MEMORY (1 << 20)
+
+size_t parse_memory(char *s) {
+	char *end;
+	double n = strtod(s, &end);
+	if (end == s || n <= 0)
+		return 0;
+	switch (toupper(*end)) {
+		case 'T': n *= 1024;
+		// fall through
+		case 'G': n *= 1024;
+		// fall through
+		case 'M': n *= 1024;
+		// fall through
+		case 'K': n *= 1024;
+			end++;
+			break;
+		case '\0':
+			break;
+		default:
+			return 0;
+	}
+	// allow 4G, 4GB, and 4GiB
+	if (strcmp(end, "") != 0 && strcasecmp(end, "B") != 0 && strcasecmp(end, "iB") != 0)
+		return 0;
+	return (size_t) n;
+}
+
+/*
+ * How many output files we write at the same time
+ */
+static int count_outputs(struct options *opt) {
+	if (opt->demux)
+		return 2 * (opt->demux->n + 1) + (opt->discarded ? 2 : 0);
+	int n = 0;
+	if (opt->R1_output)
+		n += opt->shards;
+	if (opt->R2_output)
+		n += opt->shards;
+	if (opt->discarded)
+		n += 2;
+	return n;
+}
+
+/*
+ * The biggest prime that is no bigger than n. The name hash is simple, so the table size should be prime
+ */
+static size_t prime_below(size_t n) {
+	for (; n > 2; n--) {
+		bool prime = n % 2 == 1;
+		for (size_t d = 3; prime && d * d <= n; d += 2)
+			prime = n % d != 0;
+		if (prime)
+			return n;
+	}
+	return 2;
+}
+
+static void too_small(struct options *opt, size_t need) {
+	fprintf(stderr, "%sERROR: --max-memory %zu MB is too small. We need at least %zu MB for the index, the compressors, and the batches of reads%s\n",
+			RED, opt->max_memory >> 20, (need >> 20) + 1, ENDC);
+	exit(2);
+}
+
+void memory_plan(struct options *opt, bool paired_end) {
+	if (opt->max_memory == 0)
+		return;
+
+	size_t fixed = 0;
+	if (opt->index && !opt->index->mapped)
+		fixed += opt->index->flat_size;
+	fixed += (size_t) count_outputs(opt) * opt->out_threads * WRITER_THREAD_BYTES;
+
+	// the fast searches read R1 and R2 at the same time. The paired end search reads one at a time
+	int streams = paired_end || opt->R1_file == NULL || opt->R2_file == NULL ? 1 : 2;
+	// give the batches up to an eighth of what is left, but not less than we search together
+	size_t left = opt->max_memory > fixed ? opt->max_memory - fixed : 0;
+	size_t reads = left / 8 / (streams * BATCH_READ_BYTES);
+	if (reads > READ_BATCH_SIZE)
+		reads = READ_BATCH_SIZE;
+	if (reads < (size_t) opt->batch_width)
+		reads = opt->batch_width;
+	opt->batch_reads = reads;
+	size_t batches = (size_t) streams * reads * BATCH_READ_BYTES;
+	if (fixed + batches > opt->max_memory)
+		too_small(opt, fixed + batches);
+	left = opt->max_memory - fixed - batches;
+
+	if (paired_end) {
+		// an eighth of the rest for the hash table, and the rest for the reads in it
+		size_t buckets = left / 8 / sizeof(struct R1_read *);
+		if (buckets < (size_t) opt->tablesize)
+			opt->tablesize = prime_below(buckets);
+		if (left < MIN_PAIR_MEMORY + (size_t) opt->tablesize * sizeof(struct R1_read *))
+			too_small(opt, fixed + batches + MIN_PAIR_MEMORY);
+		opt->pair_memory = left - (size_t) opt->tablesize * sizeof(struct R1_read *);
+	}
+
+	if (opt->verbose) {
+		fprintf(stderr, "%sMemory: %zu MB for the index and compressors, %d reads in each batch", GREEN, fixed >> 20, opt->batch_reads);
+		if (paired_end)
+			fprintf(stderr, ", %d buckets and %zu MB for the R1 reads", opt->tablesize, opt->pair_memory >> 20);
+		fprintf(stderr, "%s\n", ENDC);
+	}
+}
+
+FILE *temp_file(char *what) {
+	char *dir = getenv("TMPDIR");
+	if (dir == NULL || *dir == '\0')
+		dir = "/tmp";
+	size_t len = strlen(dir) + 32;
+	char *name = malloc(len);
+	snprintf(name, len, "%s/fat-XXXXXX", dir);
+	int fd = mkstemp(name);
+	if (fd < 0) {
+		fprintf(stderr, "%sERROR: Can not make a temp file in %s for the %s. Please set TMPDIR%s\n", RED, dir, what, ENDC);
+		exit(3);
+	}
+	// it goes away when we close it (or if we crash)
+	unlink(name);
+	free(name);
+	FILE *fp = fdopen(fd, "w+b");
+	if (fp == NULL) {
+		fprintf(stderr, "%sERROR: Can not open a temp file in %s for the %s%s\n", RED, dir, what, ENDC);
+		exit(3);
+	}
+	return fp;
+}
@@ -15,23 +15,25 @@
 #include <stdbool.h>
 #include <math.h>
 #include <stdint.h>
+#include <unistd.h>
 
 #include "colours.h"
-#include "create-snps.h"
 #include "definitions.h"
-#include "hash.h"
-#include "kseq.h"
+#include "demux.h"
+#include "fastq-batch.h"
+#include "pairs.h"
+#include "primer-index.h"
 #include "primer-match-counts.h"
-#include "primers.h"
-#include "print-sequences.h"
+#include "progress.h"
 #include "rob_dna.h"
 #include "search.h"
-#include "seqs_to_ints.h"
+#include "search-read.h"
+#include "shards.h"
 #include "structs.h"
+#include "trace.h"
+#include "trim-list.h"
 #include "version.h"
 
-KSEQ_INIT(gzFile, gzread);
-
 
 void paired_end_search(struct options *opt) {
 	/*
@@ -52,71 +54,11 @@ void paired_end_search(struct options *opt) {
 
 	COUNTS counts = {};
 
-	// create an array of kmer_bsts and malloc them
-	kmer_bst_t *all_primers[opt->maxkmer+1];
-
-	for (int i = 0; i<=opt->maxkmer; i++) {
-		all_primers[i] = malloc(sizeof(kmer_bst_t));
-
-		if (all_primers[i] == NULL) {
-			fprintf(stderr, "Can't malloc memory for all_primers %d\n", i);
-			exit(1);
-		}
-		all_primers[i]->bigger = NULL;
-		all_primers[i]->smaller = NULL;
-		all_primers[i]->value = 0;
-		all_primers[i]->id = "";
-	}
-
-	// read the primer file
-	read_primers_create_snps(opt->primers, all_primers, opt->maxkmer, opt->reverse, opt->verbose);
-	
-	// trunc_primers is the short sequences that will be searched at the 3' end of the sequence
-	// these sequences are all the same length (default: 6 bp)
-	kmer_bst_t *trunc_primers;
-	trunc_primers = malloc(sizeof(kmer_bst_t));
-	trunc_primers->bigger = NULL;
-	trunc_primers->smaller = NULL;
-	trunc_primers->value = -1;
-	trunc_primers->id = "";
-
-	// read the primer file again and truncate the primers
-	if (opt->min_adapter_length > 0)
-		read_trunc_primers(opt->primers, opt->min_adapter_length, trunc_primers, opt->reverse, opt->verbose);
-
-	if (opt->debug) {	
-		fprintf(stderr, "%sWe have read the primers%s\n", GREEN, ENDC);
-		for (int i = 0; i<=opt->maxkmer; i++)
-			print_all_primers(all_primers[i], i);
-	}
-
-	// A place to store our encdoded kmers
-	// 
-	// First, we make an array with just the lengths of the kmers we need to encode
-	// and then we encode those kmers. This reduces our search from ~30 to ~3
-	// (depending on how many primer lengths we have).
-	// We also do this longer primers to shorter, so that we initially trim off the
-	// longest possible primers
+	primer_index_t *idx = opt->index;
+	char name[MAXNAMELEN]; // the name of the primer we found
 
-	int kmer_lengths[opt->maxkmer];
-	int unique_kmer_count = 0;
-	for (int i=opt->maxkmer; i>=0; i--) 
-		if (all_primers[i]->value > 0) 
-			kmer_lengths[unique_kmer_count++] = i; 	// we need to remember this kmer length
-
-	// now we just add those kmers to this array and then we test them each time
-	uint64_t encoded_kmers[unique_kmer_count];
-
-	struct R1_read **reads;
-	reads = malloc(sizeof(*reads) * opt->tablesize);
-	for (int i = 0; i<opt->tablesize; i++)
-		reads[i] = NULL;
-
-
-	if (reads == NULL) {
-		fprintf(stderr, "%sERROR: We can not allocate memory for a table size of %d. Please try a smaller value for -t%s\n", RED, opt->tablesize, ENDC);
-		exit(2);
-	}
+	// the R1 reads, which go to a temp file if they don't fit in --max-memory
+	pair_table_t *reads = pairs_init(opt->tablesize, opt->pair_memory);
 
 	if( access( opt->R1_file, R_OK ) == -1 ) {
 		// file doesn't exist
@@ -134,126 +76,104 @@ void paired_end_search(struct options *opt) {
 	pc = malloc(sizeof(primer_counts_t));
 	pc->id = NULL;
 	pc->count = 0;
+	pc->next_primer = NULL;
 	for (int i=0; i<5; i++) {
                 pc->before[i] = 0;
                 pc->after[i] = 0;
         }
 
+	trace_thread_name(opt->trace, TRACE_MAIN, "paired end search");
+	read_batch_t *batch = read_batch_init(opt->batch_reads);
+	int nbatch = 0;
+
 	// Step 1. Read the R1 file and find the matches to any primer
 	
-	gzFile fp1 = gzopen(opt->R1_file, "r");
-	if (fp1 == NULL) {
+	fastq_reader_t *reader = fastq_open(opt->R1_file);
+	if (reader == NULL) {
 		fprintf(stderr, "%sERROR: Can not open %s%s\n", RED, opt->R1_file, ENDC);
 		exit(3);
 	}
-	kseq_t *seq = kseq_init(fp1);
-	int l;
+	fastq_time_inflate(reader, opt->trace != NULL);
+	// the UMIs are at the start of R1, and we search the reads after them
+	fastq_umi(reader, opt->umi_pattern);
 
 	FILE *match_out = NULL;
 	if (opt->R1_matches)
 		match_out = fopen(opt->R1_matches, "w");
 	
 	bool warning_printed = false;
-
-	while ((l = kseq_read(seq)) >= 0) {
-		counts.R1_seqs++;
-		if (opt->debug)
-			fprintf(stderr, "Reading %s\n", seq->name.s);
-		
-		// housekeeping warnings and definitions
-		if (opt->verbose && !warning_printed && has_n(seq->seq.s)) {
-			fprintf(stderr, "%sWARNING: sequences have an N but we don't deal with them. They are encoded as A%s\n", BLUE, ENDC);
-			warning_printed = true;
+	// the R1 reads are not trimmed until we write them, so we count them separately for the progress reports
+	uint64_t R1_will_trim = 0;
+	int barcodes[READ_BATCH_SIZE]; // the --demux barcode of each R1 read
+
+	while (true) {
+		uint64_t read_start = trace_now();
+		if (fastq_read_batch(reader, batch) == 0)
+			break;
+		uint64_t search_start = trace_now();
+		trace_read_span(opt->trace, TRACE_MAIN, read_start, search_start, fastq_inflate_ns(reader), nbatch, batch->n);
+
+		// we take the barcodes off R1 before we search for the adapters
+		if (opt->demux) {
+			for (int r=0; r<batch->n; r++) {
+				barcodes[r] = demux_read(opt->demux, &batch->reads[r]);
+				opt->demux->reads[barcodes[r]]++;
+			}
 		}
-		struct R1_read *R1read;
-		R1read = (struct R1_read *) malloc(sizeof(*R1read));
-		if (R1read == NULL) {
-			fprintf(stderr, "Can't allocate memory for new ID pointer\n");
-			return 0;
+		search_batch(idx, opt, batch);
+		for (int r=0; r<batch->n; r++) {
+			fastq_record_t *read = &batch->reads[r];
+			search_hit_t *hit = &batch->hits[r];
+			counts.R1_seqs++;
+			if (opt->debug)
+				fprintf(stderr, "Read %s\n", read->name.s);
+
+			// housekeeping warnings. search_batch counts the Ns when it encodes the reads
+			if (opt->verbose && !warning_printed && hit->ambiguous) {
+				fprintf(stderr, "%sWARNING: sequences have an N. We don't look for adapters that overlap them%s\n", BLUE, ENDC);
+				warning_printed = true;
+			}
 		}
-		R1read->trim = -1;
-		R1read->id = strdup(seq->name.s);
-		R1read->next = NULL;
-
-		bool read_matched = false;
-		// end housekeeping warnings and definitions
-
-		//  encode the first kmers in the sequence
-		for (int i = 0; i<unique_kmer_count; i++)
-			encoded_kmers[i] = kmer_encoding(seq->seq.s, 0, kmer_lengths[i]);
-
-		// test for the first kmers in our data structure. We need to iterate the 
-		// array of encoded primers and see if we find an encoding in all_primers[k]
-		// for k being the length of the encoding
-		for (int i=0; i<unique_kmer_count; i++) {
-			uint64_t enc  = encoded_kmers[i];
-			kmer_bst_t *ks = find_primer(enc, all_primers[kmer_lengths[i]]);
-			if (ks) {
+		uint64_t store_start = trace_now();
+		trace_span(opt->trace, TRACE_MAIN, "search", search_start, store_start, nbatch, batch->n);
+
+		// remember where we are going to trim each R1 read so we can compare it to R2
+		for (int r=0; r<batch->n; r++) {
+			fastq_record_t *read = &batch->reads[r];
+			search_hit_t *hit = &batch->hits[r];
+			struct R1_read R1read = {
+				.trim = hit->trim,
+				.end_trim = end_trim(hit),
+				.id = read->name.s,
+				.umi = read->umi.l ? read->umi.s : NULL,
+				.barcode = opt->demux ? barcodes[r] : 0,
+				.len = read->seq.l,
+				.keep = true,
+			};
+
+			if (hit->trim > -1) {
 				if (opt->R1_matches)
-					fprintf(match_out, "R1\t%s\t%s\t0\t-%ld\n", ks->id, seq->name.s, seq->seq.l);
+					fprintf(match_out, "R1\t%s\t%s\t%d\t-%ld\n", hit_name(hit, name, MAXNAMELEN), read->name.s, hit->trim, read->seq.l-hit->trim);
 				counts.R1_found++;
-				count_primer_occurrence(pc, ks->id, '^', seq->seq.s[kmer_lengths[i]+1]); //save the primer count for reporting
-				R1read->trim = 0;
-				unsigned hashval = hash(R1read->id) % opt->tablesize;
-				R1read->next = reads[hashval];
-				reads[hashval] = R1read;
-				read_matched = true;
-			} 
-		}
-
-		if (read_matched)
-			continue; // no point continuing if there is an adapter match at position 0!
-		
-		for (int posn=1; posn<seq->seq.l - opt->maxkmer + 1; posn++) {
-			for (int i=0; i<unique_kmer_count; i++) {
-				// calculate the next encoding for this kmer length
-				uint64_t enc  = next_kmer_encoding(seq->seq.s, posn, kmer_lengths[i], encoded_kmers[i]);
-				encoded_kmers[i] = enc; // remember it for next time!
-				kmer_bst_t *ks = find_primer(enc, all_primers[kmer_lengths[i]]);
-				if (ks) {
-					if (opt->R1_matches)
-						fprintf(match_out, "R1\t%s\t%s\t%d\t-%ld\n", ks->id, seq->name.s, posn, seq->seq.l-posn);
-					counts.R1_found++;
-					count_primer_occurrence(pc, ks->id, seq->seq.s[posn-1], seq->seq.s[kmer_lengths[i]+1]); //save the primer count for reporting
-					R1read->trim = posn;
-					read_matched = true;
-				}
-				if (read_matched)
-					break;
+				count_primer_occurrence(pc, hit_name(hit, name, MAXNAMELEN), hit->before, hit->after); //save the primer count for reporting
 			}
-			if (read_matched)
-				break;
-		}
-
+			if (trim_point(hit) > -1)
+				R1_will_trim++;
+			if (hit->poly_trim > -1)
+				counts.R1_poly++;
 
-		// if we have not trimmed any sequences, we start at length-kmer and 
-		// remove from the first trunc_primer we find
-		if (!read_matched && opt->min_adapter_length > 0) {
-			// we start a little bit before opt->maxkmer in case there are any frameshifts
-			uint64_t enc  =  kmer_encoding(seq->seq.s, seq->seq.l - opt->maxkmer - 5, opt->min_adapter_length);
-			for (int posn = seq->seq.l - opt->maxkmer - 4; posn < seq->seq.l - opt->min_adapter_length; posn++) {
-				enc  = next_kmer_encoding(seq->seq.s, posn, opt->min_adapter_length, enc);
-				kmer_bst_t *ks = find_primer(enc, trunc_primers);
-				if (ks) {
-					if (opt->R1_matches)
-						fprintf(match_out, "R1\t%s\t%s\t%d\t-%ld\n", ks->id, seq->name.s, posn, seq->seq.l-posn);
-					counts.R1_found++;
-					count_primer_occurrence(pc, ks->id, seq->seq.s[posn-1], seq->seq.s[opt->min_adapter_length+1]); //save the primer count for reporting
-					R1read->trim = posn;
-					read_matched = true;
-					
-				}
-			}
+			pairs_add(reads, &R1read);
 		}
-
-		unsigned hashval = hash(R1read->id) % opt->tablesize;
-		R1read->next = reads[hashval];
-		reads[hashval] = R1read;
+		uint64_t store_end = trace_now();
+		trace_span(opt->trace, TRACE_MAIN, "pair", store_start, store_end, nbatch, batch->n);
+		progress_update(opt->progress, PROGRESS_R1, counts.R1_seqs, R1_will_trim, 0, fastq_offset(reader), NULL);
+		progress_pending(opt->progress, PROGRESS_R1, counts.R1_seqs);
+		nbatch++;
 	}
+	// remember how much of R1 we read so the second pass adds to it
+	uint64_t R1_bytes = fastq_offset(reader);
 
-	// I am going to reset kseq so we have to initiate it again later
-	kseq_destroy(seq);
-	gzclose(fp1);
+	fastq_close(reader);
 
 	if (opt->R1_matches)
 		fclose(match_out);
@@ -262,24 +182,32 @@ void paired_end_search(struct options *opt) {
 	// Step 2. Read the R2 file and find the locations of any of the primers.
 
 	// Open R2 for reading
-	gzFile fp2 = gzopen(opt->R2_file, "r");
-	if (fp2 == NULL) {
+	reader = fastq_open(opt->R2_file);
+	if (reader == NULL) {
 		fprintf(stderr, "%sERROR: Can not open %s%s\n", RED, opt->R2_file, ENDC);
 		exit(3);
 	}
-	seq = kseq_init(fp2);
+	fastq_time_inflate(reader, opt->trace != NULL);
 
 	// if we want to write the files, we open a pipe
 	// otherwise it is null. so we just need to check before writing
 	// Open R2 for writing
-	FILE *pipe = NULL;
-	if (opt->R2_output) {
-		char* pipe_file = malloc(sizeof(char) * (strlen(opt->R2_output) + 10));
-		strcpy(pipe_file, "gzip - > ");
-		strcat(pipe_file, opt->R2_output);
-		pipe = popen(pipe_file, "w");
-		free(pipe_file);
+	shards_t *output = NULL;
+	if (opt->R2_output && !opt->demux)
+		output = shards_open(opt->R2_output, opt->shards, opt->shard_reads, opt);
+	shards_t *discarded = NULL;
+	if (opt->discarded) {
+		char *discarded_file = output_name(opt->discarded, "R2");
+		discarded = shards_open(discarded_file, 1, 1, opt);
+		free(discarded_file);
+	}
+	trim_list_t *trims = NULL;
+	if (opt->trim_list) {
+		char *trim_list_file = output_name(opt->trim_list, "R2");
+		trims = trim_list_create(trim_list_file);
+		free(trim_list_file);
 	}
+	bool keep[READ_BATCH_SIZE]; // are both reads of the pair long enough to write
 
 	// open our log files
 	FILE *adjust = NULL;
@@ -291,182 +219,245 @@ void paired_end_search(struct options *opt) {
 		fprintf(adjust, "R1/R2\tSeq ID\tFrom\tTo\n");
 	}
 
-	while ((l = kseq_read(seq)) >= 0) {
-		counts.R2_seqs++;
-		bool read_matched = false;
-		//  encode the first kmers in the sequence
-		for (int i = 0; i<unique_kmer_count; i++)
-			encoded_kmers[i] = kmer_encoding(seq->seq.s, 0, kmer_lengths[i]);
-		
-		int trim = -1;
-		
-		for (int i=0; i<unique_kmer_count; i++) {
-			uint64_t enc  = encoded_kmers[i];
-			kmer_bst_t *ks = find_primer(enc, all_primers[kmer_lengths[i]]);
-
-			if (ks) {
+	uint64_t written = 0;
+	uint64_t mates_found = 0;
+	uint64_t ordinal = 0; // which read this is in the file, so R1 and R2 go to the same shard
+	while (true) {
+		uint64_t read_start = trace_now();
+		if (fastq_read_batch(reader, batch) == 0)
+			break;
+		uint64_t search_start = trace_now();
+		trace_read_span(opt->trace, TRACE_MAIN, read_start, search_start, fastq_inflate_ns(reader), nbatch, batch->n);
+
+		search_batch(idx, opt, batch);
+		for (int r=0; r<batch->n; r++) {
+			fastq_record_t *read = &batch->reads[r];
+			search_hit_t *hit = &batch->hits[r];
+			counts.R2_seqs++;
+			if (hit->trim > -1) {
 				if (opt->R2_matches)
-					fprintf(match_out, "R2\t%s\t%s\t0\t-%ld\n", ks->id, seq->name.s, seq->seq.l);
+					fprintf(match_out, "R2\t%s\t%s\t%d\t-%ld\n", hit_name(hit, name, MAXNAMELEN), read->name.s, hit->trim, read->seq.l-hit->trim);
 				counts.R2_found++;
-				count_primer_occurrence(pc, ks->id, '^', seq->seq.s[kmer_lengths[i]+1]); //save the primer count for reporting
-				trim = 0;
-				read_matched = true;
-			} 
+				count_primer_occurrence(pc, hit_name(hit, name, MAXNAMELEN), hit->before, hit->after); //save the primer count for reporting
+			}
+			if (hit->poly_trim > -1)
+				counts.R2_poly++;
 		}
-
-		if (!read_matched) {
-			for (int posn=1; posn<seq->seq.l - opt->maxkmer + 1; posn++) {
-				for (int i=0; i<unique_kmer_count; i++) {
-					// calculate the next encoding for this kmer length
-					uint64_t enc  = next_kmer_encoding(seq->seq.s, posn, kmer_lengths[i], encoded_kmers[i]);
-					encoded_kmers[i] = enc; // remember it for next time!
-					kmer_bst_t *ks = find_primer(enc, all_primers[kmer_lengths[i]]);
-					if (ks) {
-						if (opt->R2_matches)
-							fprintf(match_out, "R2\t%s\t%s\t%d\t-%ld\n", ks->id, seq->name.s, posn, seq->seq.l-posn);
-						counts.R2_found++;
-						count_primer_occurrence(pc, ks->id, seq->seq.s[posn-1], seq->seq.s[kmer_lengths[i]+1]); //save the primer count for reporting
-						trim = posn;
-						read_matched = true;
-					}
-					if (read_matched)
+		uint64_t pair_start = trace_now();
+		trace_span(opt->trace, TRACE_MAIN, "search", search_start, pair_start, nbatch, batch->n);
+
+		for (int r=0; r<batch->n; r++) {
+			fastq_record_t *read = &batch->reads[r];
+			int trim = batch->hits[r].trim;
+			// R2 goes with its R1, and to unassigned if we don't have one
+			if (opt->demux)
+				barcodes[r] = opt->demux->n;
+
+			// we either have a value or -1 for trim.
+			// Now find the matching R1
+			struct R1_read *R1 = pairs_find(reads, read->name.s);
+			bool matched = R1 != NULL;
+			if (matched) {
+				if (R1->umi)
+					fastq_record_umi(read, R1->umi);
+				if (opt->demux)
+					barcodes[r] = R1->barcode;
+				if (opt->verbose && trim > -1 && R1->trim > -1 && trim != R1->trim)
+					fprintf(stderr, "%sWe want to trim starting at %d from R1 and %d from R2 in %s. We went with the shorter%s\n", BLUE, R1->trim, trim, read->name.s, ENDC);
+				int R1_from = R1->trim;
+				int R2_from = trim;
+				switch (reconcile_trims(&R1->trim, &trim)) {
+					case PAIR_SAME:
+						// nothing to do, we can process both reads
+						counts.same++;
+						break;
+					case PAIR_R1_ADJUSTED:
+						if (opt->adjustments)
+							fprintf(adjust, "R1\t%s\t%d\t%d\n", R1->id, R1_from, R1->trim);
+						counts.R1_adjusted++;
+						break;
+					case PAIR_R2_ADJUSTED:
+						if (opt->adjustments)
+							fprintf(adjust, "R2\t%s\t%d\t%d\n", read->name.s, R2_from, trim);
+						counts.R2_adjusted++;
 						break;
 				}
-				if (read_matched)
-					break;
 			}
-		}
-
-		// if we have not trimmed any sequences, we start at length-kmer and 
-		// remove from the first trunc_primer we find
-		if (trim == -1 && opt->min_adapter_length > 0) {
-			// we start a little bit before opt->maxkmer in case there are any frameshifts
-			uint64_t enc  =  kmer_encoding(seq->seq.s, seq->seq.l - opt->maxkmer - 5, opt->min_adapter_length);
-			for (int posn = seq->seq.l - opt->maxkmer - 4; posn < seq->seq.l - opt->min_adapter_length; posn++) {
-				enc  = next_kmer_encoding(seq->seq.s, posn, opt->min_adapter_length, enc);
-				kmer_bst_t *ks = find_primer(enc, trunc_primers);
-				if (ks) {
-					if (opt->R2_matches)
-						fprintf(match_out, "R2\t%s\t%s\t%d\t-%ld\n", ks->id, seq->name.s, posn, seq->seq.l-posn);
-					counts.R2_found++;
-					count_primer_occurrence(pc, ks->id, seq->seq.s[posn-1], seq->seq.s[opt->min_adapter_length+1]); //save the primer count for reporting
-					trim = posn;
-					read_matched = true;
-				}
+			if (!matched) {
+				fprintf(stderr, "%s We did not find an R1 that matches %s%s\n", PINK, read->name.s, ENDC);
+			} else
+				mates_found++;
+			batch->hits[r].trim = trim;
+
+			// now we know where we trim both reads, we only keep the pair if they are both long enough
+			// (R1 can move the trim past the end of a shorter R2)
+			int R2_len = trim_point(&batch->hits[r]);
+			if (R2_len < 0 || (size_t) R2_len > read->seq.l)
+				R2_len = read->seq.l;
+			keep[r] = R2_len > opt->min_sequence_length;
+			if (matched) {
+				int R1_len = earliest_trim(R1->trim, R1->end_trim);
+				if (R1_len < 0 || R1_len > R1->len)
+					R1_len = R1->len;
+				keep[r] = keep[r] && R1_len > opt->min_sequence_length;
+				R1->keep = keep[r];
+				pairs_matched(reads, R1);
 			}
 		}
-
-
-		
-
-		// we either have a value or -1 for trim.
-		// Now find the matching R1
-		unsigned hashval = hash(seq->name.s) % opt->tablesize;
-		struct R1_read *R1 = reads[hashval];
-		bool matched = false;
-		while (R1 != NULL) {
-			if (strcmp(R1->id, seq->name.s) == 0) {
-				// we found a match
-				matched = true;
-				if (trim == R1->trim) {
-					// nothing to do, we can process both reads
-					counts.same++;
-					break;
-				}
-				if (trim == -1 && R1->trim > -1) {
-					if (opt->adjustments)
-						fprintf(adjust, "R2\t%s\t%d\t%d\n", seq->name.s, trim, R1->trim);
-					trim = R1->trim;
-					counts.R2_adjusted++;
-					break;
-				}
-				if (R1->trim == -1 && trim > -1) {
-					if (opt->adjustments)
-						fprintf(adjust, "R1\t%s\t%d\t%d\n", R1->id, R1->trim, trim);
-					R1->trim = trim;
-					counts.R1_adjusted++;
-					break;
-				}
-
-				if (opt->verbose)
-					fprintf(stderr, "%sWe want to trim starting at %d from R1 and %d from R2 in %s. We went with the shorter%s\n", BLUE, R1->trim, trim, seq->name.s, ENDC);
-				if (trim < R1->trim) {
-					if (opt->adjustments)
-						fprintf(adjust, "R1\t%s\t%d\t%d\n", R1->id, R1->trim, trim);
-					R1->trim = trim;
-					counts.R1_adjusted++;
-					break;
-				}
-				if (trim > R1->trim) {
-					if (opt->adjustments)
-						fprintf(adjust, "R2\t%s\t%d\t%d\n", seq->name.s, trim, R1->trim);
-					trim = R1->trim;
-					counts.R2_adjusted++;
-					break;
-				}
+		uint64_t write_start = trace_now();
+		trace_span(opt->trace, TRACE_MAIN, "pair", pair_start, write_start, nbatch, batch->n);
+
+		for (int r=0; r<batch->n; r++) {
+			fastq_record_t *read = &batch->reads[r];
+			// the adapter (after we compared it to R1), or where the quality drops or the poly-G/A tail starts if that is first
+			int trim = trim_point(&batch->hits[r]);
+			uint64_t R2_ordinal = ordinal++;
+			if (trim > -1)
+				counts.R2_trimmed++;
+			if (trims)
+				trim_list_add(trims, read->seq.l, trim, keep[r]);
+			if (trim == 0) {
+				// an adapter dimer: there is nothing left of the read to trim or format
+				counts.R2_dimers++;
+				counts.R2_discarded++;
+				if (discarded)
+					write_empty_fastq_record(shard_out(discarded, 0), read);
+				continue;
+			}
+			if (trim > -1) {
+				if (opt->debug)
+					fprintf(stderr, "Trimming R2 %s from %ld to %d\n", read->name.s, read->seq.l, trim);
+				trim_fastq_record(read, trim);
+			}
+			if (!keep[r]) {
+				counts.R2_discarded++;
+				if (discarded)
+					write_fastq_record(shard_out(discarded, 0), read);
+				continue;
+			}
+			FILE *out = opt->demux ? demux_out(opt->demux, PROGRESS_R2, barcodes[r]) : output ? shard_out(output, R2_ordinal) : NULL;
+			if (out) {
+				write_fastq_record(out, read);
+				written++;
 			}
-			R1 = R1->next;
-		}
-		if (!matched) {
-			fprintf(stderr, "%s We did not find an R1 that matches %s%s\n", PINK, seq->name.s, ENDC);
-		}
-		if (trim > -1) {
-			if (opt->debug)
-				fprintf(stderr, "Trimming R2 %s from %ld to %d\n", seq->name.s, seq->seq.l, trim);
-			seq->seq.s[trim] = '\0';
-			seq->qual.s[trim] = '\0';
-			counts.R2_trimmed++;
 		}
-		if (pipe && strlen(seq->seq.s) > opt->min_sequence_length)
-			fprintf(pipe, "@%s %s\n%s\n+\n%s\n", seq->name.s, seq->comment.s, seq->seq.s, seq->qual.s);
-
-
+		uint64_t write_end = trace_now();
+		trace_span(opt->trace, TRACE_MAIN, "write", write_start, write_end, nbatch, batch->n);
+		progress_update(opt->progress, PROGRESS_R2, counts.R2_seqs, counts.R2_trimmed, written, fastq_offset(reader), shards_pipe(output));
+		progress_pending(opt->progress, PROGRESS_R1, counts.R1_seqs - mates_found);
+		nbatch++;
 	}
-	if (pipe)
-		pclose(pipe);
+	if (output)
+		shards_close(output);
+	if (discarded)
+		shards_close(discarded);
+	if (trims)
+		trim_list_close(trims);
+	fastq_close(reader);
+	// if we spilled R1, write down where we trim every read for the last pass
+	pairs_finish(reads);
 
 	
 	// do we need to write to R1
-	if (opt->R1_output) {
+	if (opt->R1_output || opt->demux || opt->discarded || opt->trim_list) {
 		// Step 3. Reread R1 and write the left reads, trimming at (strcmp(id, seq->name.s) == 0) -> trim
 		// We only need to do this if we are going to write to the file.
 
-		fp1 = gzopen(opt->R1_file, "r");
-		if (fp1 == NULL) {
+		reader = fastq_open(opt->R1_file);
+		if (reader == NULL) {
 			fprintf(stderr, "%sERROR: Can not open %s%s\n", RED, opt->R1_file, ENDC);
 			exit(3);
 		}
-		seq = kseq_init(fp1);
-
-		char* pipe_file = malloc(sizeof(char) * (strlen(opt->R1_output) + 10));
-		strcpy(pipe_file, "gzip - > ");
-		strcat(pipe_file, opt->R1_output);
-
-		pipe = popen(pipe_file, "w");
+		fastq_time_inflate(reader, opt->trace != NULL);
+		fastq_umi(reader, opt->umi_pattern);
+
+		output = NULL;
+		if (opt->R1_output && !opt->demux)
+			output = shards_open(opt->R1_output, opt->shards, opt->shard_reads, opt);
+		discarded = NULL;
+		if (opt->discarded) {
+			char *discarded_file = output_name(opt->discarded, "R1");
+			discarded = shards_open(discarded_file, 1, 1, opt);
+			free(discarded_file);
+		}
+		trims = NULL;
+		if (opt->trim_list) {
+			char *trim_list_file = output_name(opt->trim_list, "R1");
+			trims = trim_list_create(trim_list_file);
+			free(trim_list_file);
+		}
+		ordinal = 0;
+		int R1_trim[READ_BATCH_SIZE]; // where we trimmed each read, so we know the adapter dimers
 
-		while ((l = kseq_read(seq)) >= 0) {
-			unsigned hashval = hash(seq->name.s) % opt->tablesize;
-			struct R1_read *R1 = reads[hashval];
-			while (R1 != NULL) {
-				if (strcmp(R1->id, seq->name.s) == 0) {
-					if (R1->trim > -1) {
+		uint64_t R1_written = 0;
+		while (true) {
+			uint64_t read_start = trace_now();
+			if (fastq_read_batch(reader, batch) == 0)
+				break;
+			uint64_t pair_start = trace_now();
+			trace_read_span(opt->trace, TRACE_MAIN, read_start, pair_start, fastq_inflate_ns(reader), nbatch, batch->n);
+
+			for (int r=0; r<batch->n; r++) {
+				fastq_record_t *read = &batch->reads[r];
+				// take the barcode off again so the trim positions are the same as the first time
+				if (opt->demux)
+					barcodes[r] = demux_read(opt->demux, read);
+				int trim = -1;
+				bool keep_pair = true;
+				size_t len = read->seq.l;
+				if (pairs_final(reads, read->name.s, &trim, &keep_pair)) {
+					if (trim > 0) {
 						if (opt->debug)
-							fprintf(stderr, "Trimming R1 %s from %ld to %d\n", seq->name.s, seq->seq.l, R1->trim);
-						seq->seq.s[R1->trim] = '\0';
-						seq->qual.s[R1->trim] = '\0';
-						counts.R1_trimmed++;
+							fprintf(stderr, "Trimming R1 %s from %ld to %d\n", read->name.s, read->seq.l, trim);
+						trim_fastq_record(read, trim);
 					}
+					if (trim > -1)
+						counts.R1_trimmed++;
+				}
+				R1_trim[r] = trim;
+				keep[r] = keep_pair && read->seq.l > (size_t) opt->min_sequence_length;
+				if (trims)
+					trim_list_add(trims, len, trim, keep[r]);
+			}
+			uint64_t write_start = trace_now();
+			trace_span(opt->trace, TRACE_MAIN, "pair", pair_start, write_start, nbatch, batch->n);
+
+			for (int r=0; r<batch->n; r++) {
+				fastq_record_t *read = &batch->reads[r];
+				uint64_t R1_ordinal = ordinal++;
+				if (R1_trim[r] == 0) {
+					// an adapter dimer, which we don't need to format
+					counts.R1_dimers++;
+					counts.R1_discarded++;
+					if (discarded)
+						write_empty_fastq_record(shard_out(discarded, 0), read);
+					continue;
+				}
+				if (!keep[r]) {
+					counts.R1_discarded++;
+					if (discarded)
+						write_fastq_record(shard_out(discarded, 0), read);
+					continue;
+				}
+				FILE *out = opt->demux ? demux_out(opt->demux, PROGRESS_R1, barcodes[r]) : output ? shard_out(output, R1_ordinal) : NULL;
+				if (out) {
+					write_fastq_record(out, read);
+					R1_written++;
 				}
-				R1 = R1->next;
-				if (R1 == NULL)
-					break;
 			}
-			if (strlen(seq->seq.s) > opt->min_sequence_length)
-				fprintf(pipe, "@%s %s\n%s\n+\n%s\n", seq->name.s, seq->comment.s, seq->seq.s, seq->qual.s);
+			uint64_t write_end = trace_now();
+			trace_span(opt->trace, TRACE_MAIN, "write", write_start, write_end, nbatch, batch->n);
+			progress_update(opt->progress, PROGRESS_R1, counts.R1_seqs, R1_will_trim, R1_written, R1_bytes + fastq_offset(reader), shards_pipe(output));
+			nbatch++;
 		}
 
-		pclose(pipe);
-
+		if (output)
+			shards_close(output);
+		if (discarded)
+			shards_close(discarded);
+		if (trims)
+			trim_list_close(trims);
+		fastq_close(reader);
 	}
 
 
@@ -474,22 +465,22 @@ void paired_end_search(struct options *opt) {
 		fclose(adjust);
 	if (opt->R2_matches)
 		fclose(match_out);
-	kseq_destroy(seq);
-	gzclose(fp2);
 
-	for (int i=0; i<=opt->maxkmer; i++)
-		free(all_primers[i]);
+	read_batch_destroy(batch);
 
-	free(reads);
+	pairs_destroy(reads);
 
 	printf("Total sequences: R1 %d R2 %d\n", counts.R1_seqs, counts.R2_seqs);
 	printf("Primer found: R1 %d R2 %d\n", counts.R1_found, counts.R2_found);
 	printf("Same Offset: %d (includes no adapter)\n", counts.same);
 	printf("Adjusted offset: R1 %d R2 %d\n", counts.R1_adjusted, counts.R2_adjusted);
 	printf("Sequences trimmed: R1 %d R2 %d\n", counts.R1_trimmed, counts.R2_trimmed);
+	if (opt->poly_g || opt->poly_a)
+		printf("Poly-G/A tails: R1 %d R2 %d\n", counts.R1_poly, counts.R2_poly);
+	printf("Adapter dimers: R1 %d R2 %d\n", counts.R1_dimers, counts.R2_dimers);
+	printf("Discarded: R1 %d R2 %d\n", counts.R1_discarded, counts.R2_discarded);
 
 
 	printf("\nAdapter occurrences:\n");
 	print_primers(pc, opt->primer_occurrences);
 }
-
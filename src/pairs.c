@@ -0,0 +1,249 @@
+/*
+ * The R1 reads for the paired end search, which we spill to a temp file if they don't fit
+ * in --max-memory. See pairs.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "colours.h"
+#include "hash.h"
+#include "memory-budget.h"
+#include "pairs.h"
+#include "search-read.h"
+
+/*
+ * What we write for each spilled read, followed by its id and umi
+ */
+typedef struct spilled_read {
+	int32_t trim;
+	int32_t end_trim;
+	int32_t len;
+	int32_t barcode;
+	uint16_t id_len;
+	uint16_t umi_len;
+} spilled_read_t;
+
+static size_t R1_bytes(struct R1_read *R1) {
+	return sizeof(struct R1_read) + strlen(R1->id) + 1 + (R1->umi ? strlen(R1->umi) + 1 : 0);
+}
+
+pair_table_t *pairs_init(int size, size_t budget) {
+	pair_table_t *t = calloc(1, sizeof(pair_table_t));
+	if (t)
+		t->table = calloc(size, sizeof(struct R1_read *));
+	if (t == NULL || t->table == NULL) {
+		fprintf(stderr, "%sERROR: We can not allocate memory for a table size of %d. Please try a smaller value for -t%s\n", RED, size, ENDC);
+		exit(2);
+	}
+	t->size = size;
+	t->budget = budget;
+	t->arena = arena_create(1 << 20);
+	return t;
+}
+
+static void link_read(pair_table_t *t, struct R1_read *R1) {
+	unsigned hashval = hash(R1->id) % t->size;
+	R1->next = t->table[hashval];
+	t->table[hashval] = R1;
+}
+
+static void unlink_read(pair_table_t *t, struct R1_read *R1) {
+	struct R1_read **p = &t->table[hash(R1->id) % t->size];
+	while (*p != R1)
+		p = &(*p)->next;
+	*p = R1->next;
+}
+
+/*
+ * Write all the R1 reads in memory to the spill file, and start again
+ */
+static void spill(pair_table_t *t) {
+	if (t->spill == NULL)
+		t->spill = temp_file("R1 reads");
+	for (uint64_t i=0; i<t->norder; i++) {
+		struct R1_read *R1 = t->order[i];
+		spilled_read_t s = {R1->trim, R1->end_trim, R1->len, R1->barcode, strlen(R1->id), R1->umi ? strlen(R1->umi) : 0};
+		fwrite(&s, sizeof(s), 1, t->spill);
+		fwrite(R1->id, 1, s.id_len, t->spill);
+		fwrite(R1->umi, 1, s.umi_len, t->spill);
+	}
+	t->spilled += t->norder;
+	t->norder = 0;
+	memset(t->table, 0, sizeof(struct R1_read *) * t->size);
+	arena_destroy(t->arena);
+	t->arena = arena_create(1 << 20);
+}
+
+void pairs_add(pair_table_t *t, struct R1_read *R1) {
+	struct R1_read *copy = arena_alloc(t->arena, sizeof(struct R1_read));
+	*copy = *R1;
+	size_t len = strlen(R1->id) + 1;
+	copy->id = memcpy(arena_alloc(t->arena, len), R1->id, len);
+	if (R1->umi) {
+		len = strlen(R1->umi) + 1;
+		copy->umi = memcpy(arena_alloc(t->arena, len), R1->umi, len);
+	}
+	copy->ordinal = t->n++;
+	link_read(t, copy);
+	if (t->budget == 0)
+		return;
+
+	if (t->norder == t->order_size) {
+		t->order_size = t->order_size ? t->order_size * 2 : 4096;
+		t->order = realloc(t->order, sizeof(struct R1_read *) * t->order_size);
+		if (t->order == NULL) {
+			fprintf(stderr, "%sERROR: Can't allocate memory for the R1 reads%s\n", RED, ENDC);
+			exit(2);
+		}
+	}
+	t->order[t->norder++] = copy;
+	if (t->arena->reserved + sizeof(struct R1_read *) * t->order_size > t->budget)
+		spill(t);
+}
+
+/*
+ * Read the next spilled R1 read back into memory. We malloc these so that we can free them
+ * once we've found their mate
+ */
+static struct R1_read *load_read(pair_table_t *t) {
+	if (t->loaded == 0)
+		rewind(t->spill);
+	spilled_read_t s;
+	if (fread(&s, sizeof(s), 1, t->spill) != 1) {
+		fprintf(stderr, "%sERROR: We could not read the R1 reads back from the temp file%s\n", RED, ENDC);
+		exit(3);
+	}
+	struct R1_read *R1 = malloc(sizeof(struct R1_read) + s.id_len + 1 + s.umi_len + 1);
+	if (R1 == NULL) {
+		fprintf(stderr, "%sERROR: Can't allocate memory for the R1 reads%s\n", RED, ENDC);
+		exit(2);
+	}
+	R1->trim = s.trim;
+	R1->end_trim = s.end_trim;
+	R1->len = s.len;
+	R1->barcode = s.barcode;
+	R1->keep = true;
+	R1->ordinal = t->loaded++;
+	R1->id = (char *) (R1 + 1);
+	R1->umi = s.umi_len ? R1->id + s.id_len + 1 : NULL;
+	size_t n = fread(R1->id, 1, s.id_len, t->spill);
+	R1->id[s.id_len] = '\0';
+	if (s.umi_len) {
+		n += fread(R1->umi, 1, s.umi_len, t->spill);
+		R1->umi[s.umi_len] = '\0';
+	}
+	if (n != (size_t) s.id_len + s.umi_len) {
+		fprintf(stderr, "%sERROR: We could not read the R1 reads back from the temp file%s\n", RED, ENDC);
+		exit(3);
+	}
+	return R1;
+}
+
+struct R1_read *pairs_find(pair_table_t *t, char *name) {
+	for (struct R1_read *R1 = t->table[hash(name) % t->size]; R1 != NULL; R1 = R1->next)
+		if (strcmp(R1->id, name) == 0)
+			return R1;
+	// R2 is usually in the same order as R1, so its mate is probably the next spilled read
+	while (t->loaded < t->spilled) {
+		struct R1_read *R1 = load_read(t);
+		link_read(t, R1);
+		t->window += R1_bytes(R1);
+		if (t->window > t->budget && !t->warned) {
+			fprintf(stderr, "%sWARNING: R1 and R2 are not in the same order, so we need more than --max-memory to find the mates. --external-pairs doesn't need them in order%s\n", BLUE, ENDC);
+			t->warned = true;
+		}
+		if (strcmp(R1->id, name) == 0)
+			return R1;
+	}
+	return NULL;
+}
+
+static void write_final(pair_table_t *t, struct R1_read *R1) {
+	if (t->finals == NULL)
+		t->finals = temp_file("R1 trims");
+	// the trim can be -1, and we keep a bit for keep
+	int32_t final = (earliest_trim(R1->trim, R1->end_trim) + 1) * 2 + R1->keep;
+	if (pwrite(fileno(t->finals), &final, sizeof(final), R1->ordinal * sizeof(final)) != sizeof(final)) {
+		fprintf(stderr, "%sERROR: We could not write the R1 trims to the temp file%s\n", RED, ENDC);
+		exit(3);
+	}
+}
+
+void pairs_matched(pair_table_t *t, struct R1_read *R1) {
+	// the reads in the arena are still there at the end, so we only need to write the spilled ones
+	if (R1->ordinal >= t->spilled)
+		return;
+	write_final(t, R1);
+	unlink_read(t, R1);
+	t->window -= R1_bytes(R1);
+	free(R1);
+}
+
+void pairs_finish(pair_table_t *t) {
+	if (t->spilled == 0)
+		return;
+	// the reads that are still in memory, and the ones we haven't read back because they don't have a mate
+	for (int i=0; i<t->size; i++) {
+		struct R1_read *R1 = t->table[i];
+		while (R1) {
+			struct R1_read *next = R1->next;
+			write_final(t, R1);
+			if (R1->ordinal < t->spilled)
+				free(R1);
+			R1 = next;
+		}
+		t->table[i] = NULL;
+	}
+	while (t->loaded < t->spilled) {
+		struct R1_read *R1 = load_read(t);
+		write_final(t, R1);
+		free(R1);
+	}
+	rewind(t->finals);
+}
+
+bool pairs_final(pair_table_t *t, char *name, int *trim, bool *keep) {
+	if (t->spilled) {
+		int32_t final;
+		if (t->final >= t->n || fread(&final, sizeof(final), 1, t->finals) != 1)
+			return false;
+		t->final++;
+		*trim = final / 2 - 1;
+		*keep = final & 1;
+		return true;
+	}
+	for (struct R1_read *R1 = t->table[hash(name) % t->size]; R1 != NULL; R1 = R1->next) {
+		if (strcmp(R1->id, name) == 0) {
+			*trim = earliest_trim(R1->trim, R1->end_trim);
+			*keep = R1->keep;
+			return true;
+		}
+	}
+	return false;
+}
+
+void pairs_destroy(pair_table_t *t) {
+	// pairs_finish has freed the spilled reads that were still in the table
+	free(t->table);
+	free(t->order);
+	arena_destroy(t->arena);
+	if (t->spill)
+		fclose(t->spill);
+	if (t->finals)
+		fclose(t->finals);
+	free(t);
+}
+
+int reconcile_trims(int *R1_trim, int *R2_trim) {
+	if (*R2_trim == *R1_trim)
+		return PAIR_SAME;
+	if (*R1_trim > -1 && (*R2_trim == -1 || *R2_trim > *R1_trim)) {
+		*R2_trim = *R1_trim;
+		return PAIR_R2_ADJUSTED;
+	}
+	*R1_trim = *R2_trim;
+	return PAIR_R1_ADJUSTED;
+}
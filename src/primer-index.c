@@ -0,0 +1,797 @@
+/*
+ * Build all the data structures of primers that we search with.
+ *
+ * This used to be repeated at the start of each of the searches.
+ *
+ * We build binary search trees of the primers, and then copy them into a flat
+ * hash table index (see primer-index.h) that we search, save, and load.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "colours.h"
+#include "primer-index.h"
+#include "primers.h"
+#include "rob_dna.h"
+#include "structs.h"
+
+/*
+ * While we build the canonical tables we keep the primer_name_t (rather than the offset of the name)
+ */
+typedef struct canon_slot {
+	uint64_t value;
+	primer_name_t name;
+	uint8_t strand;
+	bool used;
+} canon_slot_t;
+
+typedef struct canon_table {
+	canon_slot_t *slots;
+	uint64_t mask;
+	uint64_t count;
+} canon_table_t;
+
+static uint64_t count_primers(kmer_bst_t *ks) {
+	if (ks == NULL || (ks->bigger == NULL && ks->smaller == NULL))
+		return 0;
+	return 1 + count_primers(ks->bigger) + count_primers(ks->smaller);
+}
+
+static char complement_base(char c) {
+	switch (c) {
+		case 'A': case 'a': return 'T';
+		case 'C': case 'c': return 'G';
+		case 'G': case 'g': return 'C';
+		case 'T': case 't': return 'A';
+	}
+	return 'N';
+}
+
+/*
+ * Is b the reverse complement of the primer in slot a? It has to be the next name (" rc"),
+ * and if it is a SNP it has to be the same SNP from the other end.
+ */
+static bool is_partner(primer_name_t *a, primer_name_t *b, int k) {
+	if (b->base != a->base + 1)
+		return false;
+	if (a->snp_posn < 0)
+		return b->snp_posn < 0;
+	return b->snp_posn == k - 1 - a->snp_posn && b->snp_from == complement_base(a->snp_from) && b->snp_to == complement_base(a->snp_to);
+}
+
+/*
+ * Add a primer to a canonical table. If the slot for its canonical encoding has its
+ * reverse complement partner (in either order) we share that slot.
+ */
+static void add_canonical(canon_table_t *t, uint64_t value, primer_name_t name, int k) {
+	uint64_t rcvalue = reverse_complement(value, k);
+	uint64_t key = value < rcvalue ? value : rcvalue;
+	uint8_t strand = value != key ? FATI_NAMED_RC : 0;
+	uint64_t i = fati_hash(key) & t->mask;
+	for (; t->slots[i].used; i = (i + 1) & t->mask) {
+		canon_slot_t *slot = &t->slots[i];
+		if (slot->value != key || value == rcvalue || (slot->strand & FATI_PARTNER) || (slot->strand & FATI_NAMED_RC) == strand)
+			continue;
+		if (is_partner(&slot->name, &name, k)) {
+			slot->strand |= FATI_PARTNER;
+			return;
+		}
+		if (is_partner(&name, &slot->name, k)) {
+			slot->name = name;
+			slot->strand = strand | FATI_PARTNER;
+			return;
+		}
+	}
+	t->slots[i].used = true;
+	t->slots[i].value = key;
+	t->slots[i].name = name;
+	t->slots[i].strand = strand;
+	t->count++;
+}
+
+static void add_tree_canonical(kmer_bst_t *ks, canon_table_t *t, int k) {
+	if (ks == NULL || (ks->bigger == NULL && ks->smaller == NULL))
+		return;
+	add_canonical(t, ks->value, ks->name, k);
+	add_tree_canonical(ks->bigger, t, k);
+	add_tree_canonical(ks->smaller, t, k);
+}
+
+/*
+ * Put all the primers in a tree in a canonical table, so we know how many slots we need
+ */
+static void make_canonical(kmer_bst_t *tree, canon_table_t *t, int k) {
+	uint64_t slots = 1;
+	while (slots < 2 * count_primers(tree))
+		slots <<= 1;
+	t->slots = calloc(slots, sizeof(canon_slot_t));
+	if (t->slots == NULL) {
+		fprintf(stderr, "%sERROR: Can't malloc memory for the primer tables%s\n", RED, ENDC);
+		exit(1);
+	}
+	t->mask = slots - 1;
+	t->count = 0;
+	add_tree_canonical(tree, t, k);
+}
+
+static void add_to_table(canon_table_t *c, char *flat, fati_table_t *t, uint32_t *name_offsets) {
+	fati_slot_t *slots = (fati_slot_t *) (flat + t->offset);
+	for (uint64_t j=0; j<=c->mask; j++) {
+		canon_slot_t *cs = &c->slots[j];
+		if (!cs->used)
+			continue;
+		uint64_t i = fati_hash(cs->value) & t->mask;
+		while (slots[i].name != FATI_EMPTY)
+			i = (i + 1) & t->mask;
+		slots[i].value = cs->value;
+		slots[i].name = name_offsets[cs->name.base];
+		slots[i].snp_posn = cs->name.snp_posn;
+		slots[i].strand = cs->strand;
+		slots[i].snp_from = cs->name.snp_from;
+		slots[i].snp_to = cs->name.snp_to;
+	}
+}
+
+typedef struct seed_posting {
+	uint64_t key;
+	uint32_t primer;
+} seed_posting_t;
+
+static int compare_postings(const void *a, const void *b) {
+	const seed_posting_t *x = a, *y = b;
+	if (x->key != y->key)
+		return x->key < y->key ? -1 : 1;
+	return x->primer < y->primer ? -1 : x->primer > y->primer;
+}
+
+/*
+ * Split the full length primers that are long enough into seeds. We only keep the first primer with each
+ * encoding, the same as the trees, and we set the bit in the filter for the start of each seed.
+ * The postings are sorted by seed so that the primers
+ * with the same seed are next to each other. Each primer has seed_budget() + 1 seeds, so we count
+ * the postings in *npostings. Returns the number of different seeds.
+ */
+static uint64_t make_seed_postings(primer_index_t *idx, seed_primer_t **primers, uint64_t *nprimers, seed_posting_t **postings, uint64_t *npostings, uint64_t *filter) {
+	int n = idx->mismatches;
+	*primers = malloc(sizeof(seed_primer_t) * (idx->nseed_primers + 1));
+	*postings = malloc(sizeof(seed_posting_t) * ((uint64_t) idx->nseed_primers * (n + 1) + 1));
+	if (*primers == NULL || *postings == NULL) {
+		fprintf(stderr, "%sERROR: Can't malloc memory for the seeds%s\n", RED, ENDC);
+		exit(1);
+	}
+	*nprimers = 0;
+	for (uint32_t i=0; i<idx->nseed_primers; i++) {
+		seed_primer_t *p = &idx->seed_primers[i];
+		if (!seeded_length(p->k, n))
+			continue;
+		bool seen = false;
+		for (uint64_t j=0; j<*nprimers && !seen; j++)
+			seen = (*primers)[j].k == p->k && (*primers)[j].value == p->value;
+		if (!seen)
+			(*primers)[(*nprimers)++] = *p;
+	}
+
+	*npostings = 0;
+	for (uint64_t i=0; i<*nprimers; i++) {
+		seed_primer_t *p = &(*primers)[i];
+		for (int s=0; s<=seed_budget(p->k, n); s++) {
+			uint64_t seed = seed_bases(p->value, p->k, seed_start(p->k, n, s), seed_start(p->k, n, s+1));
+			(*postings)[*npostings].key = seed_key(p->k, s, seed);
+			(*postings)[(*npostings)++].primer = i;
+			uint64_t prefix = seed_bases(p->value, p->k, seed_start(p->k, n, s), seed_start(p->k, n, s) + FATI_MIN_SEED);
+			filter[prefix >> 6] |= 1ULL << (prefix & 63);
+		}
+	}
+	qsort(*postings, *npostings, sizeof(seed_posting_t), compare_postings);
+	uint64_t seeds = 0;
+	for (uint64_t i=0; i<*npostings; i++)
+		if (i == 0 || (*postings)[i].key != (*postings)[i-1].key)
+			seeds++;
+	return seeds;
+}
+
+/*
+ * The primers with degenerate bases are grouped by table and mask, and within a group
+ * they stay in the order we read them so the first primer with each encoding wins.
+ */
+static masked_primer_t *sorting_masked;
+
+static int compare_masked(const void *a, const void *b) {
+	const masked_primer_t *x = &sorting_masked[*(const uint32_t *) a], *y = &sorting_masked[*(const uint32_t *) b];
+	if (x->table != y->table)
+		return x->table < y->table ? -1 : 1;
+	int bx = __builtin_popcountll(x->mask), by = __builtin_popcountll(y->mask);
+	if (bx != by)
+		return bx > by ? -1 : 1;
+	if (x->mask != y->mask)
+		return x->mask < y->mask ? -1 : 1;
+	return *(const uint32_t *) a < *(const uint32_t *) b ? -1 : 1;
+}
+
+static bool has_masked(primer_index_t *idx, int table) {
+	for (uint32_t i=0; i<idx->nmasked_primers; i++)
+		if (idx->masked_primers[i].table == table)
+			return true;
+	return false;
+}
+
+/*
+ * Copy the trees into one block of memory. Each table is at most half full so we
+ * always find an empty slot quickly when the encoding is not there.
+ */
+static void flatten_primer_index(primer_index_t *idx) {
+	kmer_bst_t *trees[FATI_TABLES];
+	for (int i=0; i<=MAXKMER; i++)
+		trees[i] = i <= idx->maxkmer ? idx->all_primers[i] : NULL;
+	trees[FATI_TRUNC] = idx->trunc_primers;
+
+	fati_header_t h;
+	memset(&h, 0, sizeof(fati_header_t));
+	memcpy(h.magic, FATI_MAGIC, 4);
+	h.version = FATI_VERSION;
+	h.byte_order = FATI_BYTE_ORDER;
+	h.maxkmer = idx->maxkmer;
+	h.min_adapter_length = idx->min_adapter_length;
+	h.reverse = idx->reverse;
+	h.mismatches = idx->mismatches;
+	for (int k=0; k<=MAXKMER; k++)
+		for (int s=0; s<=idx->mismatches + 1; s++)
+			h.seed_starts[k][s] = seed_start(k, idx->mismatches, s);
+	h.unique_kmer_count = idx->unique_kmer_count;
+	for (int i=0; i<idx->unique_kmer_count; i++)
+		h.kmer_lengths[i] = idx->kmer_lengths[i];
+
+	// the short 3' primers are all the same length
+	int trunc = idx->min_adapter_length < MAXKMER ? idx->min_adapter_length : MAXKMER;
+	canon_table_t canon[FATI_TABLES];
+	uint64_t offset = (sizeof(fati_header_t) + 15) & ~15ULL;
+	for (int i=0; i<FATI_TABLES; i++) {
+		make_canonical(trees[i], &canon[i], i == FATI_TRUNC ? trunc : i);
+		uint64_t count = canon[i].count;
+		uint64_t slots = 1;
+		while (slots < 2 * count)
+			slots <<= 1;
+		h.tables[i].offset = offset;
+		h.tables[i].mask = slots - 1;
+		h.tables[i].count = count;
+		offset += slots * sizeof(fati_slot_t);
+	}
+
+	// the seeds, if we allow more than one mismatch
+	seed_primer_t *primers = NULL;
+	seed_posting_t *postings = NULL;
+	uint64_t nseeds = 0;
+	if (idx->mismatches > 1)
+		nseeds = make_seed_postings(idx, &primers, &h.nprimers, &postings, &h.npostings, h.seed_filter);
+	h.primers_offset = offset;
+	offset += h.nprimers * sizeof(fati_primer_t);
+	uint64_t seed_slots = 1;
+	while (seed_slots < 2 * nseeds)
+		seed_slots <<= 1;
+	h.seeds.offset = offset;
+	h.seeds.mask = seed_slots - 1;
+	h.seeds.count = nseeds;
+	offset += seed_slots * sizeof(fati_seed_t);
+	h.postings_offset = offset;
+	offset += (h.npostings * sizeof(uint32_t) + 15) & ~15ULL;
+
+	// the groups of primers with degenerate bases
+	uint32_t nmasked = idx->nmasked_primers;
+	uint32_t *order = malloc(sizeof(uint32_t) * (nmasked + 1));
+	for (uint32_t i=0; i<nmasked; i++)
+		order[i] = i;
+	sorting_masked = idx->masked_primers;
+	qsort(order, nmasked, sizeof(uint32_t), compare_masked);
+	masked_primer_t *masked = idx->masked_primers;
+	uint32_t *group_start = malloc(sizeof(uint32_t) * (nmasked + 1));
+	for (uint32_t i=0; i<nmasked; i++) {
+		masked_primer_t *m = &masked[order[i]];
+		if (i > 0 && m->table == masked[order[i-1]].table && m->mask == masked[order[i-1]].mask)
+			continue;
+		if (h.ngroups == UINT16_MAX) {
+			fprintf(stderr, "%sERROR: There are too many different patterns of degenerate bases in the primers%s\n", RED, ENDC);
+			exit(1);
+		}
+		if (h.group_count[m->table] == 0)
+			h.group_first[m->table] = h.ngroups;
+		h.group_count[m->table]++;
+		group_start[h.ngroups++] = i;
+	}
+	group_start[h.ngroups] = nmasked;
+	fati_group_t *groups = calloc(h.ngroups + 1, sizeof(fati_group_t));
+	h.groups_offset = offset;
+	offset += (h.ngroups * sizeof(fati_group_t) + 15) & ~15ULL;
+	for (uint32_t g=0; g<h.ngroups; g++) {
+		uint64_t count = group_start[g+1] - group_start[g];
+		uint64_t slots = 1;
+		while (slots < 2 * count)
+			slots <<= 1;
+		groups[g].mask = masked[order[group_start[g]]].mask;
+		groups[g].table.offset = offset;
+		groups[g].table.mask = slots - 1;
+		offset += slots * sizeof(fati_slot_t);
+	}
+
+	// each name is only written once, and the slots point to it
+	uint32_t *name_offsets = malloc(sizeof(uint32_t) * (idx->nnames + 1));
+	uint64_t names_size = 0;
+	for (uint32_t i=0; i<idx->nnames; i++) {
+		name_offsets[i] = (uint32_t) names_size;
+		names_size += strlen(idx->names[i]) + 1;
+		if (names_size >= FATI_EMPTY) {
+			fprintf(stderr, "%sERROR: There are too many primer names to put in the index%s\n", RED, ENDC);
+			exit(1);
+		}
+	}
+	// the direct address table of the short 3' primers
+	if (trunc > 0 && trunc <= FATI_DIRECT_MAX) {
+		h.direct_k = trunc;
+		h.direct_offset = offset;
+		offset += sizeof(uint32_t) << (2 * trunc);
+	}
+
+	h.names_offset = offset;
+	h.names_size = names_size;
+	h.size = offset + names_size;
+
+	char *flat = arena_alloc(idx->arena, h.size);
+	memcpy(flat, &h, sizeof(fati_header_t));
+	// all 1's is FATI_EMPTY
+	memset(flat + sizeof(fati_header_t), 0xFF, h.names_offset - sizeof(fati_header_t));
+	for (uint32_t i=0; i<idx->nnames; i++)
+		strcpy(flat + h.names_offset + name_offsets[i], idx->names[i]);
+	for (int i=0; i<FATI_TABLES; i++) {
+		add_to_table(&canon[i], flat, &((fati_header_t *) flat)->tables[i], name_offsets);
+		free(canon[i].slots);
+	}
+
+	fati_primer_t *fprimers = (fati_primer_t *) (flat + h.primers_offset);
+	for (uint64_t i=0; i<h.nprimers; i++) {
+		fprimers[i].value = primers[i].value;
+		fprimers[i].name = name_offsets[primers[i].base];
+		fprimers[i].k = primers[i].k;
+	}
+	// an empty seed slot has a count of 0
+	fati_seed_t *seeds = (fati_seed_t *) (flat + h.seeds.offset);
+	memset(seeds, 0, (h.seeds.mask + 1) * sizeof(fati_seed_t));
+	uint32_t *fpostings = (uint32_t *) (flat + h.postings_offset);
+	for (uint64_t i=0; i<h.npostings; i++) {
+		fpostings[i] = postings[i].primer;
+		if (i > 0 && postings[i].key == postings[i-1].key)
+			continue;
+		uint64_t j = fati_hash(postings[i].key) & h.seeds.mask;
+		while (seeds[j].count)
+			j = (j + 1) & h.seeds.mask;
+		seeds[j].key = postings[i].key;
+		seeds[j].first = i;
+		uint64_t end = i;
+		while (end < h.npostings && postings[end].key == postings[i].key)
+			end++;
+		seeds[j].count = end - i;
+	}
+
+	memcpy(flat + h.groups_offset, groups, h.ngroups * sizeof(fati_group_t));
+	for (uint32_t g=0; g<h.ngroups; g++) {
+		fati_group_t *group = &((fati_group_t *) (flat + h.groups_offset))[g];
+		fati_slot_t *slots = (fati_slot_t *) (flat + group->table.offset);
+		for (uint32_t i=group_start[g]; i<group_start[g+1]; i++) {
+			masked_primer_t *m = &masked[order[i]];
+			if (table_lookup(flat, &group->table, m->value))
+				continue;
+			uint64_t j = fati_hash(m->value) & group->table.mask;
+			while (slots[j].name != FATI_EMPTY)
+				j = (j + 1) & group->table.mask;
+			slots[j].value = m->value;
+			slots[j].name = name_offsets[m->name.base];
+			slots[j].snp_posn = m->name.snp_posn;
+			slots[j].strand = 0;
+			slots[j].snp_from = m->name.snp_from;
+			slots[j].snp_to = m->name.snp_to;
+			group->table.count++;
+		}
+	}
+
+	// every encoding gets whatever primer_lookup finds for it, so the two always agree
+	idx->flat = flat;
+	if (h.direct_k) {
+		uint32_t *direct = (uint32_t *) (flat + h.direct_offset);
+		for (uint64_t enc=0; enc < 1ULL << (2 * h.direct_k); enc++) {
+			bool partner;
+			const fati_slot_t *slot = primer_lookup(idx, FATI_TRUNC, enc, reverse_complement(enc, h.direct_k), &partner);
+			direct[enc] = slot ? (uint32_t) (((const char *) slot - flat) / sizeof(fati_slot_t)) << 1 | partner : FATI_EMPTY;
+		}
+	}
+
+	free(order);
+	free(group_start);
+	free(groups);
+	free(primers);
+	free(postings);
+	free(name_offsets);
+
+	idx->flat_size = h.size;
+}
+
+primer_index_t *build_primer_index(struct options *opt) {
+	// everything in the index comes from this arena, so we can free it all at once.
+	// We get more memory for the trees once we know how many primers there are.
+	arena_t *arena = arena_create(1 << 16);
+	primer_index_t *idx = arena_alloc(arena, sizeof(primer_index_t));
+	memset(idx, 0, sizeof(primer_index_t));
+	idx->arena = arena;
+	idx->maxkmer = opt->maxkmer;
+	idx->min_adapter_length = opt->min_adapter_length;
+	idx->reverse = opt->reverse;
+	idx->mismatches = opt->mismatches;
+	idx->mapped = false;
+
+	// create an array of kmer_bsts. all_primers[k] is the full length sequences of length k
+	for (int i = 0; i<=opt->maxkmer; i++)
+		idx->all_primers[i] = new_primer_root(arena);
+
+	// trunc_primers is the short sequences that will be searched at the 3' end of the sequence
+	// these sequences are all the same length (default: 6 bp)
+	idx->trunc_primers = new_primer_root(arena);
+
+	// read the primer file for all primers, and truncate them (if min_adapter_length > 0)
+	read_primers_create_snps(opt->primers, idx, opt->verbose);
+
+	if (opt->debug) {	
+		fprintf(stderr, "%sWe have read the primers%s\n", GREEN, ENDC);
+		for (int i = 0; i<=opt->maxkmer; i++)
+			print_all_primers(idx->all_primers[i], i, idx->names);
+	}
+
+	// First, we make an array with just the lengths of the kmers we need to encode
+	// and then we encode those kmers. This reduces our search from ~30 to ~3
+	// (depending on how many primer lengths we have).
+	// We also do this longer primers to shorter, so that we initially trim off the
+	// longest possible primers.
+	// A tree that has had a primer added has children, even if that primer encodes to 0
+	idx->unique_kmer_count = 0;
+	for (int i=opt->maxkmer; i>0; i--) 
+		if (idx->all_primers[i]->bigger != NULL || has_masked(idx, i))
+			idx->kmer_lengths[idx->unique_kmer_count++] = i; 	// we need to remember this kmer length
+
+	flatten_primer_index(idx);
+	if (opt->verbose)
+		fprintf(stderr, "%sThe primer index uses %zu bytes of memory%s\n", GREEN, arena->reserved, ENDC);
+	return idx;
+}
+
+void save_primer_index(primer_index_t *idx, char *file) {
+	FILE *out = fopen(file, "wb");
+	if (out == NULL) {
+		fprintf(stderr, "%sERROR: Can not open %s to write the index%s\n", RED, file, ENDC);
+		exit(3);
+	}
+	if (fwrite(idx->flat, 1, idx->flat_size, out) != idx->flat_size || fclose(out) != 0) {
+		fprintf(stderr, "%sERROR: Could not write the index to %s%s\n", RED, file, ENDC);
+		exit(3);
+	}
+}
+
+static void bad_index(char *file, char *why) {
+	fprintf(stderr, "%sERROR: %s is not a valid index: %s. Please rebuild it with fast-adapter-trimming index%s\n", RED, file, why, ENDC);
+	exit(3);
+}
+
+/*
+ * Is offset a slot with a primer in it in the table of short 3' primers, or one of their groups?
+ */
+static bool in_table(const char *flat, const fati_table_t *t, uint64_t offset) {
+	return offset >= t->offset && offset < t->offset + (t->mask + 1) * sizeof(fati_slot_t)
+		&& ((const fati_slot_t *) (flat + offset))->name != FATI_EMPTY;
+}
+
+static bool short_primer_slot(fati_header_t *h, fati_group_t *groups, uint64_t offset) {
+	if (in_table((char *) h, &h->tables[FATI_TRUNC], offset))
+		return true;
+	for (int g=h->group_first[FATI_TRUNC]; g<h->group_first[FATI_TRUNC] + h->group_count[FATI_TRUNC]; g++)
+		if (in_table((char *) h, &groups[g].table, offset))
+			return true;
+	return false;
+}
+
+/*
+ * mmap length bytes of fd read only and check that it is an index. The index may be
+ * shorter than the mapping (hugepage files are rounded up to a whole page).
+ */
+static primer_index_t *map_primer_index(int fd, char *file, size_t length) {
+	if (length < sizeof(fati_header_t))
+		bad_index(file, "it is too short");
+	char *flat = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+	if (flat == MAP_FAILED) {
+		fprintf(stderr, "%sERROR: Can not mmap the index %s%s\n", RED, file, ENDC);
+		exit(3);
+	}
+
+	fati_header_t *h = (fati_header_t *) flat;
+	if (memcmp(h->magic, FATI_MAGIC, 4) != 0)
+		bad_index(file, "the magic number is wrong");
+	if (h->version != FATI_VERSION)
+		bad_index(file, "it was written by a different version");
+	if (h->byte_order != FATI_BYTE_ORDER)
+		bad_index(file, "it was written on a machine with a different byte order");
+	if (h->size > length)
+		bad_index(file, "it is the wrong size");
+	if (h->maxkmer > MAXKMER || h->unique_kmer_count > MAXKMER + 1)
+		bad_index(file, "the kmer lengths are wrong");
+	if (h->mismatches > MAXMISMATCHES)
+		bad_index(file, "it allows too many mismatches");
+	if (h->names_offset + h->names_size != h->size || (h->names_size && flat[h->size - 1] != '\0'))
+		bad_index(file, "the names are wrong");
+	for (int i=0; i<FATI_TABLES; i++) {
+		fati_table_t *t = &h->tables[i];
+		if (t->mask >= h->size || (t->mask & (t->mask + 1)) != 0 || t->count > t->mask || t->offset % 16
+				|| t->offset + (t->mask + 1) * sizeof(fati_slot_t) > h->names_offset)
+			bad_index(file, "a table is wrong");
+		fati_slot_t *slots = (fati_slot_t *) (flat + t->offset);
+		for (uint64_t j=0; j<=t->mask; j++)
+			if (slots[j].name != FATI_EMPTY && (slots[j].name >= h->names_size || slots[j].strand > (FATI_NAMED_RC | FATI_PARTNER)
+						|| ((slots[j].strand & FATI_PARTNER) && slots[j].name + strlen(flat + h->names_offset + slots[j].name) + 1 >= h->names_size)))
+				bad_index(file, "a primer name is wrong");
+	}
+	if (h->nprimers >= h->size || h->seeds.mask >= h->size || h->npostings > h->nprimers * (h->mismatches + 1)
+			|| h->primers_offset % 16 || h->primers_offset + h->nprimers * sizeof(fati_primer_t) > h->seeds.offset
+			|| h->seeds.offset % 16 || (h->seeds.mask & (h->seeds.mask + 1)) != 0 || h->seeds.count > h->seeds.mask
+			|| h->seeds.offset + (h->seeds.mask + 1) * sizeof(fati_seed_t) > h->postings_offset
+			|| h->postings_offset + h->npostings * sizeof(uint32_t) > h->names_offset)
+		bad_index(file, "the seeds are wrong");
+	if (h->groups_offset % 16 || h->ngroups > UINT16_MAX || h->groups_offset < h->postings_offset + h->npostings * sizeof(uint32_t)
+			|| h->groups_offset + h->ngroups * sizeof(fati_group_t) > h->names_offset)
+		bad_index(file, "the degenerate primers are wrong");
+	fati_group_t *groups = (fati_group_t *) (flat + h->groups_offset);
+	for (int i=0; i<FATI_TABLES; i++)
+		if (h->group_first[i] + h->group_count[i] > h->ngroups)
+			bad_index(file, "the degenerate primers are wrong");
+	for (uint32_t g=0; g<h->ngroups; g++) {
+		fati_table_t *t = &groups[g].table;
+		if (t->mask >= h->size || (t->mask & (t->mask + 1)) != 0 || t->count > t->mask || t->offset % 16
+				|| t->offset < h->groups_offset || t->offset + (t->mask + 1) * sizeof(fati_slot_t) > h->names_offset)
+			bad_index(file, "a table of degenerate primers is wrong");
+		fati_slot_t *slots = (fati_slot_t *) (flat + t->offset);
+		for (uint64_t j=0; j<=t->mask; j++)
+			if (slots[j].name != FATI_EMPTY && slots[j].name >= h->names_size)
+				bad_index(file, "a primer name is wrong");
+	}
+	if (h->direct_k) {
+		if (h->direct_k > FATI_DIRECT_MAX || h->direct_k != (h->min_adapter_length < MAXKMER ? h->min_adapter_length : MAXKMER)
+				|| h->direct_offset % 16 || h->direct_offset + (sizeof(uint32_t) << (2 * h->direct_k)) > h->names_offset)
+			bad_index(file, "the short primers are wrong");
+		uint32_t *direct = (uint32_t *) (flat + h->direct_offset);
+		for (uint64_t j=0; j < 1ULL << (2 * h->direct_k); j++)
+			if (direct[j] != FATI_EMPTY && !short_primer_slot(h, groups, (uint64_t) (direct[j] >> 1) * sizeof(fati_slot_t)))
+				bad_index(file, "the short primers are wrong");
+	}
+	for (int k=0; k<=MAXKMER; k++)
+		for (uint32_t s=0; s<=h->mismatches + 1; s++)
+			if (h->seed_starts[k][s] != seed_start(k, h->mismatches, s))
+				bad_index(file, "the seeds are wrong");
+	fati_primer_t *primers = (fati_primer_t *) (flat + h->primers_offset);
+	uint64_t npostings = 0;
+	for (uint64_t i=0; i<h->nprimers; i++) {
+		if (primers[i].name >= h->names_size || primers[i].k < 1 || primers[i].k > h->maxkmer || !seeded_length(primers[i].k, h->mismatches))
+			bad_index(file, "a seed primer is wrong");
+		npostings += seed_budget(primers[i].k, h->mismatches) + 1;
+	}
+	if (npostings != h->npostings)
+		bad_index(file, "the seeds are wrong");
+	uint32_t *postings = (uint32_t *) (flat + h->postings_offset);
+	for (uint64_t i=0; i<h->npostings; i++)
+		if (postings[i] >= h->nprimers)
+			bad_index(file, "a seed is wrong");
+	fati_seed_t *seeds = (fati_seed_t *) (flat + h->seeds.offset);
+	for (uint64_t i=0; i<=h->seeds.mask; i++)
+		if ((uint64_t) seeds[i].first + seeds[i].count > h->npostings)
+			bad_index(file, "a seed is wrong");
+
+	primer_index_t *idx = calloc(1, sizeof(primer_index_t));
+	if (idx == NULL) {
+		fprintf(stderr, "%sERROR: Can't malloc memory for the primer index%s\n", RED, ENDC);
+		exit(1);
+	}
+	idx->maxkmer = h->maxkmer;
+	idx->min_adapter_length = h->min_adapter_length;
+	idx->reverse = h->reverse;
+	idx->mismatches = h->mismatches;
+	idx->unique_kmer_count = h->unique_kmer_count;
+	for (int i=0; i<idx->unique_kmer_count; i++) {
+		if (h->kmer_lengths[i] < 1 || h->kmer_lengths[i] > (int) h->maxkmer)
+			bad_index(file, "the kmer lengths are wrong");
+		idx->kmer_lengths[i] = h->kmer_lengths[i];
+	}
+	idx->flat = flat;
+	idx->flat_size = length;
+	idx->mapped = true;
+	return idx;
+}
+
+primer_index_t *load_primer_index(char *file) {
+	int fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%sERROR: Can not open the index %s%s\n", RED, file, ENDC);
+		exit(3);
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		bad_index(file, "we can not stat it");
+	}
+	primer_index_t *idx = map_primer_index(fd, file, st.st_size);
+	if (((fati_header_t *) idx->flat)->size != (uint64_t) st.st_size)
+		bad_index(file, "it is the wrong size");
+	close(fd);
+	return idx;
+}
+
+/*
+ * The name of a shared index depends on everything that changes what is in it: the bytes
+ * in the primer file, the options we built it with, and the format version.
+ * This is 64-bit FNV-1a.
+ */
+static uint64_t index_key(struct options *opt) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	FILE *in = fopen(opt->primers, "rb");
+	if (in == NULL) {
+		fprintf(stderr, "%sERROR: The file %s can not be found. Please check the file path%s\n", RED, opt->primers, ENDC);
+		exit(3);
+	}
+	unsigned char buf[65536];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+		for (size_t i=0; i<n; i++)
+			hash = (hash ^ buf[i]) * 0x100000001b3ULL;
+	fclose(in);
+	int params[5] = {opt->maxkmer, opt->min_adapter_length, opt->reverse, opt->mismatches, FATI_VERSION};
+	unsigned char *p = (unsigned char *) params;
+	for (size_t i=0; i<sizeof(params); i++)
+		hash = (hash ^ p[i]) * 0x100000001b3ULL;
+	return hash;
+}
+
+static int open_shared(char *name, bool hugepages, int flags) {
+	if (hugepages)
+		return open(name, flags, 0644);
+	return shm_open(name, flags, 0644);
+}
+
+static void unlink_shared(char *name, bool hugepages) {
+	if (hugepages)
+		unlink(name);
+	else
+		shm_unlink(name);
+}
+
+/*
+ * Wait for another process to finish publishing the index. It writes the magic number last,
+ * and holds a lock on the segment until then. If nobody has the lock and there is still no
+ * magic number, it died before it finished, so we set *stale and give up straight away.
+ */
+static primer_index_t *attach_shared(int fd, char *name, bool *stale) {
+	struct timespec nap = {0, 10000000};
+	*stale = false;
+	for (int tries = 0; tries < 3000; tries++) {
+		// look at the lock before the magic number, so we don't miss it if they just finished
+		bool unlocked = flock(fd, LOCK_SH | LOCK_NB) == 0;
+		if (unlocked)
+			flock(fd, LOCK_UN);
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(fati_header_t)) {
+			char magic[4];
+			if (pread(fd, magic, 4, 0) == 4 && memcmp(magic, FATI_MAGIC, 4) == 0)
+				return map_primer_index(fd, name, st.st_size);
+		}
+		if (unlocked) {
+			*stale = true;
+			return NULL;
+		}
+		nanosleep(&nap, NULL);
+	}
+	return NULL;
+}
+
+/*
+ * Copy the index we built into a new shared segment. We write everything except the magic
+ * number, and then the magic number, so nobody uses it before it is complete.
+ */
+static bool publish_shared(int fd, primer_index_t *idx, bool hugepages) {
+	size_t length = idx->flat_size;
+	if (hugepages) {
+		// hugetlbfs files have to be a whole number of huge pages
+		struct statfs sfs;
+		if (fstatfs(fd, &sfs) != 0)
+			return false;
+		length = (length + sfs.f_bsize - 1) / sfs.f_bsize * sfs.f_bsize;
+	}
+	if (ftruncate(fd, length) != 0)
+		return false;
+	char *dest = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (dest == MAP_FAILED)
+		return false;
+	memcpy(dest + 4, idx->flat + 4, idx->flat_size - 4);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(dest, idx->flat, 4);
+	munmap(dest, length);
+	return true;
+}
+
+primer_index_t *shared_primer_index(struct options *opt, char *hugepage_dir) {
+	char name[PATH_MAX];
+	uint64_t key = index_key(opt);
+	if (hugepage_dir)
+		snprintf(name, sizeof(name), "%s/fat-index-%016" PRIx64, hugepage_dir, key);
+	else
+		snprintf(name, sizeof(name), "/fat-index-%016" PRIx64, key);
+	bool hugepages = hugepage_dir != NULL;
+
+	// if we find one that a dead job left unfinished, we remove it and try once more
+	for (int attempt = 0; attempt < 2; attempt++) {
+		// someone may already have published it
+		int fd = open_shared(name, hugepages, O_RDONLY);
+		if (fd < 0 && errno == ENOENT) {
+			fd = open_shared(name, hugepages, O_RDWR | O_CREAT | O_EXCL);
+			if (fd >= 0) {
+				// we are the first, so build it and share it. We hold the lock until it is
+				// finished (closing fd lets it go), so the others can tell if we die first
+				flock(fd, LOCK_EX);
+				primer_index_t *built = build_primer_index(opt);
+				bool ok = publish_shared(fd, built, hugepages);
+				close(fd);
+				if (!ok) {
+					fprintf(stderr, "%sWARNING: Could not publish the primer index to %s, so we are not sharing it%s\n", BLUE, name, ENDC);
+					unlink_shared(name, hugepages);
+					return built;
+				}
+				if (opt->verbose)
+					fprintf(stderr, "%sPublished the primer index to %s%s\n", GREEN, name, ENDC);
+				free_primer_index(built);
+				fd = open_shared(name, hugepages, O_RDONLY);
+			} else if (errno == EEXIST) {
+				// someone beat us to it
+				fd = open_shared(name, hugepages, O_RDONLY);
+			}
+		}
+		if (fd < 0) {
+			fprintf(stderr, "%sWARNING: Could not open the shared primer index %s. We will build our own%s\n", BLUE, name, ENDC);
+			return build_primer_index(opt);
+		}
+		bool stale;
+		primer_index_t *idx = attach_shared(fd, name, &stale);
+		close(fd);
+		if (idx) {
+			if (opt->verbose)
+				fprintf(stderr, "%sUsing the shared primer index %s%s\n", GREEN, name, ENDC);
+			return idx;
+		}
+		if (!stale)
+			break;
+		fprintf(stderr, "%sWARNING: The job that was publishing %s died before it finished, so we will remove it and publish it again%s\n", BLUE, name, ENDC);
+		unlink_shared(name, hugepages);
+	}
+	fprintf(stderr, "%sWARNING: Another job is still publishing %s after 30 seconds. We will build our own index%s\n", BLUE, name, ENDC);
+	return build_primer_index(opt);
+}
+
+void free_primer_index(primer_index_t *idx) {
+	if (idx->mapped) {
+		munmap(idx->flat, idx->flat_size);
+		free(idx);
+	} else {
+		// idx is in the arena too
+		arena_destroy(idx->arena);
+	}
+}
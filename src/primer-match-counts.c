@@ -55,7 +55,7 @@ void count_primer_occurrence(primer_counts_t *pc, char * id, char before, char a
 
 	if (found)
 		return;
-	n->id = id;
+	n->id = strdup(id); // id may be a buffer that the caller reuses
 	n->count++;
 	switch(before) {
 		case 'A':
@@ -0,0 +1,148 @@
+/*
+ * Report the progress of long runs every few seconds.
+ *
+ * The search threads publish their counts (see progress.h) and this thread wakes up every
+ * opt->progress seconds and writes reads/sec, compressed MB/sec in, the fraction of reads trimmed
+ * and how much data is waiting between the stages.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "colours.h"
+#include "progress.h"
+
+static const char *stream_names[2] = {"R1", "R2"};
+
+static double elapsed(progress_t *p) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - p->start.tv_sec) + (now.tv_nsec - p->start.tv_nsec) / 1e9;
+}
+
+static void report(progress_t *p, bool final) {
+	double now = elapsed(p);
+	double dt = now - p->last_time;
+	if (dt <= 0)
+		dt = 1e-9;
+
+	if (!p->tsv) {
+		int secs = (int) now;
+		fprintf(p->out, "%s[progress %02d:%02d:%02d]%s", GREEN, secs / 3600, (secs / 60) % 60, secs % 60, ENDC);
+	}
+
+	for (int i=0; i<2; i++) {
+		progress_stream_t *ps = &p->streams[i];
+		if (!atomic_load_explicit(&ps->active, memory_order_relaxed))
+			continue;
+		uint64_t reads = atomic_load_explicit(&ps->reads, memory_order_relaxed);
+		uint64_t trimmed = atomic_load_explicit(&ps->trimmed, memory_order_relaxed);
+		uint64_t written = atomic_load_explicit(&ps->written, memory_order_relaxed);
+		uint64_t bytes = atomic_load_explicit(&ps->bytes_in, memory_order_relaxed);
+		uint64_t pipe_bytes = atomic_load_explicit(&ps->pipe_bytes, memory_order_relaxed);
+		uint64_t pending = atomic_load_explicit(&ps->pending, memory_order_relaxed);
+
+		// the paired end search reads R1 twice, so the counters can go backwards between reports
+		double rps = reads >= p->last_reads[i] ? (reads - p->last_reads[i]) / dt : 0;
+		double mbps = bytes >= p->last_bytes[i] ? (bytes - p->last_bytes[i]) / dt / 1e6 : 0;
+		double trimfrac = reads ? (double) trimmed / reads : 0;
+
+		if (p->tsv)
+			fprintf(p->out, "%.1f\t%s\t%" PRIu64 "\t%.0f\t%.2f\t%.4f\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%s\n",
+					now, stream_names[i], reads, rps, mbps, trimfrac, written, pipe_bytes, pending, final ? "final" : "running");
+		else
+			fprintf(p->out, " %s: %" PRIu64 " reads %.1fk reads/s %.2f MB/s in %.1f%% trimmed %" PRIu64 " written pipe %" PRIu64 " KB pending %" PRIu64,
+					stream_names[i], reads, rps / 1000, mbps, trimfrac * 100, written, pipe_bytes / 1024, pending);
+
+		p->last_reads[i] = reads;
+		p->last_bytes[i] = bytes;
+	}
+	if (!p->tsv)
+		fprintf(p->out, "%s\n", final ? " (final)" : "");
+	fflush(p->out);
+	p->last_time = now;
+}
+
+static void *progress_thread(void *arg) {
+	progress_t *p = (progress_t *) arg;
+	double next = p->interval;
+	// wake up often so that we stop promptly, but only report every interval seconds
+	struct timespec nap = {0, 100000000};
+	while (!atomic_load(&p->stop)) {
+		nanosleep(&nap, NULL);
+		if (elapsed(p) >= next) {
+			report(p, false);
+			next += p->interval;
+		}
+	}
+	return NULL;
+}
+
+progress_t *progress_start(int interval, char *file) {
+	if (interval <= 0)
+		return NULL;
+
+	progress_t *p = calloc(1, sizeof(progress_t));
+	if (p == NULL) {
+		fprintf(stderr, "%sERROR: Can't allocate memory for progress reporting%s\n", RED, ENDC);
+		exit(2);
+	}
+	p->interval = interval;
+	p->out = stderr;
+	if (file) {
+		p->out = fopen(file, "w");
+		if (p->out == NULL) {
+			fprintf(stderr, "%sERROR: Can not open %s to write progress%s\n", RED, file, ENDC);
+			exit(3);
+		}
+		p->tsv = true;
+		fprintf(p->out, "elapsed_s\tstream\treads\treads_per_s\tMB_per_s_in\ttrimmed_fraction\twritten\tpipe_bytes\tpending\tstate\n");
+	}
+	clock_gettime(CLOCK_MONOTONIC, &p->start);
+
+	int result_code = pthread_create(&p->thread, NULL, &progress_thread, (void *) p);
+	if (result_code) {
+		fprintf(stderr, "%sERROR: Starting the progress thread returned the error code %d%s\n", RED, result_code, ENDC);
+		free(p);
+		return NULL;
+	}
+	return p;
+}
+
+void progress_update(progress_t *p, int stream, uint64_t reads, uint64_t trimmed, uint64_t written, uint64_t bytes_in, FILE *pipe) {
+	if (p == NULL)
+		return;
+	progress_stream_t *ps = &p->streams[stream];
+	atomic_store_explicit(&ps->reads, reads, memory_order_relaxed);
+	atomic_store_explicit(&ps->trimmed, trimmed, memory_order_relaxed);
+	atomic_store_explicit(&ps->written, written, memory_order_relaxed);
+	atomic_store_explicit(&ps->bytes_in, bytes_in, memory_order_relaxed);
+	if (pipe) {
+		// how many bytes are sitting in the pipe waiting for gzip to compress them
+		int waiting = 0;
+		if (ioctl(fileno(pipe), FIONREAD, &waiting) == 0)
+			atomic_store_explicit(&ps->pipe_bytes, (uint64_t) waiting, memory_order_relaxed);
+	}
+	atomic_store_explicit(&ps->active, true, memory_order_relaxed);
+}
+
+void progress_pending(progress_t *p, int stream, uint64_t pending) {
+	if (p == NULL)
+		return;
+	atomic_store_explicit(&p->streams[stream].pending, pending, memory_order_relaxed);
+}
+
+void progress_stop(progress_t *p) {
+	if (p == NULL)
+		return;
+	atomic_store(&p->stop, true);
+	pthread_join(p->thread, NULL);
+	report(p, true);
+	if (p->out != stderr)
+		fclose(p->out);
+	free(p);
+}
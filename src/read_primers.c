@@ -15,12 +15,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <zlib.h>
+#include "arena.h"
 #include "colours.h"
 #include "primers.h"
 #include "structs.h"
 #include "definitions.h"
 #include "create-snps.h"
 #include "kseq.h"
+#include "primer-index.h"
 #include "print-sequences.h"
 #include "rob_dna.h"
 #include "seqs_to_ints.h"
@@ -28,169 +30,252 @@
 
 KSEQ_INIT(gzFile, gzread);
 
-void read_primers(char* primerfile, kmer_bst_t** all_primers, int maxkmer, bool reverse, int verbose) {
+/*
+ * Remember a primer name and return its number
+ */
+static uint32_t add_primer_name(primer_index_t *idx, char *name, char *suffix) {
+	idx->names[idx->nnames] = arena_sprintf(idx->arena, "%s%s", name, suffix);
+	return idx->nnames++;
+}
+
+typedef struct primer_seq {
+	char *name;
+	char *seq;
+	int len;
+} primer_seq_t;
+
+/*
+ * Read all the sequences in primerfile into the arena. Returns how many there are, or -1 if we can't read the file.
+ */
+static int read_primer_seqs(char *primerfile, arena_t *arena, primer_seq_t **seqs, int verbose) {
+	if( access( primerfile, R_OK ) == -1 ) {
+		// file doesn't exist
+		fprintf(stderr, "%sERROR: The file %s can not be found. Please check the file path%s\n", RED, primerfile, ENDC);
+		return -1;
+	}
+
+	if (verbose)
+		fprintf(stderr, "%sREADING %s%s\n", PINK, primerfile, ENDC);
+
+	gzFile fp = gzopen(primerfile, "r");
+	kseq_t *seq = kseq_init(fp);
+	int n = 0;
+	int size = 64;
+	*seqs = malloc(sizeof(primer_seq_t) * size);
+	while (kseq_read(seq) >= 0) {
+		if (n == size) {
+			size *= 2;
+			*seqs = realloc(*seqs, sizeof(primer_seq_t) * size);
+		}
+		(*seqs)[n].name = arena_sprintf(arena, "%s", seq->name.s);
+		(*seqs)[n].seq = arena_sprintf(arena, "%s", seq->seq.s);
+		(*seqs)[n].len = seq->seq.l;
+		n++;
+	}
+	kseq_destroy(seq);
+	int ret = gzclose(fp);
+	if (ret != 0)
+		fprintf(stderr, "Closing the kseq filehandle returned %d\n", ret);
+	return n;
+}
+
+void read_primers(char* primerfile, primer_index_t *idx, int verbose) {
 	/*
 	 * encode the primers in primerfile 
 	 *
-	 * We expect all_primers to be an array of 0-maxkmer kmer_bst_t's
+	 * We expect idx->all_primers to be an array of 0-maxkmer kmer_bst_t's
 	 *
 	 * Note: we need to take the correct substring of the sequence to reverse complement! We need the rightmose k-bases 
 	 * otherwise we have an offset of length(string) - kmer to where the match should be.
 	 *
 	 */
-	if( access( primerfile, R_OK ) == -1 ) {
-		// file doesn't exist
-		fprintf(stderr, "%sERROR: The file %s can not be found. Please check the file path%s\n", RED, primerfile, ENDC);
+	primer_seq_t *seqs;
+	int n = read_primer_seqs(primerfile, idx->arena, &seqs, verbose);
+	if (n < 0)
 		return;
-	}
+	idx->names = arena_alloc(idx->arena, sizeof(char *) * n * 2);
+	idx->nnames = 0;
 
-	gzFile fp;
-	kseq_t *seq;
-
-	fp = gzopen(primerfile, "r");
-	seq = kseq_init(fp);
-	int l;
-	while ((l = kseq_read(seq)) >= 0) {
-		int kmer = seq->seq.l;
-		if (seq->seq.l > maxkmer) {
-			fprintf(stderr, "%sWARNING: Length of %s is longer than our maximum (%ld bp), so we had to truncate it%s\n", RED, seq->name.s, seq->seq.l, ENDC);
-			kmer = maxkmer;
+	for (int i=0; i<n; i++) {
+		int kmer = seqs[i].len;
+		if (seqs[i].len > idx->maxkmer) {
+			fprintf(stderr, "%sWARNING: Length of %s is longer than our maximum (%d bp), so we had to truncate it%s\n", RED, seqs[i].name, seqs[i].len, ENDC);
+			kmer = idx->maxkmer;
 		}
-		uint64_t enc = kmer_encoding(seq->seq.s, 0, kmer);
-		
-		add_primer(enc, seq->name.s, all_primers[kmer]);
-		if (reverse) {
-			uint64_t rcenc = kmer_encoding(seq->seq.s, seq->seq.l - kmer, kmer);
+		uint64_t enc = kmer_encoding(seqs[i].seq, 0, kmer);
+		primer_name_t name = {add_primer_name(idx, seqs[i].name, ""), -1, 0, 0};
+		add_primer(enc, name, idx->all_primers[kmer], idx->arena);
+		if (idx->reverse) {
+			uint64_t rcenc = kmer_encoding(seqs[i].seq, seqs[i].len - kmer, kmer);
 			enc = reverse_complement(rcenc, kmer);
-			char revname[seq->name.l+3];
-			strcpy(revname, seq->name.s);
-			strcat(revname, " rc");
+			name.base = add_primer_name(idx, seqs[i].name, " rc");
 			if (verbose)
-				fprintf(stderr, "%sAdded a rc primer: %s %s\n", GREEN, revname, ENDC);
-			add_primer(enc, revname, all_primers[kmer]);
+				fprintf(stderr, "%sAdded a rc primer: %s %s\n", GREEN, idx->names[name.base], ENDC);
+			add_primer(enc, name, idx->all_primers[kmer], idx->arena);
 		}
 			
 		if (verbose)
-			fprintf(stderr, "%sEncoding %s with length %ld using k-mer %d%s\n", GREEN, seq->seq.s, seq->seq.l, kmer, ENDC);
+			fprintf(stderr, "%sEncoding %s with length %d using k-mer %d%s\n", GREEN, seqs[i].seq, seqs[i].len, kmer, ENDC);
 	}
-	kseq_destroy(seq);
-	gzclose(fp);
+	free(seqs);
+}
+
+/*
+ * Does the sequence have anything other than A, C, G, and T?
+ */
+static bool degenerate(char *seq) {
+	for (char *c=seq; *c; c++)
+		if (strchr("ACGTacgt", *c) == NULL)
+			return true;
+	return false;
+}
+
+static void add_masked_primer(primer_index_t *idx, uint64_t value, uint64_t mask, primer_name_t name, int table) {
+	masked_primer_t *p = &idx->masked_primers[idx->nmasked_primers++];
+	p->value = value;
+	p->mask = mask;
+	p->name = name;
+	p->table = table;
 }
 
-void read_primers_create_snps(char* primerfile, kmer_bst_t** all_primers, int maxkmer, bool reverse, int verbose) {
+/*
+ * A primer with degenerate bases, and its SNPs at all the positions that are not degenerate.
+ */
+static void add_masked_primer_and_snps(primer_index_t *idx, char *seq, int kmer, uint32_t base, uint64_t enc, uint64_t mask, int table) {
+	primer_name_t name = {base, -1, 0, 0};
+	add_masked_primer(idx, enc, mask, name, table);
+	if (idx->mismatches == 0)
+		return;
+	for (int i=0; i<kmer; i++) {
+		int shift = 2 * (kmer - 1 - i);
+		if (((mask >> shift) & 3) != 3)
+			continue;
+		for (uint64_t b=0; b<4; b++) {
+			if (b == ((enc >> shift) & 3))
+				continue;
+			primer_name_t snpname = {base, i, seq[i], "ACGT"[b]};
+			add_masked_primer(idx, (enc & ~(3ULL << shift)) | (b << shift), mask, snpname, table);
+		}
+	}
+}
+
+/*
+ * Add a primer to its table (a length, or FATI_TRUNC), with all of its SNPs unless we only
+ * want exact matches. If we allow more mismatches than that, we also remember the full length
+ * primers so we can split them into seeds. Primers with degenerate bases are kept separately
+ * with the mask of the bases we compare.
+ */
+static void add_primer_and_snps(primer_index_t *idx, char *seq, int kmer, uint32_t base, int table) {
+	kmer_bst_t *primers = table == FATI_TRUNC ? idx->trunc_primers : idx->all_primers[table];
+	uint64_t mask;
+	uint64_t enc = kmer_iupac_encoding(seq, 0, kmer, &mask);
+	if (mask != (1ULL << (2 * kmer)) - 1) {
+		add_masked_primer_and_snps(idx, seq, kmer, base, enc, mask, table);
+		return;
+	}
+	if (idx->mismatches == 0) {
+		primer_name_t name = {base, -1, 0, 0};
+		add_primer(enc, name, primers, idx->arena);
+	} else {
+		create_all_snps(seq, kmer, base, primers, idx->arena, idx->names, false);
+	}
+	if (table != FATI_TRUNC && idx->mismatches > 1) {
+		seed_primer_t *p = &idx->seed_primers[idx->nseed_primers++];
+		p->value = enc;
+		p->base = base;
+		p->k = kmer;
+	}
+}
+
+void read_primers_create_snps(char* primerfile, primer_index_t *idx, int verbose) {
 	/*
 	 * encode the primers in primerfile and create all snps for all primers.
+	 * (With idx->mismatches 0 we don't make the snps, and with more than 1 we also keep the
+	 * full length primers to split into seeds. The short 3' primers only ever have 1 mismatch.
+	 * Primers with degenerate bases (e.g. N) go in idx->masked_primers instead of the trees.)
+	 * We also truncate each primer to idx->min_adapter_length bp (and create all their snps)
+	 * for the search at the 3' end.
 	 *
-	 * We expect all_primers to be an array of 0-maxkmer kmer_bst_t's
+	 * We expect idx->all_primers to be an array of 0-maxkmer kmer_bst_t's
 	 *
 	 * Note: we need to take the correct substring of the sequence to reverse complement! We need the rightmose k-bases 
 	 * otherwise we have an offset of length(string) - kmer to where the match should be.
 	 *
 	 */
-	if( access( primerfile, R_OK ) == -1 ) {
-		// file doesn't exist
-		fprintf(stderr, "%sERROR: The file %s can not be found. Please check the file path%s\n", RED, primerfile, ENDC);
+	primer_seq_t *seqs;
+	int n = read_primer_seqs(primerfile, idx->arena, &seqs, verbose);
+	if (n < 0)
 		return;
-	}
 
-	gzFile fp;
-	kseq_t *seq;
+	int trunc = idx->min_adapter_length;
+	if (trunc > MAXKMER) {
+		fprintf(stderr, "%sTruncated the longest primers from %d to %d%s\n", BLUE, trunc, MAXKMER, ENDC);
+		trunc = MAXKMER;
+	}
 
-	if (verbose)
-		fprintf(stderr, "%sREADING %s%s\n", PINK, primerfile, ENDC);
+	// now we know how many primers there are we can get all the memory for the trees in one go.
+	// Each primer we add fills in an empty node and adds two more empty ones.
+	int strands = idx->reverse ? 2 : 1;
+	size_t nodes = 0;
+	size_t masked = 0;
+	int longest = 0;
+	for (int i=0; i<n; i++) {
+		int kmer = seqs[i].len < idx->maxkmer ? seqs[i].len : idx->maxkmer;
+		nodes += (size_t) strands * (1 + 3 * kmer) * 2;
+		if (trunc > 0)
+			nodes += (size_t) strands * (1 + 3 * trunc) * 2;
+		if (degenerate(seqs[i].seq))
+			masked += (size_t) strands * (2 + 3 * (kmer + (trunc > 0 ? trunc : 0)));
+		if (seqs[i].len > longest)
+			longest = seqs[i].len;
+	}
+	arena_reserve(idx->arena, nodes * sizeof(kmer_bst_t) + masked * sizeof(masked_primer_t));
+	idx->masked_primers = arena_alloc(idx->arena, sizeof(masked_primer_t) * masked);
+	idx->nmasked_primers = 0;
+	idx->names = arena_alloc(idx->arena, sizeof(char *) * n * strands * 2);
+	idx->nnames = 0;
+	if (idx->mismatches > 1)
+		idx->seed_primers = arena_alloc(idx->arena, sizeof(seed_primer_t) * n * strands);
+	idx->nseed_primers = 0;
 
-	fp = gzopen(primerfile, "r");
-	seq = kseq_init(fp);
-	int l;
-	while ((l = kseq_read(seq)) >= 0) {
-		int kmer = seq->seq.l;
-		if (seq->seq.l > maxkmer) {
+	char *rcseq = malloc(longest + 1);
+	for (int i=0; i<n; i++) {
+		char *seq = seqs[i].seq;
+		int kmer = seqs[i].len;
+		if (seqs[i].len > idx->maxkmer) {
 			if (verbose)
-				fprintf(stderr, "%sWARNING: Length of %s is longer than our maximum (%ld bp), so we had to truncate it%s\n", RED, seq->name.s, seq->seq.l, ENDC);
-			kmer = maxkmer;
+				fprintf(stderr, "%sWARNING: Length of %s is longer than our maximum (%d bp), so we had to truncate it%s\n", RED, seqs[i].name, seqs[i].len, ENDC);
+			kmer = idx->maxkmer;
 		}
 
-		create_all_snps(seq->seq.s, kmer, seq->name.s, all_primers[kmer], false);
+		add_primer_and_snps(idx, seq, kmer, add_primer_name(idx, seqs[i].name, ""), kmer);
 		
-		if (reverse) {
-			char revname[seq->name.l+3];
-			strcpy(revname, seq->name.s);
-			strcat(revname, " rc");
+		if (idx->reverse) {
+			uint32_t rcname = add_primer_name(idx, seqs[i].name, " rc");
 			if (verbose)
-				fprintf(stderr, "%sAdded a rc primer: %s %s\n", GREEN, revname, ENDC);
-			
-			char* rcseq = malloc(seq->seq.l + 1);
-			rc(rcseq, seq->seq.s);
-			create_all_snps(rcseq, kmer, revname, all_primers[kmer], false);
-
+				fprintf(stderr, "%sAdded a rc primer: %s %s\n", GREEN, idx->names[rcname], ENDC);
+			rc(rcseq, seq);
+			add_primer_and_snps(idx, rcseq, kmer, rcname, kmer);
 		}
 			
 		if (verbose)
-			fprintf(stderr, "%sEncoding %s with length %ld using k-mer %d%s\n", GREEN, seq->seq.s, seq->seq.l, kmer, ENDC);
-	}
-	int ret = gzclose(fp);
-	if (ret != 0)
-		fprintf(stderr, "Closing the kseq filehandle returned %d\n", ret);
-	kseq_destroy(seq);
-}
-
+			fprintf(stderr, "%sEncoding %s with length %d using k-mer %d%s\n", GREEN, seq, seqs[i].len, kmer, ENDC);
 
-
-char* substring(char* str, int start, int end) {
-    int length = end - start;
-    char* result = malloc((length + 1) * sizeof(char));
-
-    int i, j;
-    for (i = start, j = 0; i < end; i++, j++) {
-        result[j] = str[i];
-    }
-
-    result[j] = '\0'; // Add null terminator to mark the end of the substring
-
-    return result;
-}
-
-
-void read_trunc_primers(char* primerfile, int maxlen, kmer_bst_t* trunc_primers, bool reverse, int verbose) {
-	// read the primers and truncate them to maxlen. Remember if we have that sequence and if not, add it to the kmer_bst
-	if( access( primerfile, R_OK ) == -1 ) {
-		// file doesn't exist
-		fprintf(stderr, "%sERROR: The file %s can not be found. Please check the file path%s\n", RED, primerfile, ENDC);
-		return;
-	}
-
-	gzFile fp;
-	kseq_t *seq;
-
-	if (verbose)
-		fprintf(stderr, "%sREADING %s to truncate to %d%s\n", PINK, primerfile, maxlen, ENDC);
-
-	if (maxlen > MAXKMER)
-		fprintf(stderr, "%sTruncated the longest primers from %d to %d%s\n", BLUE, maxlen, MAXKMER, ENDC);
-
-	fp = gzopen(primerfile, "r");
-	seq = kseq_init(fp);
-	int l;
-	while ((l = kseq_read(seq)) >= 0) {
-		char tname[seq->name.l+6];
-		strcpy(tname, seq->name.s);
-		strcat(tname, " trunc");
-		create_all_snps(substring(seq->seq.s, 0, maxlen), maxlen, tname, trunc_primers, false);
-		if (reverse) {
-			char revname[seq->name.l+8];
-			strcpy(revname, seq->name.s);
-			strcat(revname, " trunc rc");
-			char* rcseq = malloc(seq->seq.l+ 1);
-			rc(rcseq, seq->seq.s);
-			create_all_snps(substring(rcseq, 0, maxlen), maxlen, revname, trunc_primers, false);
+		if (trunc <= 0)
+			continue;
+		if (seqs[i].len < trunc) {
+			if (verbose)
+				fprintf(stderr, "%sWARNING: %s is shorter than %d bp so we can't truncate it%s\n", RED, seqs[i].name, trunc, ENDC);
+			continue;
+		}
+		add_primer_and_snps(idx, seq, trunc, add_primer_name(idx, seqs[i].name, " trunc"), FATI_TRUNC);
+		if (idx->reverse) {
+			rc(rcseq, seq);
+			add_primer_and_snps(idx, rcseq, trunc, add_primer_name(idx, seqs[i].name, " trunc rc"), FATI_TRUNC);
 		}
 		if (verbose)
-			fprintf(stderr, "%sEncoding %s with length %ld using k-mer %d%s\n", GREEN, seq->seq.s, seq->seq.l, maxlen, ENDC);
+			fprintf(stderr, "%sEncoding %s with length %d using k-mer %d%s\n", GREEN, seq, seqs[i].len, trunc, ENDC);
 	}
-
-	int ret = gzclose(fp);
-	if (ret != 0)
-		fprintf(stderr, "Closing the kseq filehandle after reading truncated primers returned %d\n", ret);
-	kseq_destroy(seq);
+	free(rcseq);
+	free(seqs);
 }
-
@@ -33,17 +33,22 @@ uint64_t reverse_complement(uint64_t enc, int len) {
 
 char* rc(char* to, char* from) {
 	/*
-	 * Reverse complement the sequence in from and put it in to
+	 * Reverse complement the sequence in from and put it in to.
+	 * We complement the degenerate (IUPAC) bases too, e.g. R (A/G) becomes Y (C/T), and
+	 * anything else becomes an N.
 	 */
 
-	//            A  B  C  D  E  F  G  H  I  J  K  L  M  N  O  P  Q  R  S  T  U  V  W  X  Y  Z
-	int rc[26] = {3, 3, 2, 3, 3, 3, 1, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 0, 3, 3, 3, 3, 3, 3};
-	char*bases = "ACGT";
+	//                A    B    C    D    E    F    G    H    I    J    K    L    M    N    O    P    Q    R    S    T    U    V    W    X    Y    Z
+	char comp[26] = {'T', 'V', 'G', 'H', 'N', 'N', 'C', 'D', 'N', 'N', 'M', 'N', 'K', 'N', 'N', 'N', 'N', 'Y', 'S', 'A', 'A', 'B', 'W', 'N', 'R', 'N'};
 
-	int i;
-	for (i = 0; i<strlen(from); i++)
-		to[strlen(from)-i-1] = bases[rc[(int) from[i] - (int)'A']];
-	to[i]='\0';
+	int len = strlen(from);
+	for (int i = 0; i<len; i++) {
+		int b = from[i];
+		if (b >= 'a' && b <= 'z')
+			b -= 'a' - 'A';
+		to[len-i-1] = (b >= 'A' && b <= 'Z') ? comp[b - 'A'] : 'N';
+	}
+	to[len]='\0';
 	return to;
 }
 
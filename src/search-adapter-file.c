@@ -4,6 +4,7 @@
  * (c) Rob. 2023
  */
 
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <zlib.h>
@@ -14,39 +15,333 @@
 #include "structs.h"
 #include "search.h"
 #include "colours.h"
+#include "demux.h"
+#include "memory-budget.h"
+#include "primer-index.h"
+#include "progress.h"
+#include "search-read.h"
+#include "shards.h"
+#include "writer.h"
+#include "trace.h"
+#include "trim-list.h"
 #include "version.h"
 
 void help() {
 	printf("USAGE: search-paired-snp -1 -2 --primers -outputR1 --outputR2 --matchesR1 --matchesR2\n");
-	printf("\nSearch for primers listed in %s--primers%s, allowing for 1-bp mismatches, against all the reads in %s--R1%s and %s--R2%s\n", 
+	printf("       search-paired-snp index -f adapters.fa -o adapters.fati (run index --help for more information)\n");
+	printf("       search-paired-snp apply -1 R1.fastq.gz -2 R2.fastq.gz --trim-list trims -p R1.out.fastq.gz -q R2.out.fastq.gz (run apply --help for more information)\n");
+	printf("\nSearch for primers listed in %s--primers%s, allowing for 1-bp mismatches (or --mismatches), against all the reads in %s--R1%s and %s--R2%s\n", 
 			GREEN, ENDC, GREEN, ENDC, GREEN, ENDC);
 	printf("-1 --R1 R%s1%s file (%srequired%s)\n", GREEN, ENDC, RED, ENDC);
 	printf("-2 --R2 R%s2%s file (%srequired%s)\n", GREEN, ENDC, RED, ENDC);
-	printf("-f --primers fasta file of primers (%srequired%s)\n", RED, ENDC);
-	printf("-p --outputR1 R1 output fastq file (will be gzip compressed)\n");
-	printf("-q --outputR2 R2 output fastq file (will be gzip compressed)\n");
+	printf("-f --primers fasta file of primers (%srequired%s unless you use --index-file)\n", RED, ENDC);
+	printf("-p --outputR1 R1 output fastq file (compressed by the extension: .gz, .bgz, .zst, or not at all)\n");
+	printf("-q --outputR2 R2 output fastq file (compressed by the extension: .gz, .bgz, .zst, or not at all)\n");
 	printf("-j --matchesR1 Write the R1 matches to this file. Default: stdout\n");
 	printf("-k --matchesR2 Write the R2 matches to this file. Default: stdout\n");
 	printf("-m --adapterlen Minimum adapter length to match at the 3' end of the sequence. We search for this sequence within the last k bp. Default: 6\n");
 	printf("-t --trimadapters Maximum length to be used for an adapter (default = 31 bp). We can't go longer than 31 bp, but we can do shorter!\n");
 	printf("-l --length Minimum sequence length (bp). Sequences shorter than this will be filtered out (Default 100)\n");
 	printf("--noreverse Do not reverse the sequences\n");
+	printf("--mismatches Number of mismatches (0-%d) allowed between a full length adapter and the read. Default: 1\n", MAXMISMATCHES);
+	printf("--batch-width search this many reads together so that their index lookups overlap (1 searches one read at a time). Default: %d\n", SEARCH_WIDTH);
+	printf("--qual-window also trim the reads where the mean quality of this many bases first drops below --qual-threshold. Default: off\n");
+	printf("--qual-threshold the mean (phred) quality for --qual-window. Default: 20\n");
+	printf("--poly-g also trim poly-G tails (from two colour chemistry) at least this long from the 3' end. Default: off\n");
+	printf("--poly-a also trim poly-A tails at least this long from the 3' end. Default: off\n");
+	printf("--poly-mismatch-every allow one mismatch in every this many bases of a poly-G/A tail. Default: 8\n");
+	printf("--umi-len move this many bases from the start of each R1 read into the read name. Default: off\n");
+	printf("--umi-pattern like --umi-len, but the bases that match N in the pattern are the UMI and the ones that match X are dropped (e.g. NNNNNNXXX)\n");
+	printf("--demux a fasta file of barcodes at the start of R1. We write the reads for each barcode to --demux-out instead of -p/-q\n");
+	printf("--demux-out the directory for the --demux outputs (BARCODE_R1.fastq.gz, BARCODE_R2.fastq.gz, and unassigned)\n");
+	printf("--shards split each output file into this many files (R1.000.fastq.gz, R1.001.fastq.gz, ...), keeping the pairs in the same shard. Default: 1\n");
+	printf("--shard-reads write this many reads in a row to each shard. Default: 1 (round robin)\n");
+	printf("--discarded-out write the reads (and their mates) that are shorter than -l after trimming here, with .R1 and .R2 before the extension\n");
+	printf("--out-format write the outputs as auto (from the extension), raw, gzip, bgzf, or zstd. Default: auto\n");
+	printf("--out-level the compression level. Default: the compressor's default (zstd: 1)\n");
+	printf("--out-threads compress each output with this many threads (pigz, bgzf, and zstd). Default: 2\n");
+	printf("--trim-list write where we trim each read to this file (with .R1 and .R2 before the extension) instead of writing the reads. Trim them later with apply\n");
+	printf("--max-memory use about this much memory (e.g. 4G). In --paired_end mode we spill the R1 reads to a temp file in $TMPDIR above it. Default: no limit\n");
 	printf("--adjustments Write the trimming adjustments here\n");
 	printf("--paired_end use a paired end (slower) search.\n");
+	printf("--external-pairs a paired end search that joins the mates through temp files in $TMPDIR, so R1 and R2 can be in any order and don't need to fit in memory\n");
 	printf("--primeroccurrences minimum number of times a primer was matched to include in the report\n");
 	printf("--nothreads use a single thread only. We typically want upto 4 threads to read and write R1 and R2 files\n");
+	printf("--progress report progress (reads/sec, MB/sec, fraction trimmed) every this many seconds\n");
+	printf("--progress-file write the progress reports to this file as tab separated text. Default: stderr\n");
+	printf("--index-file use a prebuilt index of the primers (see index) instead of --primers\n");
+	printf("--shared-index share one copy of the primer index between all the processes on this computer (POSIX shared memory)\n");
+	printf("--hugepages share the primer index in this directory on a hugetlbfs filesystem (implies --shared-index)\n");
+	printf("--trace write a timeline of each batch of reads in each thread to this file (chrome trace-event JSON)\n");
 	printf("--verbose more output (but less than --debug)\n");
 	printf("--debug more more output\n");
 	printf("-v --version print the version and exit\n");
 }
 
 
+void index_help() {
+	printf("USAGE: search-paired-snp index -f adapters.fa -o adapters.fati\n");
+	printf("\nBuild the index of all the primers and their SNPs once, and write it to a file that the searches can load with --index-file\n");
+	printf("-f --primers fasta file of primers (%srequired%s)\n", RED, ENDC);
+	printf("-o --output index file to write (%srequired%s)\n", RED, ENDC);
+	printf("-m --adapterlen Minimum adapter length to match at the 3' end of the sequence. Default: 6\n");
+	printf("-t --trimadapters Maximum length to be used for an adapter (default = 31 bp)\n");
+	printf("--noreverse Do not reverse the sequences\n");
+	printf("--mismatches Number of mismatches (0-%d) allowed between a full length adapter and the read. Default: 1\n", MAXMISMATCHES);
+	printf("--verbose more output\n");
+}
+
+void apply_help() {
+	printf("USAGE: search-paired-snp apply -1 R1.fastq.gz -2 R2.fastq.gz --trim-list trims -p R1.out.fastq.gz -q R2.out.fastq.gz\n");
+	printf("\nTrim the reads with the trim lists that a search wrote with --trim-list, and write the ones we keep. We trim R1 and R2 at the same time\n");
+	printf("-1 --R1 the R1 file that we searched\n");
+	printf("-2 --R2 the R2 file that we searched\n");
+	printf("--trim-list the --trim-list that we searched with (%srequired%s)\n", RED, ENDC);
+	printf("-p --outputR1 R1 output fastq file (compressed by the extension: .gz, .bgz, .zst, or not at all)\n");
+	printf("-q --outputR2 R2 output fastq file (compressed by the extension: .gz, .bgz, .zst, or not at all)\n");
+	printf("--out-format write the outputs as auto (from the extension), raw, gzip, bgzf, or zstd. Default: auto\n");
+	printf("--out-level the compression level. Default: the compressor's default (zstd: 1)\n");
+	printf("--out-threads compress each output with this many threads (pigz, bgzf, and zstd). Default: 2\n");
+	printf("--verbose more output\n");
+}
+
+/*
+ * Check the number of --mismatches
+ */
+static int parse_mismatches(char *arg) {
+	int mismatches = atoi(arg);
+	if (mismatches < 0 || mismatches > MAXMISMATCHES) {
+		fprintf(stderr, "%sERROR: --mismatches must be between 0 and %d%s\n", RED, MAXMISMATCHES, ENDC);
+		exit(EXIT_FAILURE);
+	}
+	return mismatches;
+}
+
+/*
+ * Check the lengths for the poly-G/A options
+ */
+static int parse_poly(char *arg, char *option) {
+	int n = atoi(arg);
+	if (n < 1) {
+		fprintf(stderr, "%sERROR: %s must be at least 1%s\n", RED, option, ENDC);
+		exit(EXIT_FAILURE);
+	}
+	return n;
+}
+
+/*
+ * Check a --umi-pattern. It is made of N (the UMI) and X (bases we drop)
+ */
+static char *parse_umi_pattern(char *arg) {
+	size_t len = strlen(arg);
+	if (len == 0 || len > MAXUMILEN || strspn(arg, "NX") != len || strchr(arg, 'N') == NULL) {
+		fprintf(stderr, "%sERROR: --umi-pattern must be up to %d Ns and Xs with at least one N, not %s%s\n", RED, MAXUMILEN, arg, ENDC);
+		exit(EXIT_FAILURE);
+	}
+	return strdup(arg);
+}
+
+/*
+ * Check the --out-format, --out-level and --out-threads for the outputs
+ */
+static int parse_out_format(char *arg) {
+	int format = output_format(arg);
+	if (format < 0) {
+		fprintf(stderr, "%sERROR: --out-format must be auto, raw, gzip, bgzf, or zstd%s\n", RED, ENDC);
+		exit(EXIT_FAILURE);
+	}
+	return format;
+}
+
+static int parse_out_level(char *arg) {
+	int level = atoi(arg);
+	if (level < 1 || level > 22) {
+		fprintf(stderr, "%sERROR: --out-level must be between 1 and 9 (or 22 for zstd)%s\n", RED, ENDC);
+		exit(EXIT_FAILURE);
+	}
+	return level;
+}
+
+static int parse_out_threads(char *arg) {
+	int threads = atoi(arg);
+	if (threads < 1 || threads > MAXOUTTHREADS) {
+		fprintf(stderr, "%sERROR: --out-threads must be between 1 and %d%s\n", RED, MAXOUTTHREADS, ENDC);
+		exit(EXIT_FAILURE);
+	}
+	return threads;
+}
+
+/*
+ * fast-adapter-trimming index: build the primer index and save it
+ */
+int index_main(int argc, char* argv[]) {
+	struct options opt = {0};
+	opt.min_adapter_length = 6;
+	opt.maxkmer = MAXKMER;
+	opt.reverse = true;
+	opt.mismatches = 1;
+	char *output = NULL;
+
+	static struct option long_options[] = {
+		{"primers",  required_argument, 0, 'f'},
+		{"output",  required_argument, 0, 'o'},
+		{"adapterlen", required_argument, 0, 'm'},
+		{"trimadapter", required_argument, 0, 't'},
+		{"noreverse", no_argument, 0, 7},
+		{"mismatches", required_argument, 0, 14},
+		{"verbose", no_argument, 0, 'b'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+	int gopt;
+	int option_index = 0;
+	while ((gopt = getopt_long(argc, argv, "f:o:m:t:bh", long_options, &option_index )) != -1) {
+		switch (gopt) {
+			case 'f':
+				opt.primers = strdup(optarg);
+				break;
+			case 'o':
+				output = strdup(optarg);
+				break;
+			case 'm':
+				opt.min_adapter_length = atoi(optarg);
+				break;
+			case 't':
+				opt.maxkmer = atoi(optarg);
+				if (opt.maxkmer > MAXKMER) {
+					fprintf(stderr, "%sERROR: Can't use a kmer longer than %d. Option -t (--trimadapter) adjusted to %d%s\n", RED, MAXKMER, MAXKMER, ENDC);
+					opt.maxkmer = MAXKMER;
+				}
+				break;
+			case 7:
+				opt.reverse = false;
+				break;
+			case 14:
+				opt.mismatches = parse_mismatches(optarg);
+				break;
+			case 'b':
+				opt.verbose = true;
+				break;
+			case 'h':
+				index_help();
+				return 0;
+			default: index_help();
+				 exit(EXIT_FAILURE);
+		}
+	}
+	if (opt.primers == NULL || output == NULL) {
+		fprintf(stderr, "Please provide a primer file and an output file\n");
+		index_help();
+		exit(EXIT_FAILURE);
+	}
+
+	primer_index_t *idx = build_primer_index(&opt);
+	save_primer_index(idx, output);
+	fati_header_t *h = (fati_header_t *) idx->flat;
+	uint64_t primers = 0;
+	uint64_t slots = 0;
+	for (int i=0; i<FATI_TABLES; i++) {
+		fati_slot_t *s = (fati_slot_t *) (idx->flat + h->tables[i].offset);
+		for (uint64_t j=0; j<=h->tables[i].mask; j++)
+			if (s[j].name != FATI_EMPTY)
+				primers += s[j].strand & FATI_PARTNER ? 2 : 1;
+		slots += h->tables[i].count;
+	}
+	fati_group_t *groups = (fati_group_t *) (idx->flat + h->groups_offset);
+	for (uint32_t g=0; g<h->ngroups; g++) {
+		primers += groups[g].table.count;
+		slots += groups[g].table.count;
+	}
+	fprintf(stderr, "%sWrote %" PRIu64 " primers in %" PRIu64 " slots (%zu bytes) to %s%s\n", GREEN, primers, slots, idx->flat_size, output, ENDC);
+	free_primer_index(idx);
+	return 0;
+}
+
+/*
+ * fast-adapter-trimming apply: trim the reads with the --trim-list from a search
+ */
+int apply_main(int argc, char* argv[]) {
+	struct options opt = {0};
+	opt.out_format = FORMAT_AUTO;
+	opt.out_threads = 2;
+	opt.batch_reads = READ_BATCH_SIZE;
+
+	static struct option long_options[] = {
+		{"R1",  required_argument, 0, '1'},
+		{"R2",  required_argument, 0, '2'},
+		{"outputR1",  required_argument, 0, 'p'},
+		{"outputR2",  required_argument, 0, 'q'},
+		{"out-format", required_argument, 0, 28},
+		{"out-level", required_argument, 0, 29},
+		{"out-threads", required_argument, 0, 30},
+		{"trim-list", required_argument, 0, 33},
+		{"verbose", no_argument, 0, 'b'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+	int gopt;
+	int option_index = 0;
+	while ((gopt = getopt_long(argc, argv, "1:2:p:q:bh", long_options, &option_index )) != -1) {
+		switch (gopt) {
+			case '1':
+				opt.R1_file = strdup(optarg);
+				break;
+			case '2':
+				opt.R2_file = strdup(optarg);
+				break;
+			case 'p':
+				opt.R1_output = strdup(optarg);
+				break;
+			case 'q':
+				opt.R2_output = strdup(optarg);
+				break;
+			case 28:
+				opt.out_format = parse_out_format(optarg);
+				break;
+			case 29:
+				opt.out_level = parse_out_level(optarg);
+				break;
+			case 30:
+				opt.out_threads = parse_out_threads(optarg);
+				break;
+			case 33:
+				opt.trim_list = strdup(optarg);
+				break;
+			case 'b':
+				opt.verbose = true;
+				break;
+			case 'h':
+				apply_help();
+				return 0;
+			default: apply_help();
+				 exit(EXIT_FAILURE);
+		}
+	}
+	if (opt.trim_list == NULL || (opt.R1_file == NULL && opt.R2_file == NULL)) {
+		fprintf(stderr, "Please provide the trim list and at least one R1 or R2 read file\n");
+		apply_help();
+		exit(EXIT_FAILURE);
+	}
+	if ((opt.R1_file != NULL) != (opt.R1_output != NULL) || (opt.R2_file != NULL) != (opt.R2_output != NULL)) {
+		fprintf(stderr, "%sERROR: Please give us an output (-p or -q) for each read file (-1 or -2)%s\n", RED, ENDC);
+		exit(EXIT_FAILURE);
+	}
+	apply_trim_lists(&opt);
+	return 0;
+}
+
+
 int main(int argc, char* argv[]) {
 	if (argc < 2) {
 		help();
 		exit(0);
 	}
 
+	if (strcmp(argv[1], "index") == 0)
+		return index_main(argc - 1, argv + 1);
+	if (strcmp(argv[1], "apply") == 0)
+		return apply_main(argc - 1, argv + 1);
+
 	if (argc == 2 && ((strcmp(argv[1], "-v") == 0) || (strcmp(argv[1], "--version") == 0))) {
 		printf("%s version: %f\n", argv[0], __version__);
 		exit(0);
@@ -68,13 +363,46 @@ int main(int argc, char* argv[]) {
 	opt->maxkmer = 31;
 	opt->primer_occurrences = 50;
 	opt->reverse = true;
+	opt->mismatches = 1;
+	opt->last_trunc = false;
+	opt->batch_width = SEARCH_WIDTH;
+	opt->qual_window = 0;
+	opt->qual_threshold = 20;
+	opt->poly_g = 0;
+	opt->poly_a = 0;
+	opt->poly_every = 8;
+	opt->umi_pattern = NULL;
 	opt->primers = NULL;
 	opt->debug = false;
 	opt->verbose = false;
 	opt->adjustments = NULL;
+	opt->progress = NULL;
+	opt->trace = NULL;
+	opt->index = NULL;
+	opt->kernels = NULL;
+	opt->demux = NULL;
+	opt->shards = 1;
+	opt->shard_reads = 1;
+	opt->discarded = NULL;
+	opt->out_format = FORMAT_AUTO;
+	opt->out_level = 0;
+	opt->out_threads = 2;
+	opt->max_memory = 0;
+	opt->batch_reads = READ_BATCH_SIZE;
+	opt->pair_memory = 0;
+	opt->trim_list = NULL;
 
 	bool nothreads = false;
 	bool paired_end = false;
+	bool external_pairs = false;
+	int progress_interval = 0;
+	char *progress_file = NULL;
+	char *trace_file = NULL;
+	char *index_file = NULL;
+	bool shared_index = false;
+	char *hugepage_dir = NULL;
+	char *demux_file = NULL;
+	char *demux_dir = NULL;
 
 	int gopt = 0;
 	static struct option long_options[] = {
@@ -93,6 +421,32 @@ int main(int argc, char* argv[]) {
 		{"nothreads", no_argument, 0, 5},
 		{"adjustments", required_argument, 0, 6},
 		{"noreverse", required_argument, 0, 7},
+		{"progress", required_argument, 0, 8},
+		{"progress-file", required_argument, 0, 9},
+		{"trace", required_argument, 0, 10},
+		{"index-file", required_argument, 0, 11},
+		{"shared-index", no_argument, 0, 12},
+		{"hugepages", required_argument, 0, 13},
+		{"mismatches", required_argument, 0, 14},
+		{"batch-width", required_argument, 0, 15},
+		{"qual-window", required_argument, 0, 16},
+		{"qual-threshold", required_argument, 0, 17},
+		{"poly-g", required_argument, 0, 18},
+		{"poly-a", required_argument, 0, 19},
+		{"poly-mismatch-every", required_argument, 0, 20},
+		{"umi-len", required_argument, 0, 21},
+		{"umi-pattern", required_argument, 0, 22},
+		{"demux", required_argument, 0, 23},
+		{"demux-out", required_argument, 0, 24},
+		{"shards", required_argument, 0, 25},
+		{"shard-reads", required_argument, 0, 26},
+		{"discarded-out", required_argument, 0, 27},
+		{"out-format", required_argument, 0, 28},
+		{"out-level", required_argument, 0, 29},
+		{"out-threads", required_argument, 0, 30},
+		{"max-memory", required_argument, 0, 31},
+		{"external-pairs", no_argument, 0, 32},
+		{"trim-list", required_argument, 0, 33},
 		{"debug", no_argument, 0, 'd'},
 		{"version", no_argument, 0, 'v'},
 		{"verbose", no_argument, 0, 'b'},
@@ -159,6 +513,117 @@ int main(int argc, char* argv[]) {
 			case 7:
 				opt->reverse = false;
 				break;
+			case 8:
+				progress_interval = atoi(optarg);
+				break;
+			case 9:
+				progress_file = strdup(optarg);
+				break;
+			case 10:
+				trace_file = strdup(optarg);
+				break;
+			case 11:
+				index_file = strdup(optarg);
+				break;
+			case 12:
+				shared_index = true;
+				break;
+			case 13:
+				hugepage_dir = strdup(optarg);
+				shared_index = true;
+				break;
+			case 14:
+				opt->mismatches = parse_mismatches(optarg);
+				break;
+			case 15:
+				opt->batch_width = atoi(optarg);
+				if (opt->batch_width < 1 || opt->batch_width > READ_BATCH_SIZE) {
+					fprintf(stderr, "%sERROR: --batch-width must be between 1 and %d%s\n", RED, READ_BATCH_SIZE, ENDC);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 16:
+				opt->qual_window = atoi(optarg);
+				if (opt->qual_window < 1 || opt->qual_window > MAXQUALWINDOW) {
+					fprintf(stderr, "%sERROR: --qual-window must be between 1 and %d%s\n", RED, MAXQUALWINDOW, ENDC);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 17:
+				opt->qual_threshold = atoi(optarg);
+				if (opt->qual_threshold < 0 || opt->qual_threshold > 93) {
+					fprintf(stderr, "%sERROR: --qual-threshold must be between 0 and 93%s\n", RED, ENDC);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 18:
+				opt->poly_g = parse_poly(optarg, "--poly-g");
+				break;
+			case 19:
+				opt->poly_a = parse_poly(optarg, "--poly-a");
+				break;
+			case 20:
+				opt->poly_every = parse_poly(optarg, "--poly-mismatch-every");
+				break;
+			case 21: {
+				int n = atoi(optarg);
+				if (n < 1 || n > MAXUMILEN) {
+					fprintf(stderr, "%sERROR: --umi-len must be between 1 and %d%s\n", RED, MAXUMILEN, ENDC);
+					exit(EXIT_FAILURE);
+				}
+				opt->umi_pattern = malloc(n + 1);
+				memset(opt->umi_pattern, 'N', n);
+				opt->umi_pattern[n] = '\0';
+				break;
+			}
+			case 22:
+				opt->umi_pattern = parse_umi_pattern(optarg);
+				break;
+			case 23:
+				demux_file = strdup(optarg);
+				break;
+			case 24:
+				demux_dir = strdup(optarg);
+				break;
+			case 25:
+				opt->shards = atoi(optarg);
+				if (opt->shards < 1 || opt->shards > MAXSHARDS) {
+					fprintf(stderr, "%sERROR: --shards must be between 1 and %d%s\n", RED, MAXSHARDS, ENDC);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 26:
+				opt->shard_reads = atoi(optarg);
+				if (opt->shard_reads < 1) {
+					fprintf(stderr, "%sERROR: --shard-reads must be at least 1%s\n", RED, ENDC);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 27:
+				opt->discarded = strdup(optarg);
+				break;
+			case 28:
+				opt->out_format = parse_out_format(optarg);
+				break;
+			case 29:
+				opt->out_level = parse_out_level(optarg);
+				break;
+			case 30:
+				opt->out_threads = parse_out_threads(optarg);
+				break;
+			case 31:
+				opt->max_memory = parse_memory(optarg);
+				if (opt->max_memory == 0) {
+					fprintf(stderr, "%sERROR: --max-memory must be a size like 4G or 500M%s\n", RED, ENDC);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 32:
+				external_pairs = true;
+				break;
+			case 33:
+				opt->trim_list = strdup(optarg);
+				break;
 			default: help();
 				 exit(EXIT_FAILURE);
 		}
@@ -170,25 +635,104 @@ int main(int argc, char* argv[]) {
 		exit(EXIT_FAILURE);
 	}
 
-	if (opt->primers == NULL) {
+	if (opt->primers == NULL && index_file == NULL) {
 		fprintf(stderr, "Please provide a primer file\n");
 		help();
 		exit(EXIT_FAILURE);
 	}
 
 
-	if (nothreads)
+	if ((demux_file == NULL) != (demux_dir == NULL)) {
+		fprintf(stderr, "%sERROR: --demux and --demux-out go together%s\n", RED, ENDC);
+		exit(EXIT_FAILURE);
+	}
+	if (external_pairs) {
+		// it is a paired end search, and --nothreads makes no difference to it
+		paired_end = true;
+		nothreads = false;
+	}
+	if (demux_file && opt->shards > 1) {
+		fprintf(stderr, "%sWARNING: We write one file per barcode with --demux, so we ignore --shards%s\n", BLUE, ENDC);
+		opt->shards = 1;
+	}
+	if (demux_file && opt->R1_file == NULL) {
+		fprintf(stderr, "%sERROR: --demux needs the barcodes in R1%s\n", RED, ENDC);
+		exit(EXIT_FAILURE);
+	}
+	if (opt->trim_list) {
+		// apply only cuts the 3' end of the reads in the original files
+		if (demux_file || opt->umi_pattern) {
+			fprintf(stderr, "%sERROR: apply can't move the barcodes or UMIs, so please don't use --trim-list with --demux or --umi-len/--umi-pattern%s\n", RED, ENDC);
+			exit(EXIT_FAILURE);
+		}
+		if (opt->R1_output || opt->R2_output) {
+			fprintf(stderr, "%sERROR: --trim-list writes the trims instead of the reads. Please use apply to write -p and -q%s\n", RED, ENDC);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (progress_file && progress_interval <= 0) {
+		fprintf(stderr, "%sWARNING: --progress-file needs --progress SECONDS. We will report every 60 seconds%s\n", BLUE, ENDC);
+		progress_interval = 60;
+	}
+	opt->progress = progress_start(progress_interval, progress_file);
+	opt->trace = trace_open(trace_file);
+
+	// build the primer index once, or load one that we prebuilt. All the searches share it
+	if (index_file) {
+		opt->index = load_primer_index(index_file);
+		if (opt->index->maxkmer != opt->maxkmer || opt->index->min_adapter_length != opt->min_adapter_length
+				|| opt->index->reverse != opt->reverse || opt->index->mismatches != opt->mismatches)
+			fprintf(stderr, "%sWARNING: %s was built with -t %d -m %d --mismatches %d%s, so we use those%s\n", BLUE, index_file,
+					opt->index->maxkmer, opt->index->min_adapter_length, opt->index->mismatches, opt->index->reverse ? "" : " --noreverse", ENDC);
+		opt->maxkmer = opt->index->maxkmer;
+		opt->min_adapter_length = opt->index->min_adapter_length;
+		opt->reverse = opt->index->reverse;
+		opt->mismatches = opt->index->mismatches;
+	} else if (shared_index) {
+		opt->index = shared_primer_index(opt, hugepage_dir);
+	} else {
+		opt->index = build_primer_index(opt);
+	}
+	select_search_kernels(opt->index, opt);
+	if (demux_file)
+		opt->demux = demux_open(demux_file, demux_dir, opt->R2_file != NULL, opt);
+	// the paired end searches have always cut the tail at the last short primer, and that finds more of the adapters
+	opt->last_trunc = paired_end && !nothreads;
+	// now we know how big the index is, share out the rest of --max-memory
+	memory_plan(opt, paired_end && !nothreads);
+
+	if (external_pairs)
+		external_pair_search(opt);
+	else if (nothreads)
 		fast_search(opt);
 	else if (paired_end)
 		paired_end_search(opt);
 	else {
 		pthread_t threads[2];
 		thread_args_t *thread0_args;
-		thread0_args = malloc(sizeof(thread_args_t));
+		thread0_args = calloc(1, sizeof(thread_args_t));
 		thread0_args->opt = opt;
+		thread0_args->stream = PROGRESS_R1;
 		thread_args_t *thread1_args;
-		thread1_args = malloc(sizeof(thread_args_t));
+		thread1_args = calloc(1, sizeof(thread_args_t));
 		thread1_args->opt = opt;
+		thread1_args->stream = PROGRESS_R2;
+		if (opt->discarded) {
+			thread0_args->discarded_file = output_name(opt->discarded, "R1");
+			thread1_args->discarded_file = output_name(opt->discarded, "R2");
+		}
+		if (opt->trim_list) {
+			thread0_args->trim_list_file = output_name(opt->trim_list, "R1");
+			thread1_args->trim_list_file = output_name(opt->trim_list, "R2");
+		}
+		// the two threads swap which reads are long enough, so we write both reads of a pair or neither
+		pair_sync_t *sync = NULL;
+		if (opt->R1_file && opt->R2_file) {
+			sync = pair_sync_init();
+			thread0_args->sync = sync;
+			thread1_args->sync = sync;
+		}
 		// process R1
 		if (opt->R1_file) {
 			thread0_args->fqfile = strdup(opt->R1_file);
@@ -221,9 +765,20 @@ int main(int argc, char* argv[]) {
 			if (result_code)
 				fprintf(stderr, "%sERROR: Joining thread 1 for it to finish returned the error code %d%s\n", RED, result_code, ENDC);
 		}
+		if (sync)
+			pair_sync_destroy(sync);
+		free(thread0_args->discarded_file);
+		free(thread1_args->discarded_file);
+		free(thread0_args->trim_list_file);
+		free(thread1_args->trim_list_file);
 		free(thread0_args);
 		free(thread1_args);
 	}
+	if (opt->demux)
+		demux_close(opt->demux);
+	progress_stop(opt->progress);
+	trace_close(opt->trace);
+	free_primer_index(opt->index);
 
 	free(opt);
 }
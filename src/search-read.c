@@ -0,0 +1,720 @@
+/*
+ * Search a single read for the adapters. All of our search modes use this so that
+ * they trim in the same way.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "colours.h"
+#include "definitions.h"
+#include "primer-index.h"
+#include "primers.h"
+#include "search-read.h"
+#include "seqs_to_ints.h"
+#include "structs.h"
+
+static inline char complement_base(char c) {
+	switch (c) {
+		case 'A': case 'a': return 'T';
+		case 'C': case 'c': return 'G';
+		case 'G': case 'g': return 'C';
+		case 'T': case 't': return 'A';
+	}
+	return 'N';
+}
+
+/*
+ * The primer in a slot of length k. If we matched its partner, that is the next name and the
+ * SNP is at the other end of it.
+ */
+static inline void set_hit_name(primer_index_t *idx, const fati_slot_t *slot, bool partner, int k, search_hit_t *hit) {
+	hit->id = primer_slot_name(idx, slot, partner);
+	hit->snp_posn = slot->snp_posn;
+	hit->snp_from = slot->snp_from;
+	hit->snp_to = slot->snp_to;
+	if (partner && slot->snp_posn >= 0) {
+		hit->snp_posn = k - 1 - slot->snp_posn;
+		hit->snp_from = complement_base(slot->snp_from);
+		hit->snp_to = complement_base(slot->snp_to);
+	}
+	hit->mismatches = slot->snp_posn < 0 ? 0 : 1;
+}
+
+/*
+ * A primer we found with the seeds. If there is only one mismatch we name it like a SNP.
+ */
+static inline void set_seed_hit_name(primer_index_t *idx, const fati_primer_t *primer, uint64_t enc, int mismatches, search_hit_t *hit) {
+	hit->id = idx->flat + ((const fati_header_t *) idx->flat)->names_offset + primer->name;
+	hit->snp_posn = -1;
+	hit->mismatches = mismatches;
+	if (mismatches == 1) {
+		uint64_t x = primer->value ^ enc;
+		int bit = __builtin_ctzll(x) & ~1;
+		hit->snp_posn = primer->k - 1 - bit / 2;
+		hit->snp_from = "ACGT"[(primer->value >> bit) & 3];
+		hit->snp_to = "ACGT"[(enc >> bit) & 3];
+	}
+}
+
+char *hit_name(search_hit_t *hit, char *buf, size_t len) {
+	if (hit->mismatches > 1) {
+		snprintf(buf, len, "%s %d mismatches", hit->id, hit->mismatches);
+		return buf;
+	}
+	return format_primer_name(hit->id, hit->snp_posn, hit->snp_from, hit->snp_to, buf, len);
+}
+
+/*
+ * Where is the next ambiguous base at or after from (len if there isn't one)
+ */
+static inline int next_ambiguous(uint8_t *codes, int len, int from) {
+	while (from < len && codes[from] != AMBIGUOUS_BASE)
+		from++;
+	return from;
+}
+
+/*
+ * Is the window of length k at posn a primer (or one of its SNPs, or within the mismatches of it)?
+ * If so we fill in the hit.
+ */
+static inline bool window_hit(primer_index_t *idx, struct options *opt, char *seq, int posn, int k, uint64_t enc, uint64_t rcenc, search_hit_t *hit) {
+	bool partner;
+	const fati_slot_t *slot = primer_lookup(idx, k, enc, rcenc, &partner);
+	const fati_primer_t *primer = NULL;
+	int mismatches;
+	// if it isn't a primer or one of its SNPs, it may be further away
+	if (slot == NULL && seeded_length(k, idx->mismatches))
+		primer = seed_lookup(idx, k, enc, &mismatches);
+	if (slot == NULL && primer == NULL)
+		return false;
+	if (slot)
+		set_hit_name(idx, slot, partner, k, hit);
+	else
+		set_seed_hit_name(idx, primer, enc, mismatches, hit);
+	hit->trim = posn;
+	hit->kmer = k;
+	hit->before = posn ? seq[posn-1] : '^';
+	// the base after the adapter, or $ if it runs to the end of the read
+	hit->after = seq[posn + k] ? seq[posn + k] : '$';
+	if (opt->debug) {
+		char name[MAXNAMELEN];
+		fprintf(stderr, "ID: %s TRIM: %d kmer len: %d kmer seq: %s\n", hit_name(hit, name, MAXNAMELEN), posn, k, kmer_decoding(enc, k));
+	}
+	return true;
+}
+
+/*
+ * Where the search for the short primers starts, or -1 if we don't look for them in a read of
+ * length len. We start a little bit before opt->maxkmer in case there are any frameshifts, and
+ * the first window is at start + 1.
+ */
+static inline int trunc_start(struct options *opt, int len) {
+	if (opt->min_adapter_length <= 0)
+		return -1;
+	int start = len - opt->maxkmer - 5;
+	if (start < 0)
+		start = 0;
+	if (len - start < opt->min_adapter_length)
+		return -1;
+	return start;
+}
+
+static inline void trunc_hit(primer_index_t *idx, struct options *opt, char *seq, int posn, int m, const fati_slot_t *slot, bool partner, uint64_t enc, search_hit_t *hit) {
+	set_hit_name(idx, slot, partner, m, hit);
+	hit->trim = posn;
+	hit->kmer = m;
+	hit->before = seq[posn-1];
+	hit->after = seq[posn + m] ? seq[posn + m] : '$';
+	hit->truncated = true;
+	if (opt->debug) {
+		char name[MAXNAMELEN];
+		fprintf(stderr, "TRUNC: ID: %s TRIM: %d kmer len: %d kmer seq: %s\n", hit_name(hit, name, MAXNAMELEN), posn, m, kmer_decoding(enc, m));
+	}
+}
+
+/*
+ * If we didn't find a full length primer, we look for the short primers in the last few bases,
+ * and remove from the first one we find (or the last one, with opt->last_trunc)
+ */
+static void search_trunc(primer_index_t *idx, struct options *opt, char *seq, uint8_t *codes, int len, search_hit_t *hit) {
+	int start = trunc_start(opt, len);
+	if (start < 0)
+		return;
+	int m = opt->min_adapter_length;
+	uint64_t kmask = m < 32 ? (1ULL << (2 * m)) - 1 : UINT64_MAX;
+	bool direct = ((const fati_header_t *) idx->flat)->direct_k == m;
+	// last_n is the last ambiguous base we have added
+	uint64_t enc = 0;
+	uint64_t rcenc = 0;
+	int last_n = -1;
+	for (int j=start+1; j<start+m && j<len; j++) {
+		enc = (enc << 2) | (codes[j] & 3);
+		rcenc = (rcenc >> 2) | ((uint64_t) (3 - (codes[j] & 3)) << (2 * (m - 1)));
+		if (codes[j] == AMBIGUOUS_BASE)
+			last_n = j;
+	}
+	for (int posn = start + 1; posn < len - m; posn++) {
+		uint8_t code = codes[posn + m - 1] & 3;
+		enc = ((enc << 2) | code) & kmask;
+		rcenc = (rcenc >> 2) | ((uint64_t) (3 - code) << (2 * (m - 1)));
+		if (codes[posn + m - 1] == AMBIGUOUS_BASE)
+			last_n = posn + m - 1;
+		if (last_n >= posn)
+			continue;
+		bool partner;
+		const fati_slot_t *slot = direct ? direct_lookup(idx, enc, &partner) : primer_lookup(idx, FATI_TRUNC, enc, rcenc, &partner);
+		if (slot) {
+			trunc_hit(idx, opt, seq, posn, m, slot, partner, enc, hit);
+			if (!opt->last_trunc)
+				return;
+		}
+	}
+}
+
+/*
+ * The main scan: slide along the sequence and at every position test all the kmer lengths,
+ * longest first. The first match is the most 5' adapter so we can stop there.
+ * Note that we only slide as far as the longest primer fits.
+ * We roll one encoding of the longest primer length along the read, and the window
+ * of length k at posn is the top 2k bits of it. We roll its reverse complement too, and
+ * the reverse complement of the window of length k is the bottom 2k bits of that.
+ * Windows with an N are skipped.
+ *
+ * This is always inlined, so that the kernels below, which call it with a constant read length,
+ * longest primer, and maxkmer (and single if the longest primers are the only ones), get their
+ * own copy with the shifts, masks and loop bounds worked out when we compile it.
+ */
+static inline __attribute__((always_inline)) bool main_scan(primer_index_t *idx, struct options *opt, char *seq, uint8_t *codes, int len, search_hit_t *hit, int longest, int maxkmer, bool single) {
+	if (len < maxkmer || idx->unique_kmer_count == 0)
+		return false;
+	uint64_t window = 0;
+	uint64_t rcwindow = 0;
+	for (int j=0; j<longest-1; j++) {
+		window = (window << 2) | (codes[j] & 3);
+		rcwindow = (rcwindow >> 2) | ((uint64_t) (3 - (codes[j] & 3)) << (2 * (longest - 1)));
+	}
+	int nk = single ? 1 : idx->unique_kmer_count;
+	int next_n = hit->ambiguous ? next_ambiguous(codes, len, 0) : len;
+	for (int posn=0; posn<=len - maxkmer; posn++) {
+		uint8_t code = codes[posn + longest - 1] & 3;
+		window = (window << 2) | code;
+		rcwindow = (rcwindow >> 2) | ((uint64_t) (3 - code) << (2 * (longest - 1)));
+		if (next_n < posn)
+			next_n = next_ambiguous(codes, len, posn);
+		for (int i=0; i<nk; i++) {
+			int k = single ? longest : idx->kmer_lengths[i];
+			if (next_n < posn + k)
+				continue;
+			uint64_t kmask = (1ULL << (2 * k)) - 1;
+			if (window_hit(idx, opt, seq, posn, k, (window >> (2 * (longest - k))) & kmask, rcwindow & kmask, hit))
+				return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * The main scans that we specialize, for the usual -t lengths (which is the longest primer when
+ * there are primers that long) and read lengths. Each one comes in two flavours: for indexes that
+ * only have primers of the longest length (single), and for indexes with any lengths.
+ */
+#define KERNEL_READ_LENGTHS(X, K) X(K, 100) X(K, 150) X(K, 151) X(K, 250)
+#define KERNEL_ADAPTER_LENGTHS(X) KERNEL_READ_LENGTHS(X, 31) KERNEL_READ_LENGTHS(X, 21) KERNEL_READ_LENGTHS(X, 18)
+#define KERNEL_NREADLENGTHS 4
+
+typedef bool (*main_scan_t)(primer_index_t *, struct options *, char *, uint8_t *, search_hit_t *);
+
+typedef struct search_kernel {
+	int k;
+	int len;
+	bool single;
+	main_scan_t scan;
+} search_kernel_t;
+
+#define DEFINE_KERNELS(K, LEN) \
+	static bool scan_##K##_##LEN(primer_index_t *idx, struct options *opt, char *seq, uint8_t *codes, search_hit_t *hit) { \
+		return main_scan(idx, opt, seq, codes, LEN, hit, K, K, false); \
+	} \
+	static bool scan_single_##K##_##LEN(primer_index_t *idx, struct options *opt, char *seq, uint8_t *codes, search_hit_t *hit) { \
+		return main_scan(idx, opt, seq, codes, LEN, hit, K, K, true); \
+	}
+KERNEL_ADAPTER_LENGTHS(DEFINE_KERNELS)
+
+// the kernels for each k (and single) are next to each other, so we can point at the first one
+#define KERNEL_ENTRY(K, LEN) {K, LEN, false, scan_##K##_##LEN},
+#define SINGLE_KERNEL_ENTRY(K, LEN) {K, LEN, true, scan_single_##K##_##LEN},
+static const search_kernel_t kernels[] = {
+	KERNEL_ADAPTER_LENGTHS(KERNEL_ENTRY)
+	KERNEL_ADAPTER_LENGTHS(SINGLE_KERNEL_ENTRY)
+};
+
+void select_search_kernels(primer_index_t *idx, struct options *opt) {
+	opt->kernels = NULL;
+	if (idx->unique_kmer_count == 0 || idx->kmer_lengths[0] != opt->maxkmer)
+		return;
+	bool single = idx->unique_kmer_count == 1;
+	for (int i=0; i<sizeof(kernels) / sizeof(kernels[0]); i += KERNEL_NREADLENGTHS)
+		if (kernels[i].k == opt->maxkmer && kernels[i].single == single) {
+			opt->kernels = &kernels[i];
+			break;
+		}
+	if (opt->verbose)
+		fprintf(stderr, "%sUsing the %s search kernels%s\n", GREEN, opt->kernels ? "specialized" : "generic", ENDC);
+}
+
+static void search_codes(primer_index_t *idx, struct options *opt, char *seq, uint8_t *codes, int len, search_hit_t *hit, bool trunc) {
+	bool found = false;
+	const search_kernel_t *kernel = NULL;
+	for (int i=0; opt->kernels && i<KERNEL_NREADLENGTHS; i++)
+		if (opt->kernels[i].len == len)
+			kernel = &opt->kernels[i];
+	if (kernel)
+		found = kernel->scan(idx, opt, seq, codes, hit);
+	else if (idx->unique_kmer_count > 0)
+		found = main_scan(idx, opt, seq, codes, len, hit, idx->kmer_lengths[0], opt->maxkmer, false);
+	if (!found && trunc)
+		search_trunc(idx, opt, seq, codes, len, hit);
+}
+
+static inline void clear_hit(search_hit_t *hit) {
+	hit->trim = -1;
+	hit->id = NULL;
+	hit->snp_posn = -1;
+	hit->mismatches = 0;
+	hit->kmer = 0;
+	hit->before = '^';
+	hit->after = '^';
+	hit->truncated = false;
+	hit->qual_trim = -1;
+	hit->poly_trim = -1;
+}
+
+/*
+ * Search one read. If trunc is false we leave the short primers for later.
+ */
+static void search_one(primer_index_t *idx, struct options *opt, char *seq, int len, search_hit_t *hit, bool trunc) {
+	clear_hit(hit);
+
+	// Encode the whole read once, and count the Ns while we do it
+	uint8_t stack_codes[READ_CODES];
+	uint8_t *codes = len <= READ_CODES ? stack_codes : malloc(len);
+	if (codes == NULL) {
+		fprintf(stderr, "%sERROR: Can't malloc memory to encode a read of %d bp%s\n", RED, len, ENDC);
+		exit(1);
+	}
+	hit->ambiguous = encode_read(seq, len, codes);
+	search_codes(idx, opt, seq, codes, len, hit, trunc);
+	if (codes != stack_codes)
+		free(codes);
+}
+
+void search_read(primer_index_t *idx, struct options *opt, char *seq, int len, search_hit_t *hit) {
+	search_one(idx, opt, seq, len, hit, true);
+}
+
+/*
+ * Just look for the short primers in a read that we have already searched
+ */
+static void search_trunc_read(primer_index_t *idx, struct options *opt, char *seq, int len, search_hit_t *hit) {
+	uint8_t stack_codes[READ_CODES];
+	uint8_t *codes = len <= READ_CODES ? stack_codes : malloc(len);
+	if (codes == NULL) {
+		fprintf(stderr, "%sERROR: Can't malloc memory to encode a read of %d bp%s\n", RED, len, ENDC);
+		exit(1);
+	}
+	encode_read(seq, len, codes);
+	search_trunc(idx, opt, seq, codes, len, hit);
+	if (codes != stack_codes)
+		free(codes);
+}
+
+int quality_trim(char *qual, int len, int window, int threshold) {
+	if (window <= 0 || len < window)
+		return -1;
+	// a window is bad if the sum of its (phred+33) qualities is less than this
+	int limit = (threshold + 33) * window;
+	int nwindows = len - window + 1;
+	int i = 0;
+#ifdef __SSE2__
+	// the sums of the 16 windows that start at i to i+15 are the sums of window loads of 16 qualities,
+	// each one base further along. The last one ends at the last base so we don't read past the read.
+	if (window <= MAXQUALWINDOW) {
+		__m128i zero = _mm_setzero_si128();
+		__m128i bad_sum = _mm_set1_epi16(limit);
+		for (; i + 16 <= nwindows; i += 16) {
+			__m128i lo = zero;
+			__m128i hi = zero;
+			for (int j=0; j<window; j++) {
+				__m128i q = _mm_loadu_si128((__m128i *) (qual + i + j));
+				lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(q, zero));
+				hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(q, zero));
+			}
+			int bad = _mm_movemask_epi8(_mm_packs_epi16(_mm_cmplt_epi16(lo, bad_sum), _mm_cmplt_epi16(hi, bad_sum)));
+			if (bad)
+				return i + __builtin_ctz(bad);
+		}
+	}
+#endif
+	// and a running sum for the rest
+	int sum = 0;
+	for (int j=0; j<window; j++)
+		sum += (unsigned char) qual[i + j];
+	for (; i<nwindows; i++) {
+		if (sum < limit)
+			return i;
+		if (i + window < len)
+			sum += (unsigned char) qual[i + window] - (unsigned char) qual[i];
+	}
+	return -1;
+}
+
+int poly_tail(char *seq, int len, char base, int every) {
+	int mismatches = 0;
+	int tail = 0;
+	int seen = 0; // how many bases we have looked at from the 3' end
+	int end = len;
+#ifdef __SSE2__
+	// compare 16 bases at a time, and only look at them one at a time if they aren't all base
+	__m128i b = _mm_set1_epi8(base);
+	for (; end >= 16; end -= 16) {
+		int match = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *) (seq + end - 16)), b));
+		if (match == 0xFFFF) {
+			seen += 16;
+			tail = seen;
+			continue;
+		}
+		for (int j=15; j>=0; j--) {
+			seen++;
+			if (match & (1 << j))
+				tail = seen;
+			else if (++mismatches > seen / every)
+				return tail;
+		}
+	}
+#endif
+	for (; end > 0; end--) {
+		seen++;
+		if (seq[end - 1] == base)
+			tail = seen;
+		else if (++mismatches > seen / every)
+			return tail;
+	}
+	return tail;
+}
+
+/*
+ * Where we trim the 3' end of the read apart from the adapter
+ */
+static inline void end_hits(struct options *opt, fastq_record_t *read, search_hit_t *hit) {
+	if (opt->qual_window > 0)
+		hit->qual_trim = quality_trim(read->qual.s, read->qual.l, opt->qual_window, opt->qual_threshold);
+	int tail = 0;
+	if (opt->poly_g > 0) {
+		int g = poly_tail(read->seq.s, read->seq.l, 'G', opt->poly_every);
+		if (g >= opt->poly_g)
+			tail = g;
+	}
+	if (opt->poly_a > 0) {
+		int a = poly_tail(read->seq.s, read->seq.l, 'A', opt->poly_every);
+		if (a >= opt->poly_a && a > tail)
+			tail = a;
+	}
+	if (tail)
+		hit->poly_trim = read->seq.l - tail;
+}
+
+/*
+ * One read in a group that search_batch is searching together. We roll the windows of each
+ * read along it just like search_codes does, and keep the windows at the current position.
+ */
+typedef struct lane {
+	char *seq;
+	uint8_t *codes;
+	int len;
+	int npos;      // how many positions the main scan looks at
+	int posn;      // where the windows in enc and rcenc are
+	int next_n;
+	uint64_t window;
+	uint64_t rcwindow;
+	uint64_t enc[MAXKMER+1]; // for each kmer length, longest first
+	uint64_t rcenc[MAXKMER+1];
+	bool skip[MAXKMER+1];    // the window has an N in it
+	search_hit_t *hit;
+} lane_t;
+
+/*
+ * Add the next base to the windows of a lane, and prefetch where we will look them up
+ */
+static inline void lane_advance(primer_index_t *idx, lane_t *l) {
+	int longest = idx->kmer_lengths[0];
+	uint8_t code = l->codes[l->posn + longest - 1] & 3;
+	l->window = (l->window << 2) | code;
+	l->rcwindow = (l->rcwindow >> 2) | ((uint64_t) (3 - code) << (2 * (longest - 1)));
+	if (l->next_n < l->posn)
+		l->next_n = next_ambiguous(l->codes, l->len, l->posn);
+	for (int i=0; i<idx->unique_kmer_count; i++) {
+		int k = idx->kmer_lengths[i];
+		l->skip[i] = l->next_n < l->posn + k;
+		if (l->skip[i])
+			continue;
+		uint64_t kmask = (1ULL << (2 * k)) - 1;
+		l->enc[i] = (l->window >> (2 * (longest - k))) & kmask;
+		l->rcenc[i] = l->rcwindow & kmask;
+		primer_prefetch(idx, k, l->enc[i], l->rcenc[i]);
+	}
+}
+
+/*
+ * The scratch space for search_batch
+ */
+typedef struct batch_scratch {
+	lane_t *lanes;
+	uint8_t *codes;
+	size_t ncodes;
+} batch_scratch_t;
+
+/*
+ * Search reads first to first+width-1 of the batch together. We step all of them along one
+ * position at a time: we look up the windows of each read at this position (which we prefetched
+ * when we got there) and then move it on and prefetch its next windows. By the time we come
+ * back to a read, its cache lines have had the whole group's lookups to arrive in.
+ * This finds exactly the same hits as search_read, because each read still stops at its first one.
+ */
+static void search_group(primer_index_t *idx, struct options *opt, read_batch_t *batch, int first, int width, batch_scratch_t *scratch, bool trunc) {
+	size_t ncodes = 0;
+	for (int r=first; r<first+width; r++)
+		ncodes += batch->reads[r].seq.l;
+	if (ncodes > scratch->ncodes) {
+		scratch->codes = realloc(scratch->codes, ncodes);
+		if (scratch->codes == NULL) {
+			fprintf(stderr, "%sERROR: Can't malloc memory to encode a batch of reads%s\n", RED, ENDC);
+			exit(1);
+		}
+		scratch->ncodes = ncodes;
+	}
+
+	// encode all the reads and get each one to its first window
+	lane_t *lanes = scratch->lanes;
+	int longest = idx->unique_kmer_count > 0 ? idx->kmer_lengths[0] : 0;
+	int active = 0;
+	ncodes = 0;
+	for (int i=0; i<width; i++) {
+		lane_t *l = &lanes[i];
+		l->seq = batch->reads[first + i].seq.s;
+		l->len = batch->reads[first + i].seq.l;
+		l->codes = scratch->codes + ncodes;
+		l->hit = &batch->hits[first + i];
+		ncodes += l->len;
+		clear_hit(l->hit);
+		end_hits(opt, &batch->reads[first + i], l->hit);
+		l->hit->ambiguous = encode_read(l->seq, l->len, l->codes);
+		l->npos = l->len >= opt->maxkmer && longest > 0 ? l->len - opt->maxkmer + 1 : 0;
+		if (l->npos == 0)
+			continue;
+		l->posn = 0;
+		l->window = 0;
+		l->rcwindow = 0;
+		for (int j=0; j<longest-1; j++) {
+			l->window = (l->window << 2) | (l->codes[j] & 3);
+			l->rcwindow = (l->rcwindow >> 2) | ((uint64_t) (3 - (l->codes[j] & 3)) << (2 * (longest - 1)));
+		}
+		l->next_n = l->hit->ambiguous ? next_ambiguous(l->codes, l->len, 0) : l->len;
+		lane_advance(idx, l);
+		// keep the reads that we are still searching at the front
+		if (i != active) {
+			lane_t t = lanes[active];
+			lanes[active] = *l;
+			*l = t;
+		}
+		active++;
+	}
+
+	while (active > 0) {
+		for (int i=0; i<active; ) {
+			lane_t *l = &lanes[i];
+			bool found = false;
+			for (int j=0; j<idx->unique_kmer_count && !found; j++)
+				if (!l->skip[j])
+					found = window_hit(idx, opt, l->seq, l->posn, idx->kmer_lengths[j], l->enc[j], l->rcenc[j], l->hit);
+			if (!found && ++l->posn < l->npos) {
+				lane_advance(idx, l);
+				i++;
+				continue;
+			}
+			// this read is finished, so swap the last one we are searching into its place
+			lanes[i] = lanes[--active];
+		}
+	}
+
+	if (!trunc)
+		return;
+	ncodes = 0;
+	for (int r=first; r<first+width; r++) {
+		if (batch->hits[r].trim < 0)
+			search_trunc(idx, opt, batch->reads[r].seq.s, scratch->codes + ncodes, batch->reads[r].seq.l, &batch->hits[r]);
+		ncodes += batch->reads[r].seq.l;
+	}
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define TRUNC_LANES 8
+
+/*
+ * Look for the short primers in up to TRUNC_LANES reads that are all the same length, one read
+ * in each 32 bit lane of an AVX2 register. The rolling encoding of one read depends on the last
+ * one so we can't do much with one read at a time, but the reads don't depend on each other.
+ * All the reads start and end in the same place, so we step them along together, and gather
+ * the direct address table entries of all of them at once.
+ */
+__attribute__((target("avx2")))
+static void trunc_lanes(primer_index_t *idx, struct options *opt, read_batch_t *batch, int *reads, int n) {
+	int len = batch->reads[reads[0]].seq.l;
+	int start = trunc_start(opt, len);
+	int m = opt->min_adapter_length;
+	int bases = len - start - 1;
+
+	// the codes from start+1 with the lanes next to each other. Empty lanes are all Ns
+	uint8_t codes[READ_CODES * TRUNC_LANES];
+	uint8_t read_codes[READ_CODES];
+	memset(codes, AMBIGUOUS_BASE, bases * TRUNC_LANES);
+	for (int i=0; i<n; i++) {
+		encode_read(batch->reads[reads[i]].seq.s + start + 1, bases, read_codes);
+		for (int j=0; j<bases; j++)
+			codes[j * TRUNC_LANES + i] = read_codes[j];
+	}
+
+	const int *direct = (const int *) (idx->flat + ((const fati_header_t *) idx->flat)->direct_offset);
+	__m256i kmask = _mm256_set1_epi32((1 << (2 * m)) - 1);
+	__m256i three = _mm256_set1_epi32(3);
+	__m256i ambiguous = _mm256_set1_epi32(AMBIGUOUS_BASE);
+	__m256i empty = _mm256_set1_epi32(FATI_EMPTY);
+	__m256i enc = _mm256_setzero_si256();
+	__m256i last_n = _mm256_set1_epi32(-1);
+	for (int j=0; j<m-1; j++) {
+		__m256i c = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *) (codes + j * TRUNC_LANES)));
+		enc = _mm256_or_si256(_mm256_slli_epi32(enc, 2), _mm256_and_si256(c, three));
+		last_n = _mm256_blendv_epi8(last_n, _mm256_set1_epi32(start + 1 + j), _mm256_cmpeq_epi32(c, ambiguous));
+	}
+	int done = (0xFF << n) & 0xFF;
+	for (int posn = start + 1; posn < len - m && done != 0xFF; posn++) {
+		int j = posn + m - 1 - (start + 1);
+		__m256i c = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *) (codes + j * TRUNC_LANES)));
+		enc = _mm256_and_si256(_mm256_or_si256(_mm256_slli_epi32(enc, 2), _mm256_and_si256(c, three)), kmask);
+		last_n = _mm256_blendv_epi8(last_n, _mm256_set1_epi32(posn + m - 1), _mm256_cmpeq_epi32(c, ambiguous));
+		__m256i entry = _mm256_i32gather_epi32(direct, enc, 4);
+		// a hit is an entry that isn't empty, in a window after the last N
+		__m256i ok = _mm256_andnot_si256(_mm256_cmpeq_epi32(entry, empty), _mm256_cmpgt_epi32(_mm256_set1_epi32(posn), last_n));
+		int found = _mm256_movemask_ps(_mm256_castsi256_ps(ok)) & ~done;
+		if (found == 0)
+			continue;
+		uint32_t entries[TRUNC_LANES];
+		uint32_t encs[TRUNC_LANES];
+		_mm256_storeu_si256((__m256i *) entries, entry);
+		_mm256_storeu_si256((__m256i *) encs, enc);
+		for (int i=0; i<n; i++) {
+			if ((found & (1 << i)) == 0)
+				continue;
+			bool partner;
+			const fati_slot_t *slot = direct_slot(idx, entries[i], &partner);
+			trunc_hit(idx, opt, batch->reads[reads[i]].seq.s, posn, m, slot, partner, encs[i], &batch->hits[reads[i]]);
+		}
+		// with opt->last_trunc a later hit replaces this one
+		if (!opt->last_trunc)
+			done |= found;
+	}
+}
+
+/*
+ * Can we look for the short primers with trunc_lanes?
+ */
+static bool use_trunc_lanes(primer_index_t *idx, struct options *opt) {
+	static int avx2 = -1;
+	if (avx2 < 0)
+		avx2 = __builtin_cpu_supports("avx2");
+	return avx2 && opt->min_adapter_length > 0 && ((const fati_header_t *) idx->flat)->direct_k == opt->min_adapter_length;
+}
+
+/*
+ * Look for the short primers in all the reads in the batch that don't have a full length
+ * primer. Our reads are almost always the same length, so we put the reads of the most common
+ * length in lanes, and search any others one at a time.
+ */
+static void search_trunc_lanes(primer_index_t *idx, struct options *opt, read_batch_t *batch) {
+	int *pending = malloc(sizeof(int) * batch->n);
+	if (pending == NULL) {
+		fprintf(stderr, "%sERROR: Can't malloc memory to search a batch of reads%s\n", RED, ENDC);
+		exit(1);
+	}
+	int npending = 0;
+	// the most common length (Boyer-Moore majority vote, which is right if more than half are that length)
+	int common = -1;
+	int votes = 0;
+	for (int r=0; r<batch->n; r++) {
+		int len = batch->reads[r].seq.l;
+		if (batch->hits[r].trim >= 0 || trunc_start(opt, len) < 0)
+			continue;
+		pending[npending++] = r;
+		if (votes == 0)
+			common = len;
+		votes += len == common ? 1 : -1;
+	}
+
+	int lanes[TRUNC_LANES];
+	int n = 0;
+	for (int p=0; p<npending; p++) {
+		int r = pending[p];
+		if (batch->reads[r].seq.l != common || common > READ_CODES) {
+			search_trunc_read(idx, opt, batch->reads[r].seq.s, batch->reads[r].seq.l, &batch->hits[r]);
+			continue;
+		}
+		lanes[n++] = r;
+		if (n == TRUNC_LANES) {
+			trunc_lanes(idx, opt, batch, lanes, n);
+			n = 0;
+		}
+	}
+	if (n)
+		trunc_lanes(idx, opt, batch, lanes, n);
+	free(pending);
+}
+#else
+static bool use_trunc_lanes(primer_index_t *idx, struct options *opt) {
+	return false;
+}
+
+static void search_trunc_lanes(primer_index_t *idx, struct options *opt, read_batch_t *batch) {
+}
+#endif
+
+void search_batch(primer_index_t *idx, struct options *opt, read_batch_t *batch) {
+	// if we can, we leave the short primers until we have searched every read for the full length ones
+	bool lanes = use_trunc_lanes(idx, opt);
+	int width = opt->batch_width;
+	if (width <= 1) {
+		for (int r=0; r<batch->n; r++) {
+			search_one(idx, opt, batch->reads[r].seq.s, batch->reads[r].seq.l, &batch->hits[r], !lanes);
+			end_hits(opt, &batch->reads[r], &batch->hits[r]);
+		}
+	} else {
+		batch_scratch_t scratch = {0};
+		scratch.lanes = malloc(sizeof(lane_t) * width);
+		if (scratch.lanes == NULL) {
+			fprintf(stderr, "%sERROR: Can't malloc memory to search %d reads at a time%s\n", RED, width, ENDC);
+			exit(1);
+		}
+		for (int r=0; r<batch->n; r+=width)
+			search_group(idx, opt, batch, r, r + width <= batch->n ? width : batch->n - r, &scratch, !lanes);
+		free(scratch.lanes);
+		free(scratch.codes);
+	}
+	if (lanes)
+		search_trunc_lanes(idx, opt, batch);
+}
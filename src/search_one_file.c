@@ -1,6 +1,6 @@
-
 /*
  * A fast search that does not compare R1 and R2 but only trims the most 5' adapter sequence for each read.
+ * We still only write a pair if both reads are long enough, so R1 and R2 stay in sync.
  *
  */
 
@@ -11,24 +11,379 @@
 #include <stdbool.h>
 #include <math.h>
 #include <stdint.h>
+#include <unistd.h>
 #include <pthread.h>
 
 #include "colours.h"
-#include "create-snps.h"
 #include "definitions.h"
-#include "hash.h"
-#include "kseq.h"
+#include "demux.h"
+#include "fastq-batch.h"
+#include "primer-index.h"
 #include "primer-match-counts.h"
-#include "primers.h"
-#include "print-sequences.h"
+#include "progress.h"
 #include "rob_dna.h"
 #include "search.h"
-#include "seqs_to_ints.h"
+#include "search-read.h"
+#include "shards.h"
 #include "structs.h"
+#include "trace.h"
+#include "trim-list.h"
 #include "version.h"
 
 
-KSEQ_INIT(gzFile, gzread);
+/*
+ * Where we are in one fastq file. We read and search a batch of reads, decide which
+ * ones are long enough to keep (which for pairs also depends on the mate), and then write them.
+ */
+typedef struct file_search {
+	thread_args_t *t_args;
+	struct options *opt;
+	primer_index_t *idx;
+	primer_counts_t *pc;
+	int tid;
+	char *label;
+	fastq_reader_t *reader;
+	FILE *match_out;
+	shards_t *output;
+	shards_t *discarded;
+	trim_list_t *trims;
+	read_batch_t *batch;
+	int barcodes[READ_BATCH_SIZE]; // the --demux barcode of each read
+	bool keep[READ_BATCH_SIZE];    // is the read (and its mate) long enough to write
+	int *seqs;
+	int *found;
+	int *trimmed;
+	int *poly;
+	int *dimers;
+	int *discarded_count;
+	bool warning_printed;
+	uint64_t written;
+	uint64_t ordinal; // which read this is in the file, to choose the shard
+	int nbatch;
+	uint64_t write_start;
+} file_search_t;
+
+static file_search_t *file_search_open(thread_args_t *t_args, primer_index_t *idx, COUNTS *counts, primer_counts_t *pc, int tid) {
+	char* fqfile = t_args->fqfile;
+	struct options *opt = t_args->opt;
+	bool R1 = t_args->stream == PROGRESS_R1;
+
+	if( access( fqfile, R_OK ) == -1 ) {
+		// file doesn't exist
+		fprintf(stderr, "%sERROR: The file %s can not be found. Please check the file path%s\n", RED, fqfile, ENDC);
+		return NULL;
+	}
+
+	if (opt->verbose)
+		fprintf(stderr, "%sReading %s%s\n", GREEN, fqfile, ENDC);
+
+	file_search_t *fs = calloc(1, sizeof(file_search_t));
+	if (fs == NULL) {
+		fprintf(stderr, "%sERROR: Can't allocate memory to search %s%s\n", RED, fqfile, ENDC);
+		exit(2);
+	}
+	fs->t_args = t_args;
+	fs->opt = opt;
+	fs->idx = idx;
+	fs->pc = pc;
+	fs->tid = tid;
+	fs->label = R1 ? "R1" : "R2";
+	fs->seqs = R1 ? &counts->R1_seqs : &counts->R2_seqs;
+	fs->found = R1 ? &counts->R1_found : &counts->R2_found;
+	fs->trimmed = R1 ? &counts->R1_trimmed : &counts->R2_trimmed;
+	fs->poly = R1 ? &counts->R1_poly : &counts->R2_poly;
+	fs->dimers = R1 ? &counts->R1_dimers : &counts->R2_dimers;
+	fs->discarded_count = R1 ? &counts->R1_discarded : &counts->R2_discarded;
+
+	fs->reader = fastq_open(fqfile);
+	if (fs->reader == NULL) {
+		fprintf(stderr, "%sERROR: Can not open %s%s\n", RED, fqfile, ENDC);
+		exit(3);
+	}
+	fastq_time_inflate(fs->reader, opt->trace != NULL);
+	// the UMIs are at the start of R1, and we search the reads after them
+	if (R1)
+		fastq_umi(fs->reader, opt->umi_pattern);
+
+	if (t_args->matches_file)
+		fs->match_out = fopen(t_args->matches_file, "w");
+
+	// do we need to write the sequences. With --demux each barcode has its own pipe
+	if (t_args->output_file && !opt->demux)
+		fs->output = shards_open(t_args->output_file, opt->shards, opt->shard_reads, opt);
+	if (t_args->discarded_file)
+		fs->discarded = shards_open(t_args->discarded_file, 1, 1, opt);
+	if (t_args->trim_list_file)
+		fs->trims = trim_list_create(t_args->trim_list_file);
+
+	fs->batch = read_batch_init(opt->batch_reads);
+	return fs;
+}
+
+/*
+ * Read and search the next batch of reads, and decide which ones are long enough to keep.
+ * Returns how many reads there are, 0 at the end of the file
+ */
+static int file_search_batch(file_search_t *fs) {
+	struct options *opt = fs->opt;
+	read_batch_t *batch = fs->batch;
+	char name[MAXNAMELEN]; // the name of the primer we found
+
+	uint64_t read_start = trace_now();
+	if (fastq_read_batch(fs->reader, batch) == 0)
+		return 0;
+	uint64_t search_start = trace_now();
+	trace_read_span(opt->trace, fs->tid, read_start, search_start, fastq_inflate_ns(fs->reader), fs->nbatch, batch->n);
+
+	// we take the barcodes off R1 before we search for the adapters. R2 gets the barcodes of
+	// its mates when we pair them up, and goes to unassigned if it doesn't have one
+	if (opt->demux) {
+		for (int r=0; r<batch->n; r++) {
+			if (fs->t_args->stream == PROGRESS_R2) {
+				fs->barcodes[r] = opt->demux->n;
+				continue;
+			}
+			fs->barcodes[r] = demux_read(opt->demux, &batch->reads[r]);
+			opt->demux->reads[fs->barcodes[r]]++;
+		}
+	}
+	search_batch(fs->idx, opt, batch);
+	for (int r=0; r<batch->n; r++) {
+		fastq_record_t *read = &batch->reads[r];
+		search_hit_t *hit = &batch->hits[r];
+		(*fs->seqs)++;
+		if (opt->debug)
+			fprintf(stderr, "Read %s\n", read->name.s);
+
+		// housekeeping warnings. search_batch counts the Ns when it encodes the reads
+		if (opt->verbose && !fs->warning_printed && hit->ambiguous) {
+			fprintf(stderr, "%sWARNING: sequences have an N. We don't look for adapters that overlap them%s\n", BLUE, ENDC);
+			fs->warning_printed = true;
+		}
+
+		if (hit->trim > -1) {
+			(*fs->found)++;
+			count_primer_occurrence(fs->pc, hit_name(hit, name, MAXNAMELEN), hit->before, hit->after);
+		}
+		// the adapter, or where the quality drops or the poly-G/A tail starts if that is first
+		int trim = trim_point(hit);
+		if (trim > -1)
+			(*fs->trimmed)++;
+		if (trim == 0)
+			(*fs->dimers)++;
+		if (hit->poly_trim > -1)
+			(*fs->poly)++;
+		fs->keep[r] = (trim > -1 ? (size_t) trim : read->seq.l) > (size_t) opt->min_sequence_length;
+	}
+	fs->write_start = trace_now();
+	trace_span(opt->trace, fs->tid, "search", search_start, fs->write_start, fs->nbatch, batch->n);
+	return batch->n;
+}
+
+/*
+ * Trim the batch of reads, and write the ones we keep to the output and the others to the discarded file
+ */
+static void file_search_write(file_search_t *fs) {
+	struct options *opt = fs->opt;
+	read_batch_t *batch = fs->batch;
+	char name[MAXNAMELEN];
+
+	for (int r=0; r<batch->n; r++) {
+		fastq_record_t *read = &batch->reads[r];
+		search_hit_t *hit = &batch->hits[r];
+		if (hit->trim > -1 && fs->match_out)
+			fprintf(fs->match_out, "%s\t%s\t%s\t%d\t-%ld\n", fs->label, hit_name(hit, name, MAXNAMELEN), read->name.s, hit->trim, read->seq.l-hit->trim);
+		uint64_t ordinal = fs->ordinal++;
+		int trim = trim_point(hit);
+		if (fs->trims)
+			trim_list_add(fs->trims, read->seq.l, trim, fs->keep[r]);
+		if (trim == 0) {
+			// an adapter dimer: there is nothing left of the read to trim or format
+			(*fs->discarded_count)++;
+			if (fs->discarded)
+				write_empty_fastq_record(shard_out(fs->discarded, 0), read);
+			continue;
+		}
+		if (trim > -1) {
+			if (opt->debug)
+				fprintf(stderr, "Trimming %s to %d\n", read->name.s, trim);
+			trim_fastq_record(read, trim);
+		}
+		if (!fs->keep[r]) {
+			(*fs->discarded_count)++;
+			if (fs->discarded)
+				write_fastq_record(shard_out(fs->discarded, 0), read);
+			continue;
+		}
+		FILE *out = opt->demux ? demux_out(opt->demux, fs->t_args->stream, fs->barcodes[r]) : fs->output ? shard_out(fs->output, ordinal) : NULL;
+		if (out) {
+			write_fastq_record(out, read);
+			fs->written++;
+		}
+	}
+	uint64_t write_end = trace_now();
+	trace_span(opt->trace, fs->tid, "write", fs->write_start, write_end, fs->nbatch, batch->n);
+	progress_update(opt->progress, fs->t_args->stream, *fs->seqs, *fs->trimmed, fs->written, fastq_offset(fs->reader), shards_pipe(fs->output));
+	fs->nbatch++;
+}
+
+static void file_search_close(file_search_t *fs) {
+	read_batch_destroy(fs->batch);
+	fastq_close(fs->reader);
+	if (fs->match_out)
+		fclose(fs->match_out);
+	if (fs->output)
+		shards_close(fs->output);
+	if (fs->discarded)
+		shards_close(fs->discarded);
+	if (fs->trims)
+		trim_list_close(fs->trims);
+	free(fs);
+}
+
+/*
+ * Only keep the reads whose mate (the same read in the other batch) is long enough too. If one
+ * file has more reads, the extra ones don't have a mate.
+ */
+static void keep_pairs(bool *keep, int n, bool *mate_keep, int mate_n) {
+	for (int r=0; r<n && r<mate_n; r++)
+		keep[r] = keep[r] && mate_keep[r];
+}
+
+pair_sync_t *pair_sync_init() {
+	pair_sync_t *s = calloc(1, sizeof(pair_sync_t));
+	if (s == NULL) {
+		fprintf(stderr, "%sERROR: Can't allocate memory to keep the pairs together%s\n", RED, ENDC);
+		exit(2);
+	}
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	return s;
+}
+
+void pair_sync_destroy(pair_sync_t *s) {
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+	free(s);
+}
+
+/*
+ * Give the R2 mates the UMIs that we took from the start of R1, so both reads of a pair have the same name
+ */
+static void copy_umis(read_batch_t *R2, int n, read_batch_t *R1, int R1_n) {
+	for (int r=0; r<n && r<R1_n; r++)
+		fastq_record_umi(&R2->reads[r], R1->reads[r].umi.s);
+}
+
+/*
+ * Swap which reads of the batch are long enough with the thread that is searching the other file,
+ * and pass the UMIs and barcodes from R1 to R2. Each stream has one slot, so we wait until the
+ * other thread has read our last batch before we overwrite it.
+ */
+static void pair_exchange(pair_sync_t *s, file_search_t *fs, int n) {
+	int stream = fs->t_args->stream;
+	int other = 1 - stream;
+	int nbatch = fs->nbatch;
+	bool umis = fs->opt->umi_pattern != NULL;
+	bool demux = fs->opt->demux != NULL;
+	pthread_mutex_lock(&s->lock);
+	while (s->taken[other] < nbatch && !s->done[other])
+		pthread_cond_wait(&s->cond, &s->lock);
+	memcpy(s->keep[stream], fs->keep, sizeof(bool) * n);
+	if (umis && stream == PROGRESS_R1)
+		for (int r=0; r<n; r++)
+			strcpy(s->umi[r], fs->batch->reads[r].umi.s);
+	if (demux && stream == PROGRESS_R1)
+		memcpy(s->barcode, fs->barcodes, sizeof(int) * n);
+	s->n[stream] = n;
+	s->posted[stream] = nbatch + 1;
+	pthread_cond_broadcast(&s->cond);
+	while (s->posted[other] < nbatch + 1 && !s->done[other])
+		pthread_cond_wait(&s->cond, &s->lock);
+	if (s->posted[other] >= nbatch + 1) {
+		keep_pairs(fs->keep, n, s->keep[other], s->n[other]);
+		if (umis && stream == PROGRESS_R2)
+			for (int r=0; r<n && r<s->n[other]; r++)
+				fastq_record_umi(&fs->batch->reads[r], s->umi[r]);
+		if (demux && stream == PROGRESS_R2)
+			memcpy(fs->barcodes, s->barcode, sizeof(int) * (n < s->n[other] ? n : s->n[other]));
+	}
+	s->taken[stream] = nbatch + 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void pair_done(pair_sync_t *s, int stream) {
+	pthread_mutex_lock(&s->lock);
+	s->done[stream] = true;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+void search_file(thread_args_t *t_args, primer_index_t *idx, COUNTS *counts, primer_counts_t *pc, int tid) {
+	/*
+	 * Search one fastq file, t_args->fqfile, and write the trimmed sequences to t_args->output_file.
+	 *
+	 * We read a batch of reads, search them all, and then write them all. The counts for
+	 * this file are added to the R1 or R2 counts depending on t_args->stream. If t_args->sync
+	 * is set another thread is searching the mates, and we only write the pairs that are both long enough
+	 */
+
+	file_search_t *fs = file_search_open(t_args, idx, counts, pc, tid);
+	if (fs == NULL) {
+		if (t_args->sync)
+			pair_done(t_args->sync, t_args->stream);
+		return;
+	}
+	int n;
+	while ((n = file_search_batch(fs)) > 0) {
+		if (t_args->sync)
+			pair_exchange(t_args->sync, fs, n);
+		file_search_write(fs);
+	}
+	if (t_args->sync)
+		pair_done(t_args->sync, t_args->stream);
+	file_search_close(fs);
+}
+
+void search_pair(thread_args_t *R1_args, thread_args_t *R2_args, primer_index_t *idx, COUNTS *counts, primer_counts_t *pc, int tid) {
+	/*
+	 * Search R1 and R2 in one thread, a batch of each at a time, so that we can keep the pairs together
+	 */
+
+	file_search_t *R1 = file_search_open(R1_args, idx, counts, pc, tid);
+	file_search_t *R2 = file_search_open(R2_args, idx, counts, pc, tid);
+	if (R1 == NULL || R2 == NULL) {
+		// we can't pair them up, so just search the one we have
+		if (R1)
+			file_search_close(R1);
+		if (R2)
+			file_search_close(R2);
+		search_file(R1 ? R1_args : R2_args, idx, counts, pc, tid);
+		return;
+	}
+	while (true) {
+		int n1 = file_search_batch(R1);
+		int n2 = file_search_batch(R2);
+		if (n1 == 0 && n2 == 0)
+			break;
+		bool R1_keep[READ_BATCH_SIZE];
+		memcpy(R1_keep, R1->keep, sizeof(bool) * n1);
+		keep_pairs(R1->keep, n1, R2->keep, n2);
+		keep_pairs(R2->keep, n2, R1_keep, n1);
+		if (R1->opt->umi_pattern)
+			copy_umis(R2->batch, n2, R1->batch, n1);
+		if (R1->opt->demux)
+			memcpy(R2->barcodes, R1->barcodes, sizeof(int) * (n2 < n1 ? n2 : n1));
+		// a file we have finished has nothing to write
+		if (n1)
+			file_search_write(R1);
+		if (n2)
+			file_search_write(R2);
+	}
+	file_search_close(R1);
+	file_search_close(R2);
+}
 
 
 void *fast_search_one_file(void *thrargs) {
@@ -45,71 +400,13 @@ void *fast_search_one_file(void *thrargs) {
 	 */	
 
 	thread_args_t *t_args = (thread_args_t *) thrargs;
-	
-	char* fqfile = strdup(t_args->fqfile);
-	char* matchesfile = t_args->matches_file;
-	char* outputfile = t_args->output_file;
 	struct options *opt = t_args->opt;
 	
-	fprintf(stderr, "FAST threaded searching in %s\n", fqfile);
+	fprintf(stderr, "FAST threaded searching in %s\n", t_args->fqfile);
 
 	COUNTS counts = {};
 
-	// create an array of kmer_bsts and malloc them
-	// all_primers is the full length sequences
-	kmer_bst_t *all_primers[opt->maxkmer+1];
-
-	for (int i = 0; i<=opt->maxkmer; i++) {
-		all_primers[i] = malloc(sizeof(kmer_bst_t));
-
-		if (all_primers[i] == NULL) {
-			fprintf(stderr, "Can't malloc memory for all_primers %d\n", i);
-			exit(1);
-		}
-		all_primers[i]->bigger = NULL;
-		all_primers[i]->smaller = NULL;
-		all_primers[i]->value = -1;
-		all_primers[i]->id = "";
-	}
-	
-	// read the primer file for all primers
-	read_primers_create_snps(opt->primers, all_primers, opt->maxkmer, opt->reverse, opt->verbose);
-
-	// trunc_primers is the short sequences that will be searched at the 3' end of the sequence
-	// these sequences are all the same length (default: 6 bp)
-	kmer_bst_t *trunc_primers;
-	trunc_primers = malloc(sizeof(kmer_bst_t));
-	trunc_primers->bigger = NULL;
-	trunc_primers->smaller = NULL;
-	trunc_primers->value = -1;
-	trunc_primers->id = "";
-
-	// read the primer file again and truncate the primers
-	if (opt->min_adapter_length > 0)
-		read_trunc_primers(opt->primers, opt->min_adapter_length, trunc_primers, opt->reverse, opt->verbose);
-
-	if (opt->debug) {	
-		fprintf(stderr, "%sWe have read the primers%s\n", GREEN, ENDC);
-		for (int i = 0; i<=opt->maxkmer; i++)
-			print_all_primers(all_primers[i], i);
-	}
-
-	// A place to store our encdoded kmers
-	// 
-	// First, we make an array with just the lengths of the kmers we need to encode
-	// and then we encode those kmers. This reduces our search from ~30 to ~3
-	// (depending on how many primer lengths we have).
-	// We also do this longer primers to shorter, so that we initially trim off the
-	// longest possible primers
-
-	int kmer_lengths[opt->maxkmer];
-	int unique_kmer_count = 0;
-	for (int i=opt->maxkmer; i>=0; i--) 
-		if (all_primers[i]->value > 0) 
-			kmer_lengths[unique_kmer_count++] = i; 	// we need to remember this kmer length
-
-	// now we just add those kmers to this array and then we test them each time
-	uint64_t encoded_kmers[unique_kmer_count];
+	primer_index_t *idx = opt->index;
 
 	// Initialize a primer count structure
 	primer_counts_t *pc;
@@ -122,151 +419,20 @@ void *fast_search_one_file(void *thrargs) {
 		pc->after[i] = 0;
 	}
 
-	// Step 1. Read the fastq file and find the matches to any primer
-		if( access( fqfile, R_OK ) == -1 ) {
-			// file doesn't exist
-			fprintf(stderr, "%sERROR: The file %s can not be found. Please check the file path%s\n", RED, fqfile, ENDC);
-			return;
-		}
-
-		if (opt->verbose)
-			fprintf(stderr, "%sReading %s%s\n", GREEN, fqfile, ENDC);
+	int tid = t_args->stream == PROGRESS_R1 ? TRACE_R1 : TRACE_R2;
+	trace_thread_name(opt->trace, tid, tid == TRACE_R1 ? "R1 search" : "R2 search");
 
-		gzFile fp1 = gzopen(fqfile, "r");
-		if (fp1 == NULL) {
-			fprintf(stderr, "%sERROR: Can not open %s%s\n", RED, fqfile, ENDC);
-			exit(3);
-		}
-		kseq_t *seq = kseq_init(fp1);
-		int l;
-
-		FILE *match_out = NULL;
-		if (matchesfile)
-			match_out = fopen(matchesfile, "w");
-
-		// do we need to write to R1
-		FILE *pipe = NULL;
-		if (outputfile) {
-			char* pipe_file = malloc(sizeof(char) * (strlen(outputfile) + 10));
-			strcpy(pipe_file, "gzip - > ");
-			strcat(pipe_file, outputfile);
-			pipe = popen(pipe_file, "w");
-			free(pipe_file);
-		}
+	search_file(t_args, idx, &counts, pc, tid);
 
-		bool warning_printed = false;
-
-		while ((l = kseq_read(seq)) >= 0) {
-			counts.R1_seqs++;
-			if (opt->debug)
-				fprintf(stderr, "Reading %s\n", seq->name.s);
-
-			// housekeeping warnings and definitions
-			if (opt->verbose && !warning_printed && has_n(seq->seq.s)) {
-				fprintf(stderr, "%sWARNING: sequences have an N but we don't deal with them. They are encoded as A%s\n", BLUE, ENDC);
-				warning_printed = true;
-			}
-
-			int trim = -1;
-			char *primerid;
-			char before;
-			char after;
-
-			// end housekeeping warnings and definitions
-
-			//  encode the first kmers in the sequence
-			for (int i = 0; i<unique_kmer_count; i++)
-				encoded_kmers[i] = kmer_encoding(seq->seq.s, 0, kmer_lengths[i]);
-
-			// test for the first kmers in our data structure. We need to iterate the 
-			// array of encoded primers and see if we find an encoding in all_primers[k]
-			// for k being the length of the encoding
-			for (int i=0; i<unique_kmer_count; i++) {
-				uint64_t enc  = encoded_kmers[i];
-				kmer_bst_t *ks = find_primer(enc, all_primers[kmer_lengths[i]]);
-				if (ks) {
-					primerid = strdup(ks->id);
-					before = '^';
-					after = seq->seq.s[kmer_lengths[i]+1];
-					trim = 0;
-				} 
-			}
-
-
-			for (int posn=1; posn<seq->seq.l - opt->maxkmer + 1; posn++) {
-				for (int i=0; i<unique_kmer_count; i++) {
-					// calculate the next encoding for this kmer length
-					uint64_t enc  = next_kmer_encoding(seq->seq.s, posn, kmer_lengths[i], encoded_kmers[i]);
-					encoded_kmers[i] = enc; // remember it for next time!
-					kmer_bst_t *ks = find_primer(enc, all_primers[kmer_lengths[i]]);
-					if (ks) {
-						if (trim == -1 || posn < trim) {
-							primerid = strdup(ks->id);
-							before = seq->seq.s[posn-1];
-							after = seq->seq.s[kmer_lengths[i]+1];
-							trim = posn;
-							if (opt->debug)
-								fprintf(stderr, "ID: %s PRIMERID: %s TRIM: %d kmer len: %d kmer seq: %s\n", ks->id, primerid, trim, kmer_lengths[i], kmer_decoding(enc, kmer_lengths[i]));
-						}
-					}
-				}
-			}
-
-			// if we have not trimmed any sequences, we start at length-kmer and 
-			// remove from the first trunc_primer we find
-			if (trim == -1 && opt->min_adapter_length > 0) {
-				// we start a little bit before opt->maxkmer in case there are any frameshifts
-				uint64_t enc  =  kmer_encoding(seq->seq.s, seq->seq.l - opt->maxkmer - 5, opt->min_adapter_length);
-				for (int posn = seq->seq.l - opt->maxkmer - 4; posn < seq->seq.l - opt->min_adapter_length; posn++) {
-					enc  = next_kmer_encoding(seq->seq.s, posn, opt->min_adapter_length, enc);
-					kmer_bst_t *ks = find_primer(enc, trunc_primers);
-					if (ks) {
-						primerid = strdup(ks->id);
-						before = seq->seq.s[posn-1];
-						after = seq->seq.s[opt->min_adapter_length+1];
-						trim = posn;
-						if (opt->debug && strcmp(fqfile, opt->R1_file) == 0)
-							fprintf(stderr, "TRUNC: %s %s ID: %s PRIMERID: %s TRIM: %d kmer len: %d kmer seq: %s\n", fqfile, seq->name.s, ks->id, primerid, trim, opt->min_adapter_length, kmer_decoding(enc, opt->min_adapter_length));
-						break;
-					}
-				}
-			}
-
-
-			if (trim > -1) {
-				counts.R1_found++;
-				if (strlen(primerid) < 5)
-					fprintf(stderr, "ERROR: Trying to store a primer with name >%s< because trim %d!\n", primerid, trim);
-				count_primer_occurrence(pc, primerid, before, after);
-				if (matchesfile)
-					fprintf(match_out, "R1\t%s\t%s\t%d\t-%ld\n", primerid, seq->name.s, trim, seq->seq.l-trim);
-				if (opt->debug)
-					fprintf(stderr, "Trimming %s to %d\n", seq->name.s, trim);
-				seq->seq.s[trim] = '\0';
-				seq->qual.s[trim] = '\0';
-				counts.R1_trimmed++;
-			}
-			if (pipe && strlen(seq->seq.s) > opt->min_sequence_length)
-				fprintf(pipe, "@%s %s\n%s\n+\n%s\n", seq->name.s, seq->comment.s, seq->seq.s, seq->qual.s);
-		}
-
-		// I am going to reset kseq so we have to initiate it again later
-		kseq_destroy(seq);
-		gzclose(fp1);
-
-		if (matchesfile)
-			fclose(match_out);
-
-		if (pipe)
-			pclose(pipe);
-
-	for (int i=0; i<=opt->maxkmer; i++)
-		free(all_primers[i]);
-
-	printf("File name: %s\n", fqfile);
-	printf("Total sequences: %d\n", counts.R1_seqs);
-	printf("Primer found: %d\n", counts.R1_found);
-	printf("Sequences trimmed: %d\n", counts.R1_trimmed);
+	bool R1 = t_args->stream == PROGRESS_R1;
+	printf("File name: %s\n", t_args->fqfile);
+	printf("Total sequences: %d\n", R1 ? counts.R1_seqs : counts.R2_seqs);
+	printf("Primer found: %d\n", R1 ? counts.R1_found : counts.R2_found);
+	printf("Sequences trimmed: %d\n", R1 ? counts.R1_trimmed : counts.R2_trimmed);
+	if (opt->poly_g || opt->poly_a)
+		printf("Poly-G/A tails: %d\n", R1 ? counts.R1_poly : counts.R2_poly);
+	printf("Adapter dimers: %d\n", R1 ? counts.R1_dimers : counts.R2_dimers);
+	printf("Discarded: %d\n", R1 ? counts.R1_discarded : counts.R2_discarded);
 
 
 	printf("\nAdapter occurrences:\n");
@@ -275,4 +441,3 @@ void *fast_search_one_file(void *thrargs) {
 	pthread_exit(NULL);
 	return NULL;
 }
-
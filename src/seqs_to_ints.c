@@ -2,7 +2,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "print-sequences.h"
+#include "seqs_to_ints.h"
 #include "colours.h"
 
 // ALternate DNA encoding lookup table
@@ -10,6 +14,13 @@
 static int dnaEncodeTable [26] = {0, 0, 1, 0, 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 3, 0, 0, 0, 0, 0, 0};
 static int dnaDecodeTable [26] = {65, 67, 71, 84};
 
+// The IUPAC codes as a 2-bit value and the bits of that value that all of its bases share.
+// R (A/G) is ?0, Y (C/T) is ?1, K (G/T) is 1?, and M (A/C) is 0?. We can't do that
+// for S, W, B, D, H, V, N (or X) so they match anything. Other letters are A, like encode_base().
+//                               A  B  C  D  E  F  G  H  I  J  K  L  M  N  O  P  Q  R  S  T  U  V  W  X  Y  Z
+static int iupacValueTable [26] = {0, 0, 1, 0, 0, 0, 2, 0, 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 3, 3, 0, 0, 0, 1, 0};
+static int iupacCareTable  [26] = {3, 0, 3, 0, 3, 3, 3, 0, 3, 3, 2, 3, 2, 0, 3, 3, 3, 1, 0, 3, 3, 0, 0, 0, 1, 3};
+
 
 
 int encode_base(int base) {
@@ -67,6 +78,45 @@ uint64_t kmer_encoding(char * seq, int start_position, int k) {
 	return enc;
 }
 
+int encode_iupac(int base, int *care) {
+	/*
+	 * Convert an IUPAC base to a number, and set care to the bits of that number
+	 * that every base it stands for has. For A, C, G, and T care is 3 (11).
+	 */
+	if ((base >= (int)'a') && (base <= (int)'z'))
+		base -= (int)'a' - (int)'A';
+	if ((base >= (int)'A') && (base <= (int)'Z')) {
+		*care = iupacCareTable[base - (int)'A'];
+		return iupacValueTable[base - (int)'A'];
+	}
+	fprintf(stderr, "We can't encode a base that is not [a-z][A-Z]. We have |%c|\n", (char) base);
+	*care = 0;
+	return 0;
+}
+
+uint64_t kmer_iupac_encoding(char *seq, int start_position, int k, uint64_t *mask) {
+	/*
+	 * Like kmer_encoding, but the sequence may have degenerate bases. mask has the
+	 * bits of the encoding that we need to compare (and the others are 0 in the encoding).
+	 * If the sequence is all A, C, G, and T, mask has all 2k bits set.
+	 */
+
+	if (k > 32) {
+		fprintf(stderr, "%s We can only encode k<=32 strings in 64 bits. Please reduce k %s\n", PINK, ENDC);
+		exit(-1);
+	}
+
+	uint64_t enc = 0;
+	*mask = 0;
+	for (int i=start_position; i < start_position+k; i++) {
+		int care;
+		int val = encode_iupac(seq[i], &care);
+		enc = (enc << 2) + (val & care);
+		*mask = (*mask << 2) + care;
+	}
+	return enc;
+}
+
 char* kmer_decoding(uint64_t enc, int k) {
 	/* 
 	 * convert an encoded string back to a base
@@ -104,7 +154,52 @@ uint64_t next_kmer_encoding(char* seq, int start_position, int k, uint64_t enc)
 	return enc;
 }
 
+/*
+ * The 2-bit code of A, C, G, or T (either case) is bits 1 and 2 of the ASCII xor'd
+ * together: A 0x41 -> 0, C 0x43 -> 1, G 0x47 -> 2, T 0x54 -> 3.
+ */
+static inline uint8_t ascii_code(uint8_t c) {
+	return ((c >> 1) ^ (c >> 2)) & 3;
+}
 
+static inline int is_acgt(uint8_t c) {
+	c &= 0xDF;
+	return c == 'A' || c == 'C' || c == 'G' || c == 'T';
+}
 
-
-
+int encode_read(char *seq, int len, uint8_t *codes) {
+	/*
+	 * Encode every base of the read, once, before we slide along it. A, C, G, and T are
+	 * 0-3 as in encode_base() and anything else (N) is AMBIGUOUS_BASE.
+	 * Returns how many ambiguous bases there are, so we don't need a separate has_n().
+	 */
+	int ambiguous = 0;
+	int i = 0;
+#ifdef __SSE2__
+	// 16 bases at a time
+	const __m128i upper = _mm_set1_epi8((char) 0xDF);
+	const __m128i three = _mm_set1_epi8(3);
+	const __m128i amb = _mm_set1_epi8(AMBIGUOUS_BASE);
+	for (; i + 16 <= len; i += 16) {
+		__m128i c = _mm_loadu_si128((const __m128i *) (seq + i));
+		__m128i u = _mm_and_si128(c, upper);
+		__m128i ok = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(u, _mm_set1_epi8('A')), _mm_cmpeq_epi8(u, _mm_set1_epi8('C'))),
+				_mm_or_si128(_mm_cmpeq_epi8(u, _mm_set1_epi8('G')), _mm_cmpeq_epi8(u, _mm_set1_epi8('T'))));
+		// the bits shifted in from the next byte are above the 2 we keep
+		__m128i code = _mm_and_si128(_mm_xor_si128(_mm_srli_epi16(c, 1), _mm_srli_epi16(c, 2)), three);
+		code = _mm_or_si128(_mm_and_si128(ok, code), _mm_andnot_si128(ok, amb));
+		_mm_storeu_si128((__m128i *) (codes + i), code);
+		ambiguous += __builtin_popcount(~_mm_movemask_epi8(ok) & 0xFFFF);
+	}
+#endif
+	for (; i < len; i++) {
+		uint8_t c = seq[i];
+		if (is_acgt(c)) {
+			codes[i] = ascii_code(c);
+		} else {
+			codes[i] = AMBIGUOUS_BASE;
+			ambiguous++;
+		}
+	}
+	return ambiguous;
+}
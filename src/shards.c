@@ -0,0 +1,51 @@
+/*
+ * Split the trimmed reads into several compressed files
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shards.h"
+
+char *output_name(char *file, char *tag) {
+	char *exts[] = {".fastq.gz", ".fq.gz", ".fastq.bgz", ".fq.bgz", ".fastq.zst", ".fq.zst", ".fastq", ".fq", ".gz", ".bgz", ".zst"};
+	size_t len = strlen(file);
+	size_t stem = len;
+	for (size_t i=0; i<sizeof(exts)/sizeof(exts[0]); i++) {
+		size_t l = strlen(exts[i]);
+		if (len > l && strcmp(file + len - l, exts[i]) == 0) {
+			stem = len - l;
+			break;
+		}
+	}
+	char *name = malloc(len + strlen(tag) + 2);
+	sprintf(name, "%.*s.%s%s", (int) stem, file, tag, file + stem);
+	return name;
+}
+
+shards_t *shards_open(char *file, int n, int chunk, struct options *opt) {
+	shards_t *s = malloc(sizeof(shards_t));
+	s->n = n;
+	s->chunk = chunk;
+	s->out = malloc(sizeof(writer_t *) * n);
+	if (n == 1) {
+		s->out[0] = writer_open(file, opt);
+		return s;
+	}
+	for (int i=0; i<n; i++) {
+		char shard[16];
+		snprintf(shard, sizeof(shard), "%03d", i);
+		char *name = output_name(file, shard);
+		s->out[i] = writer_open(name, opt);
+		free(name);
+	}
+	return s;
+}
+
+void shards_close(shards_t *s) {
+	for (int i=0; i<s->n; i++)
+		writer_close(s->out[i]);
+	free(s->out);
+	free(s);
+}
@@ -3,13 +3,25 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include "arena.h"
+#include "definitions.h"
 #include "structs.h"
 #include "primers.h"
 #include "print-sequences.h"
 #include "seqs_to_ints.h"
 
 
-void add_primer(uint64_t encoding, char* primerid, kmer_bst_t* ks) {
+kmer_bst_t *new_primer_root(arena_t *arena) {
+	kmer_bst_t *ks = arena_alloc(arena, sizeof(kmer_bst_t));
+	ks->bigger = NULL;
+	ks->smaller = NULL;
+	ks->value = -1; // -1 is never a valid encoding, but 0 is AAAAAA
+	ks->name.base = 0;
+	ks->name.snp_posn = -1;
+	return ks;
+}
+
+void add_primer(uint64_t encoding, primer_name_t name, kmer_bst_t* ks, arena_t *arena) {
 	/*
 	 * Add a new integer to the BST. Either at the current location, and
 	 * then set bigger/smaller to be new empty structs
@@ -18,33 +30,20 @@ void add_primer(uint64_t encoding, char* primerid, kmer_bst_t* ks) {
 	 * We use bigger && smaller == NULL to indicate we are at a new
 	 * kmer_bst_t since the value is also not set
 	 */
-	
-	if (!primerid)
-		fprintf(stderr, "ERROR: Trying to add a primer with encoding %ld but no name\n", encoding);
 
-	if (ks->value == encoding) 
-		return; // we have already saved this primer!
-	
-	if (ks->bigger == NULL && ks->smaller == NULL) {
-		ks->value = encoding;
-		ks->id = malloc(strlen(primerid) + 1);
-		strcpy(ks->id, primerid);
-		ks->bigger = (kmer_bst_t *) malloc(sizeof(kmer_bst_t));
-		ks->smaller = (kmer_bst_t *)  malloc(sizeof(kmer_bst_t));
-		ks->bigger->bigger = NULL;
-		ks->bigger->smaller = NULL;
-		ks->smaller->bigger = NULL;
-		ks->smaller->smaller= NULL;
-		ks->bigger->value = -1;
-		ks->smaller->value = -1;
-		ks->bigger->id = "";
-		ks->smaller->id = "";
-		return;
+	while (true) {
+		if (ks->value == encoding)
+			return; // we have already saved this primer!
+
+		if (ks->bigger == NULL && ks->smaller == NULL) {
+			ks->value = encoding;
+			ks->name = name;
+			ks->bigger = new_primer_root(arena);
+			ks->smaller = new_primer_root(arena);
+			return;
+		}
+		ks = encoding > ks->value ? ks->bigger : ks->smaller;
 	}
-	if (encoding > ks->value)
-		return add_primer(encoding, primerid, ks->bigger);
-	
-	return add_primer(encoding, primerid, ks->smaller);
 }
 
 kmer_bst_t* find_primer(uint64_t encoding, kmer_bst_t* ks) {
@@ -64,7 +63,14 @@ kmer_bst_t* find_primer(uint64_t encoding, kmer_bst_t* ks) {
 }
 
 
-void print_all_primers(kmer_bst_t* ks, int kmer) {
+char *format_primer_name(char *base, int snp_posn, char snp_from, char snp_to, char *buf, size_t len) {
+	if (snp_posn < 0)
+		return base;
+	snprintf(buf, len, "%s %d %c->%c", base, snp_posn, snp_from, snp_to);
+	return buf;
+}
+
+void print_all_primers(kmer_bst_t* ks, int kmer, char **names) {
 	/*
 	 * print all the primers in this data structure
 	 * it does this recursively
@@ -76,14 +82,14 @@ void print_all_primers(kmer_bst_t* ks, int kmer) {
 		return;
 
 	if (ks->bigger)
-		print_all_primers(ks->bigger, kmer);
+		print_all_primers(ks->bigger, kmer, names);
+
+	if (ks->value > 0) {
+		char buf[MAXNAMELEN];
+		char *id = format_primer_name(names[ks->name.base], ks->name.snp_posn, ks->name.snp_from, ks->name.snp_to, buf, MAXNAMELEN);
+		printf("%s: %s (%ld)\n", id, kmer_decoding(ks->value, kmer), ks->value);
+	}
 
-	if (ks->value > 0)
-		printf("%s: %s (%ld)\n", ks->id, kmer_decoding(ks->value, kmer), ks->value);
-	
 	if (ks->smaller)
-		print_all_primers(ks->smaller, kmer);
+		print_all_primers(ks->smaller, kmer, names);
 }
-
-
-
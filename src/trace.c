@@ -0,0 +1,95 @@
+/*
+ * Chrome trace-event timeline of the pipeline.
+ *
+ * The events are written as we go (under a mutex, but there are only a handful of events per
+ * batch of reads), and the JSON array is closed in trace_close().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "colours.h"
+#include "trace.h"
+
+uint64_t trace_now(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+trace_t *trace_open(char *filename) {
+	if (filename == NULL)
+		return NULL;
+	trace_t *t = malloc(sizeof(trace_t));
+	if (t == NULL) {
+		fprintf(stderr, "%sERROR: Can't allocate memory for the trace%s\n", RED, ENDC);
+		exit(2);
+	}
+	t->out = fopen(filename, "w");
+	if (t->out == NULL) {
+		fprintf(stderr, "%sERROR: Can not open %s to write the trace%s\n", RED, filename, ENDC);
+		exit(3);
+	}
+	pthread_mutex_init(&t->lock, NULL);
+	t->start = trace_now();
+	t->events = 0;
+	t->pid = getpid();
+	fprintf(t->out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(t->out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"fast-adapter-trimming\"}}", t->pid);
+	t->events++;
+	return t;
+}
+
+void trace_thread_name(trace_t *t, int tid, const char *name) {
+	if (t == NULL)
+		return;
+	pthread_mutex_lock(&t->lock);
+	fprintf(t->out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", t->pid, tid, name);
+	fprintf(t->out, ",\n{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"sort_index\":%d}}", t->pid, tid, tid);
+	t->events += 2;
+	pthread_mutex_unlock(&t->lock);
+}
+
+static void write_span(trace_t *t, int tid, const char *name, uint64_t start, uint64_t end, int batch, int reads) {
+	// the timestamps are in microseconds
+	fprintf(t->out, ",\n{\"name\":\"%s\",\"cat\":\"fat\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"batch\":%d,\"reads\":%d}}",
+			name, t->pid, tid, (start - t->start) / 1000.0, (end - start) / 1000.0, batch, reads);
+	t->events++;
+}
+
+void trace_span(trace_t *t, int tid, const char *name, uint64_t start, uint64_t end, int batch, int reads) {
+	if (t == NULL)
+		return;
+	pthread_mutex_lock(&t->lock);
+	write_span(t, tid, name, start, end, batch, reads);
+	pthread_mutex_unlock(&t->lock);
+}
+
+void trace_read_span(trace_t *t, int tid, uint64_t start, uint64_t end, uint64_t inflate_ns, int batch, int reads) {
+	/*
+	 * gzread is called from inside kseq whenever its buffer runs dry, so inflating and parsing
+	 * are interleaved. We add up the inflate time across the batch and draw it first, followed
+	 * by the parse time, both nested inside the read span.
+	 */
+	if (t == NULL)
+		return;
+	if (inflate_ns > end - start)
+		inflate_ns = end - start;
+	pthread_mutex_lock(&t->lock);
+	write_span(t, tid, "read", start, end, batch, reads);
+	write_span(t, tid, "inflate", start, start + inflate_ns, batch, reads);
+	write_span(t, tid, "parse", start + inflate_ns, end, batch, reads);
+	pthread_mutex_unlock(&t->lock);
+}
+
+void trace_close(trace_t *t) {
+	if (t == NULL)
+		return;
+	fprintf(t->out, "\n]}\n");
+	fclose(t->out);
+	pthread_mutex_destroy(&t->lock);
+	free(t);
+}
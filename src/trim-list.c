@@ -0,0 +1,183 @@
+/*
+ * Write the trim positions instead of the reads, and apply them later. See trim-list.h
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "colours.h"
+#include "fastq-batch.h"
+#include "shards.h"
+#include "trim-list.h"
+#include "writer.h"
+
+static trim_list_t *trim_list_new(char *file, char *mode) {
+	trim_list_t *t = calloc(1, sizeof(trim_list_t));
+	if (t == NULL) {
+		fprintf(stderr, "%sERROR: Can't allocate memory for the trim list %s%s\n", RED, file, ENDC);
+		exit(2);
+	}
+	t->file = strdup(file);
+	t->fp = fopen(file, mode);
+	if (t->fp == NULL) {
+		fprintf(stderr, "%sERROR: Can not open the trim list %s%s\n", RED, file, ENDC);
+		exit(3);
+	}
+	// we read and write it a byte at a time
+	setvbuf(t->fp, NULL, _IOFBF, 1 << 20);
+	return t;
+}
+
+trim_list_t *trim_list_create(char *file) {
+	trim_list_t *t = trim_list_new(file, "wb");
+	fwrite(TRIM_LIST_MAGIC, 1, strlen(TRIM_LIST_MAGIC), t->fp);
+	return t;
+}
+
+void trim_list_add(trim_list_t *t, size_t len, int trim, bool keep) {
+	// in --paired_end mode the mate can move the trim past the end of the read
+	size_t cut = trim > -1 && (size_t) trim < len ? len - trim : 0;
+	uint64_t v = keep && trim != 0 ? cut + 1 : 0;
+	while (v >= 0x80) {
+		putc_unlocked((v & 0x7f) | 0x80, t->fp);
+		v >>= 7;
+	}
+	putc_unlocked(v, t->fp);
+	t->n++;
+}
+
+trim_list_t *trim_list_open(char *file) {
+	trim_list_t *t = trim_list_new(file, "rb");
+	char magic[sizeof(TRIM_LIST_MAGIC)] = {0};
+	if (fread(magic, 1, strlen(TRIM_LIST_MAGIC), t->fp) != strlen(TRIM_LIST_MAGIC) || strcmp(magic, TRIM_LIST_MAGIC) != 0) {
+		fprintf(stderr, "%sERROR: %s is not a trim list from --trim-list%s\n", RED, file, ENDC);
+		exit(3);
+	}
+	return t;
+}
+
+bool trim_list_next(trim_list_t *t, bool *keep, size_t *cut) {
+	uint64_t v = 0;
+	for (int shift = 0; ; shift += 7) {
+		int c = getc_unlocked(t->fp);
+		if (c == EOF) {
+			if (shift == 0)
+				return false;
+			fprintf(stderr, "%sERROR: The trim list %s ends in the middle of a read%s\n", RED, t->file, ENDC);
+			exit(3);
+		}
+		v |= (uint64_t) (c & 0x7f) << shift;
+		if (!(c & 0x80))
+			break;
+	}
+	*keep = v > 0;
+	*cut = v > 0 ? v - 1 : 0;
+	t->n++;
+	return true;
+}
+
+void trim_list_close(trim_list_t *t) {
+	if (fclose(t->fp) != 0) {
+		fprintf(stderr, "%sERROR: Could not write the trim list %s%s\n", RED, t->file, ENDC);
+		exit(3);
+	}
+	free(t->file);
+	free(t);
+}
+
+/*
+ * What each apply thread does, and what it counts
+ */
+typedef struct apply_args {
+	struct options *opt;
+	char *fqfile;
+	char *list_file;
+	char *output_file;
+	uint64_t reads;
+	uint64_t trimmed;
+	uint64_t dropped;
+} apply_args_t;
+
+static void *apply_one_file(void *arg) {
+	apply_args_t *a = (apply_args_t *) arg;
+	fastq_reader_t *reader = fastq_open(a->fqfile);
+	if (reader == NULL) {
+		fprintf(stderr, "%sERROR: Can not open %s%s\n", RED, a->fqfile, ENDC);
+		exit(3);
+	}
+	trim_list_t *t = trim_list_open(a->list_file);
+	writer_t *out = writer_open(a->output_file, a->opt);
+	read_batch_t *batch = read_batch_init(a->opt->batch_reads);
+
+	while (fastq_read_batch(reader, batch) > 0) {
+		for (int r=0; r<batch->n; r++) {
+			fastq_record_t *read = &batch->reads[r];
+			bool keep;
+			size_t cut;
+			if (!trim_list_next(t, &keep, &cut)) {
+				fprintf(stderr, "%sERROR: %s has more reads than the trim list %s (%" PRIu64 "). Is it the same file that we searched?%s\n", RED, a->fqfile, a->list_file, t->n, ENDC);
+				exit(3);
+			}
+			a->reads++;
+			if (!keep) {
+				a->dropped++;
+				continue;
+			}
+			if (cut > read->seq.l) {
+				fprintf(stderr, "%sERROR: The trim list %s cuts %zu bp from %s, but it is only %zu bp. Is it the same file that we searched?%s\n", RED, a->list_file, cut, read->name.s, read->seq.l, ENDC);
+				exit(3);
+			}
+			if (cut > 0) {
+				trim_fastq_record(read, read->seq.l - cut);
+				a->trimmed++;
+			}
+			write_fastq_record(out->fp, read);
+		}
+	}
+	bool keep;
+	size_t cut;
+	if (trim_list_next(t, &keep, &cut)) {
+		fprintf(stderr, "%sERROR: The trim list %s has more reads than %s (%" PRIu64 "). Is it the same file that we searched?%s\n", RED, a->list_file, a->fqfile, a->reads, ENDC);
+		exit(3);
+	}
+	read_batch_destroy(batch);
+	writer_close(out);
+	trim_list_close(t);
+	fastq_close(reader);
+	return NULL;
+}
+
+void apply_trim_lists(struct options *opt) {
+	apply_args_t args[2] = {
+		{opt, opt->R1_file, output_name(opt->trim_list, "R1"), opt->R1_output},
+		{opt, opt->R2_file, output_name(opt->trim_list, "R2"), opt->R2_output},
+	};
+	pthread_t threads[2];
+	for (int i=0; i<2; i++) {
+		if (args[i].fqfile == NULL)
+			continue;
+		if (opt->verbose)
+			fprintf(stderr, "%sTrimming %s with %s%s\n", GREEN, args[i].fqfile, args[i].list_file, ENDC);
+		int result_code = pthread_create(&threads[i], NULL, &apply_one_file, &args[i]);
+		if (result_code) {
+			fprintf(stderr, "%sERROR: Starting thread %d returned the error code %d%s\n", RED, i, result_code, ENDC);
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (int i=0; i<2; i++) {
+		if (args[i].fqfile == NULL)
+			continue;
+		int result_code = pthread_join(threads[i], NULL);
+		if (result_code)
+			fprintf(stderr, "%sERROR: Joining thread %d for it to finish returned the error code %d%s\n", RED, i, result_code, ENDC);
+	}
+
+	printf("Total sequences: R1 %" PRIu64 " R2 %" PRIu64 "\n", args[0].reads, args[1].reads);
+	printf("Sequences trimmed: R1 %" PRIu64 " R2 %" PRIu64 "\n", args[0].trimmed, args[1].trimmed);
+	printf("Discarded: R1 %" PRIu64 " R2 %" PRIu64 "\n", args[0].dropped, args[1].dropped);
+	free(args[0].list_file);
+	free(args[1].list_file);
+}
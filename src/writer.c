@@ -0,0 +1,401 @@
+/*
+ * The output backends. See writer.h
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "colours.h"
+#include "writer.h"
+
+int output_format(char *name) {
+	char *names[] = {"auto", "raw", "gzip", "bgzf", "zstd"};
+	for (int i=0; i<5; i++)
+		if (strcmp(name, names[i]) == 0)
+			return i;
+	return -1;
+}
+
+char *format_extension(int format) {
+	switch (format) {
+		case FORMAT_RAW: return ".fastq";
+		case FORMAT_ZSTD: return ".fastq.zst";
+		default: return ".fastq.gz";
+	}
+}
+
+static bool ends_with(char *s, char *end) {
+	size_t ls = strlen(s), le = strlen(end);
+	return ls >= le && strcmp(s + ls - le, end) == 0;
+}
+
+static int format_from_name(char *file) {
+	if (ends_with(file, ".gz"))
+		return FORMAT_GZIP;
+	if (ends_with(file, ".bgz") || ends_with(file, ".bgzf"))
+		return FORMAT_BGZF;
+	if (ends_with(file, ".zst") || ends_with(file, ".zstd"))
+		return FORMAT_ZSTD;
+	return FORMAT_RAW;
+}
+
+/*
+ * Is program somewhere in the PATH
+ */
+static bool in_path(char *program) {
+	char *path = getenv("PATH");
+	if (path == NULL)
+		return false;
+	char *paths = strdup(path);
+	bool found = false;
+	char buf[4096];
+	for (char *dir = strtok(paths, ":"); dir && !found; dir = strtok(NULL, ":")) {
+		snprintf(buf, sizeof(buf), "%s/%s", dir, program);
+		found = access(buf, X_OK) == 0;
+	}
+	free(paths);
+	return found;
+}
+
+static FILE *open_file(char *file) {
+	FILE *fp = fopen(file, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "%sERROR: Can not write to %s%s\n", RED, file, ENDC);
+		exit(3);
+	}
+	return fp;
+}
+
+/*
+ * gzip: pigz can use more than one thread, but gzip is everywhere
+ */
+static void open_gzip(writer_t *w, char *file, struct options *opt) {
+	char level[8] = "";
+	if (opt->out_level > 0)
+		snprintf(level, sizeof(level), " -%d", opt->out_level);
+	size_t len = strlen(file) + 64;
+	char *pipe_file = malloc(len);
+	if (in_path("pigz"))
+		snprintf(pipe_file, len, "pigz -p %d%s - > %s", opt->out_threads, level, file);
+	else
+		snprintf(pipe_file, len, "gzip%s - > %s", level, file);
+	w->pipe = popen(pipe_file, "w");
+	if (w->pipe == NULL) {
+		fprintf(stderr, "%sERROR: Can not start %s%s\n", RED, pipe_file, ENDC);
+		exit(3);
+	}
+	free(pipe_file);
+	w->fp = w->pipe;
+}
+
+/*
+ * bgzf: we fill one block at a time and hand it to a compression thread. With n threads we have
+ * 2n blocks, and thread t compresses blocks t, t+n, t+2n, ... so each thread always knows which
+ * block is next. They write the blocks in order.
+ */
+
+// the most we put in one block, as bgzip does, so the compressed block always fits in 64 kb
+#define BGZF_BLOCK 0xff00
+#define BGZF_MAX 0x10000
+
+typedef struct bgzf_slot {
+	char in[BGZF_BLOCK];
+	unsigned char out[BGZF_MAX];
+	size_t len;
+	bool full;
+} bgzf_slot_t;
+
+typedef struct bgzf {
+	FILE *file;
+	int level;
+	int nthreads;
+	int nslots;
+	bgzf_slot_t *slots;
+	pthread_t *threads;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint64_t filling;    // the block we are filling
+	uint64_t next_write; // the block we write next
+	bool closing;
+	bool error;
+} bgzf_t;
+
+typedef struct bgzf_worker {
+	bgzf_t *b;
+	int t;
+} bgzf_worker_t;
+
+static const unsigned char bgzf_eof[28] = {
+	0x1f, 0x8b, 0x08, 0x04, 0, 0, 0, 0, 0, 0xff, 0x06, 0, 0x42, 0x43, 0x02, 0, 0x1b, 0, 0x03, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+/*
+ * Compress len bytes of in into a bgzf block in out. Returns the size of the block
+ */
+static size_t bgzf_compress(z_stream *zs, int level, char *in, size_t len, unsigned char *out) {
+	static const unsigned char header[16] = {0x1f, 0x8b, 0x08, 0x04, 0, 0, 0, 0, 0, 0xff, 0x06, 0, 0x42, 0x43, 0x02, 0};
+	memcpy(out, header, 16);
+	// if the data don't compress the block could be too big, so then we store it
+	for (int l = level; ; l = 0) {
+		deflateParams(zs, l, Z_DEFAULT_STRATEGY);
+		deflateReset(zs);
+		zs->next_in = (unsigned char *) in;
+		zs->avail_in = len;
+		zs->next_out = out + 18;
+		zs->avail_out = BGZF_MAX - 18 - 8;
+		if (deflate(zs, Z_FINISH) == Z_STREAM_END || l == 0)
+			break;
+	}
+	size_t size = 18 + zs->total_out + 8;
+	out[16] = (size - 1) & 0xff;
+	out[17] = (size - 1) >> 8;
+	uint32_t crc = crc32(crc32(0, NULL, 0), (unsigned char *) in, len);
+	unsigned char *tail = out + 18 + zs->total_out;
+	for (int i=0; i<4; i++) {
+		tail[i] = (crc >> (8 * i)) & 0xff;
+		tail[4 + i] = (len >> (8 * i)) & 0xff;
+	}
+	return size;
+}
+
+static void *bgzf_thread(void *arg) {
+	bgzf_worker_t *worker = arg;
+	bgzf_t *b = worker->b;
+	z_stream zs = {0};
+	deflateInit2(&zs, b->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+	for (uint64_t block = worker->t; ; block += b->nthreads) {
+		bgzf_slot_t *slot = &b->slots[block % b->nslots];
+		pthread_mutex_lock(&b->lock);
+		while (!slot->full && !(b->closing && b->filling <= block))
+			pthread_cond_wait(&b->cond, &b->lock);
+		if (!slot->full) {
+			pthread_mutex_unlock(&b->lock);
+			break;
+		}
+		pthread_mutex_unlock(&b->lock);
+
+		size_t size = bgzf_compress(&zs, b->level, slot->in, slot->len, slot->out);
+
+		pthread_mutex_lock(&b->lock);
+		while (b->next_write != block)
+			pthread_cond_wait(&b->cond, &b->lock);
+		pthread_mutex_unlock(&b->lock);
+		if (fwrite(slot->out, 1, size, b->file) != size)
+			b->error = true;
+		pthread_mutex_lock(&b->lock);
+		b->next_write++;
+		slot->full = false;
+		slot->len = 0;
+		pthread_cond_broadcast(&b->cond);
+		pthread_mutex_unlock(&b->lock);
+	}
+	deflateEnd(&zs);
+	free(worker);
+	return NULL;
+}
+
+/*
+ * Wait until the block we are filling is free
+ */
+static bgzf_slot_t *bgzf_slot(bgzf_t *b) {
+	bgzf_slot_t *slot = &b->slots[b->filling % b->nslots];
+	if (slot->full) {
+		pthread_mutex_lock(&b->lock);
+		while (slot->full)
+			pthread_cond_wait(&b->cond, &b->lock);
+		pthread_mutex_unlock(&b->lock);
+	}
+	return slot;
+}
+
+static void bgzf_send(bgzf_t *b, bgzf_slot_t *slot) {
+	pthread_mutex_lock(&b->lock);
+	slot->full = true;
+	b->filling++;
+	pthread_cond_broadcast(&b->cond);
+	pthread_mutex_unlock(&b->lock);
+}
+
+static ssize_t bgzf_write(void *cookie, const char *buf, size_t size) {
+	bgzf_t *b = cookie;
+	size_t done = 0;
+	while (done < size) {
+		bgzf_slot_t *slot = bgzf_slot(b);
+		size_t n = BGZF_BLOCK - slot->len;
+		if (n > size - done)
+			n = size - done;
+		memcpy(slot->in + slot->len, buf + done, n);
+		slot->len += n;
+		done += n;
+		if (slot->len == BGZF_BLOCK)
+			bgzf_send(b, slot);
+	}
+	return b->error ? -1 : (ssize_t) size;
+}
+
+static int bgzf_close(void *cookie) {
+	bgzf_t *b = cookie;
+	bgzf_slot_t *slot = bgzf_slot(b);
+	if (slot->len)
+		bgzf_send(b, slot);
+	pthread_mutex_lock(&b->lock);
+	b->closing = true;
+	pthread_cond_broadcast(&b->cond);
+	pthread_mutex_unlock(&b->lock);
+	for (int t=0; t<b->nthreads; t++)
+		pthread_join(b->threads[t], NULL);
+	fwrite(bgzf_eof, 1, sizeof(bgzf_eof), b->file);
+	int ret = fclose(b->file) || b->error ? EOF : 0;
+	pthread_mutex_destroy(&b->lock);
+	pthread_cond_destroy(&b->cond);
+	free(b->slots);
+	free(b->threads);
+	free(b);
+	return ret;
+}
+
+static void open_bgzf(writer_t *w, char *file, struct options *opt) {
+	bgzf_t *b = calloc(1, sizeof(bgzf_t));
+	b->file = open_file(file);
+	b->level = opt->out_level > 0 ? opt->out_level : Z_DEFAULT_COMPRESSION;
+	b->nthreads = opt->out_threads;
+	b->nslots = 2 * b->nthreads;
+	b->slots = calloc(b->nslots, sizeof(bgzf_slot_t));
+	b->threads = malloc(sizeof(pthread_t) * b->nthreads);
+	if (b->slots == NULL || b->threads == NULL) {
+		fprintf(stderr, "%sERROR: Can't allocate memory to write %s%s\n", RED, file, ENDC);
+		exit(2);
+	}
+	pthread_mutex_init(&b->lock, NULL);
+	pthread_cond_init(&b->cond, NULL);
+	for (int t=0; t<b->nthreads; t++) {
+		bgzf_worker_t *worker = malloc(sizeof(bgzf_worker_t));
+		worker->b = b;
+		worker->t = t;
+		pthread_create(&b->threads[t], NULL, bgzf_thread, worker);
+	}
+	cookie_io_functions_t io = {NULL, bgzf_write, NULL, bgzf_close};
+	w->fp = fopencookie(b, "w", io);
+	w->state = b;
+}
+
+#ifdef HAVE_ZSTD
+/*
+ * zstd: libzstd compresses on its own worker threads (ZSTD_c_nbWorkers), so we just stream to it
+ */
+typedef struct zstd_out {
+	FILE *file;
+	ZSTD_CCtx *cctx;
+	size_t size;
+	void *buf;
+	bool error;
+} zstd_out_t;
+
+static void zstd_flush(zstd_out_t *z, ZSTD_inBuffer *in, ZSTD_EndDirective mode) {
+	size_t remaining;
+	do {
+		ZSTD_outBuffer out = {z->buf, z->size, 0};
+		remaining = ZSTD_compressStream2(z->cctx, &out, in, mode);
+		if (ZSTD_isError(remaining)) {
+			fprintf(stderr, "%sERROR: zstd: %s%s\n", RED, ZSTD_getErrorName(remaining), ENDC);
+			z->error = true;
+			return;
+		}
+		if (out.pos && fwrite(z->buf, 1, out.pos, z->file) != out.pos)
+			z->error = true;
+	} while (mode == ZSTD_e_end ? remaining != 0 : in->pos < in->size);
+}
+
+static ssize_t zstd_write(void *cookie, const char *buf, size_t size) {
+	zstd_out_t *z = cookie;
+	ZSTD_inBuffer in = {buf, size, 0};
+	zstd_flush(z, &in, ZSTD_e_continue);
+	return z->error ? -1 : (ssize_t) size;
+}
+
+static int zstd_close(void *cookie) {
+	zstd_out_t *z = cookie;
+	ZSTD_inBuffer in = {NULL, 0, 0};
+	zstd_flush(z, &in, ZSTD_e_end);
+	int ret = fclose(z->file) || z->error ? EOF : 0;
+	ZSTD_freeCCtx(z->cctx);
+	free(z->buf);
+	free(z);
+	return ret;
+}
+
+static void open_zstd(writer_t *w, char *file, struct options *opt) {
+	zstd_out_t *z = calloc(1, sizeof(zstd_out_t));
+	z->file = open_file(file);
+	z->cctx = ZSTD_createCCtx();
+	// a low level by default, because these are usually intermediate files
+	ZSTD_CCtx_setParameter(z->cctx, ZSTD_c_compressionLevel, opt->out_level > 0 ? opt->out_level : 1);
+	// this fails if libzstd was built without threads, and then we compress on this thread
+	ZSTD_CCtx_setParameter(z->cctx, ZSTD_c_nbWorkers, opt->out_threads);
+	z->size = ZSTD_CStreamOutSize();
+	z->buf = malloc(z->size);
+	cookie_io_functions_t io = {NULL, zstd_write, NULL, zstd_close};
+	w->fp = fopencookie(z, "w", io);
+	w->state = z;
+}
+#endif
+
+writer_t *writer_open(char *file, struct options *opt) {
+	writer_t *w = calloc(1, sizeof(writer_t));
+	if (w == NULL) {
+		fprintf(stderr, "%sERROR: Can't allocate memory to write %s%s\n", RED, file, ENDC);
+		exit(2);
+	}
+	w->file = strdup(file);
+	w->format = opt->out_format == FORMAT_AUTO ? format_from_name(file) : opt->out_format;
+	if (opt->out_level > 9 && w->format != FORMAT_ZSTD) {
+		fprintf(stderr, "%sERROR: --out-level only goes up to 9 for %s%s\n", RED, file, ENDC);
+		exit(EXIT_FAILURE);
+	}
+	switch (w->format) {
+		case FORMAT_GZIP:
+			open_gzip(w, file, opt);
+			break;
+		case FORMAT_BGZF:
+			open_bgzf(w, file, opt);
+			break;
+		case FORMAT_ZSTD:
+#ifdef HAVE_ZSTD
+			open_zstd(w, file, opt);
+			break;
+#else
+			fprintf(stderr, "%sERROR: We can't write zstd files (%s). Please rebuild with make ZSTD=1%s\n", RED, file, ENDC);
+			exit(EXIT_FAILURE);
+#endif
+		default:
+			w->fp = open_file(file);
+	}
+	if (w->fp == NULL) {
+		fprintf(stderr, "%sERROR: Can not write to %s%s\n", RED, file, ENDC);
+		exit(3);
+	}
+	// the in process backends only see big writes
+	if (w->pipe == NULL)
+		setvbuf(w->fp, NULL, _IOFBF, 1 << 20);
+	return w;
+}
+
+void writer_close(writer_t *w) {
+	int ret = w->pipe ? pclose(w->pipe) : fclose(w->fp);
+	if (ret != 0) {
+		fprintf(stderr, "%sERROR: Could not write %s (%d)%s\n", RED, w->file, ret, ENDC);
+		exit(3);
+	}
+	free(w->file);
+	free(w);
+}